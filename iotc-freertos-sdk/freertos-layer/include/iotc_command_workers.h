@@ -0,0 +1,98 @@
+/*
+ * iotc_command_workers.h
+ *
+ * Pool of tasks that process cloud-to-device messages.
+ */
+
+#ifndef IOTC_COMMAND_WORKERS_H_
+#define IOTC_COMMAND_WORKERS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "FreeRTOS.h"
+#include "iotc_commands.h"
+
+// @brief	Number of tasks running IOTC_CMD_CONCURRENCY_PARALLEL commands. 0 runs them serially.
+#ifndef IOTC_CMD_PARALLEL_WORKERS
+#define IOTC_CMD_PARALLEL_WORKERS				( 2 )
+#endif
+
+// @brief	Stack size in words of the serial worker, which also runs OTA
+#ifndef IOTC_CMD_SERIAL_WORKER_STACK_SIZE
+#define IOTC_CMD_SERIAL_WORKER_STACK_SIZE		( 2048 )
+#endif
+
+// @brief	Stack size in words of each parallel worker
+#ifndef IOTC_CMD_PARALLEL_WORKER_STACK_SIZE
+#define IOTC_CMD_PARALLEL_WORKER_STACK_SIZE		( 1024 )
+#endif
+
+// @brief	Priority of the worker tasks
+#ifndef IOTC_CMD_WORKER_PRIORITY
+#define IOTC_CMD_WORKER_PRIORITY				( 9 )
+#endif
+
+// @brief	Max messages waiting for the serial worker, and for the parallel workers
+#ifndef IOTC_CMD_WORKER_QUEUE_LENGTH
+#define IOTC_CMD_WORKER_QUEUE_LENGTH			( MQTT_COMMAND_QUEUE_LENGTH )
+#endif
+#ifndef IOTC_CMD_SERIAL_QUEUE_LENGTH
+#define IOTC_CMD_SERIAL_QUEUE_LENGTH			( IOTC_CMD_WORKER_QUEUE_LENGTH )
+#endif
+#ifndef IOTC_CMD_PARALLEL_QUEUE_LENGTH
+#define IOTC_CMD_PARALLEL_QUEUE_LENGTH			( IOTC_CMD_WORKER_QUEUE_LENGTH )
+#endif
+
+// @brief	Ack OTA requests with IOTCL_C2D_EVT_OTA_DOWNLOADING as soon as they are queued,
+// rather than only once the download has finished
+#ifndef IOTC_CMD_OTA_EARLY_ACK
+#define IOTC_CMD_OTA_EARLY_ACK					( 1 )
+#endif
+
+// @brief	What to do with a message that arrives when its worker queue is full.
+// Submission never waits, so the MQTT agent task is not held up by busy workers.
+#define IOTC_CMD_OVERFLOW_DROP_NEWEST			( 0 )	// discard the new message
+#define IOTC_CMD_OVERFLOW_DROP_OLDEST			( 1 )	// discard the oldest waiting message, unless it is an OTA
+#define IOTC_CMD_OVERFLOW_COALESCE				( 2 )	// a new command replaces a waiting identical command,
+														// otherwise the new message is discarded
+
+#ifndef IOTC_CMD_OVERFLOW_POLICY
+#define IOTC_CMD_OVERFLOW_POLICY				IOTC_CMD_OVERFLOW_DROP_NEWEST
+#endif
+
+typedef enum {
+	IOTC_CMD_QUEUE_SERIAL = 0,
+	IOTC_CMD_QUEUE_PARALLEL,
+	IOTC_CMD_QUEUE_COUNT
+} IotcCommandQueueId;
+
+// @brief	Frees a message once it has been processed
+typedef void (*IotcCommandMessageFree)(char *message);
+
+typedef struct {
+	uint32_t jobs;
+	uint32_t rejected;				// messages of this class dropped because a worker queue was full
+	uint32_t queue_time_max_ms;		// time from submission until the message could run, including
+	uint32_t queue_time_total_ms;	// waiting for exclusive commands to finish
+	uint32_t exec_time_max_ms;		// time spent processing the message
+	uint32_t exec_time_total_ms;
+} IotcCommandWorkerStats;
+
+typedef struct {
+	uint32_t submitted;
+	uint32_t dropped_newest;		// new messages discarded because the queue was full
+	uint32_t dropped_oldest;		// waiting messages discarded to make room for a new one
+	uint32_t coalesced;				// waiting commands replaced by an identical new one
+	uint16_t depth;					// messages waiting now
+	uint16_t high_water;			// most messages ever waiting
+	uint16_t capacity;
+} IotcCommandQueueStats;
+
+
+int iotc_command_workers_init(IotcCommandMessageFree free_message);
+int iotc_command_workers_submit(char *message);
+void iotc_command_workers_get_stats(IotcCommandWorkerStats stats[IOTC_CMD_CONCURRENCY_COUNT]);
+void iotc_command_workers_get_queue_stats(IotcCommandQueueStats stats[IOTC_CMD_QUEUE_COUNT]);
+
+#endif /* IOTC_COMMAND_WORKERS_H_ */
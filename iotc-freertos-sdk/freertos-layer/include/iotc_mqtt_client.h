@@ -9,6 +9,10 @@
 #define IOTC_AWSRTOS_SDK_PLACEHOLDER_INCLUDE_IOTC_AWSMQTT_CLIENT_H_
 
 #include "iotconnect.h"
+#include "core_mqtt.h"
+#include "iotc_pool.h"
+#include "iotc_publish_lanes.h"
+#include "iotc_topics.h"
 
 // @brief 	Format of topic string used to subscribe to incoming messages for this device
 #define SUBSCRIBE_TOPIC_FORMAT   "iot/%s/cmd"
@@ -28,8 +32,40 @@
 // @brief 	Size of statically allocated buffers for holding payloads.
 #define MQTT_PAYLOAD_BUFFER_LENGTH           	( 1024 )
 
-// @brief	Max time to wait to queue incoming command on the command queue
-#define MQTT_COMMAND_QUEUE_TIMEOUT_MS      		( 500 )
+// @brief	Size classes of the pool that inbound cloud-to-device messages are copied into.
+// Each message takes a block from the smallest class that holds it and its terminator.
+#ifndef MQTT_C2D_POOL_SMALL_SIZE
+#define MQTT_C2D_POOL_SMALL_SIZE				( 128 )
+#endif
+#ifndef MQTT_C2D_POOL_SMALL_COUNT
+#define MQTT_C2D_POOL_SMALL_COUNT				( MQTT_COMMAND_QUEUE_LENGTH + 2 )
+#endif
+#ifndef MQTT_C2D_POOL_MEDIUM_SIZE
+#define MQTT_C2D_POOL_MEDIUM_SIZE				( 512 )
+#endif
+#ifndef MQTT_C2D_POOL_MEDIUM_COUNT
+#define MQTT_C2D_POOL_MEDIUM_COUNT				( 4 )
+#endif
+#ifndef MQTT_C2D_POOL_LARGE_SIZE
+#define MQTT_C2D_POOL_LARGE_SIZE				( MQTT_PAYLOAD_BUFFER_LENGTH )
+#endif
+#ifndef MQTT_C2D_POOL_LARGE_COUNT
+#define MQTT_C2D_POOL_LARGE_COUNT				( 2 )
+#endif
+
+// @brief	Largest cloud-to-device payload that is delivered. Payloads larger than the biggest
+// pool class and up to this size are copied into an exactly sized heap buffer.
+#ifndef MQTT_C2D_MAX_PAYLOAD_LENGTH
+#define MQTT_C2D_MAX_PAYLOAD_LENGTH				( MQTT_AGENT_NETWORK_BUFFER_SIZE )
+#endif
+
+// @brief	What to do with a cloud-to-device payload longer than MQTT_C2D_MAX_PAYLOAD_LENGTH
+#define MQTT_C2D_OVERSIZE_DROP					( 0 )	// discard the message
+#define MQTT_C2D_OVERSIZE_TRUNCATE				( 1 )	// deliver the first MQTT_C2D_MAX_PAYLOAD_LENGTH bytes
+
+#ifndef MQTT_C2D_OVERSIZE_POLICY
+#define MQTT_C2D_OVERSIZE_POLICY				MQTT_C2D_OVERSIZE_DROP
+#endif
 
 // @brief	Size of statically allocated buffers for holding topic names and payloads.
 #define MQTT_PUBLISH_MAX_LEN                 ( 1024 )
@@ -38,10 +74,75 @@
 #define MQTT_PUBLISH_BLOCK_TIME_MS           ( 200 )
 #define MQTT_PUBLISH_NOTIFICATION_WAIT_MS    ( 1000 )
 #define MQTT_NOTIFY_IDX                      ( 1 )
-#define MQTT_PUBLISH_QOS                     ( MQTTQoS0 )
+#define MQTT_PUBLISH_QOS                     ( MQTTQoS0 )		// default QoS, used for telemetry
+
+// @brief	QoS for command and OTA acknowledgements sent through iotc-c-lib
+#ifndef MQTT_ACK_PUBLISH_QOS
+#define MQTT_ACK_PUBLISH_QOS                 ( MQTTQoS1 )
+#endif
+
+// @brief	Outgoing QoS1 state records left for other users of the MQTT agent connection.
+// The SDK keeps at most MQTT_STATE_ARRAY_MAX_COUNT - MQTT_QOS1_RESERVED_STATES QoS1
+// publishes awaiting PUBACK and makes further QoS1 publishers wait for one to complete.
+#ifndef MQTT_QOS1_RESERVED_STATES
+#define MQTT_QOS1_RESERVED_STATES            ( 2 )
+#endif
+#define MQTT_QOS1_MAX_IN_FLIGHT              ( MQTT_STATE_ARRAY_MAX_COUNT - MQTT_QOS1_RESERVED_STATES )
+
+// @brief	Max number of asynchronous publishes awaiting completion at any time.
+// Each in-flight publish holds one MQTT agent command context, so this must not
+// exceed MQTT_COMMAND_CONTEXTS_POOL_SIZE.
+#ifndef MQTT_PUBLISH_MAX_IN_FLIGHT
+#define MQTT_PUBLISH_MAX_IN_FLIGHT           ( 8 )
+#endif
+
+// @brief	Max time to wait for a free slot in the in-flight window before failing an asynchronous publish
+#ifndef MQTT_PUBLISH_WINDOW_WAIT_MS
+#define MQTT_PUBLISH_WINDOW_WAIT_MS          ( 1000 )
+#endif
+
+// @brief	Number of SDK-owned publish buffers, each MQTT_PUBLISH_MAX_LEN bytes.
+// Buffers are held from iotc_device_client_mqtt_buffer_alloc() until the publish completes.
+#ifndef MQTT_PUBLISH_BUFFER_COUNT
+#define MQTT_PUBLISH_BUFFER_COUNT            ( MQTT_PUBLISH_MAX_IN_FLIGHT + 2 )
+#endif
+
+// @brief	Max time to wait for a free publish buffer
+#ifndef MQTT_PUBLISH_BUFFER_WAIT_MS
+#define MQTT_PUBLISH_BUFFER_WAIT_MS          ( 1000 )
+#endif
+
+// @brief	Publish buffers reserved for the control and ack lanes so acknowledgements are
+// not held up when telemetry has taken every buffer in the shared pool
+#ifndef MQTT_PUBLISH_PRIORITY_BUFFER_COUNT
+#define MQTT_PUBLISH_PRIORITY_BUFFER_COUNT   ( 2 )
+#endif
 
 typedef void (*IotConnectC2dCallback)(char* message, size_t message_len);
 
+// @brief	Called on the MQTT agent task once an asynchronous publish has been sent (QoS0)
+// or acknowledged (QoS1). Must not block.
+typedef void (*IotConnectPublishCallback)(void *context, MQTTStatus_t status);
+
+typedef struct {
+	uint32_t published;				// publishes accepted by the MQTT agent
+	uint32_t failed;				// publishes the MQTT agent rejected or completed with an error
+	uint32_t window_timeouts;		// publishes abandoned because the in-flight window stayed full
+	uint32_t qos1_timeouts;			// QoS1 publishes abandoned because no QoS1 state record freed up
+	uint32_t ack_timeouts;			// blocking publishes given up on before the agent completed them
+	uint16_t in_flight;
+	uint16_t qos1_in_flight;
+	uint16_t qos1_high_water;
+} IotConnectPublishStats;
+
+typedef struct {
+	uint32_t received;				// messages received from the MQTT agent
+	uint32_t heap_allocated;		// messages too large for the pool, copied to an exact size heap buffer
+	uint32_t oversize_dropped;		// messages larger than MQTT_C2D_MAX_PAYLOAD_LENGTH that were discarded
+	uint32_t oversize_truncated;	// messages larger than MQTT_C2D_MAX_PAYLOAD_LENGTH that were cut short
+	uint32_t alloc_failed;			// messages lost because no buffer was available
+} IotConnectC2dStats;
+
 typedef struct {
 	const char *host;    	// Host to connect the client to
 	const char *c2d_topic;
@@ -56,6 +157,20 @@ int iotc_device_client_connect(IotConnectDeviceClientConfig *client_config);
 void iotc_device_client_disconnect(void);
 bool iotc_device_client_is_connected(void);
 void iotc_device_client_mqtt_publish(const char *topic, const char *json_str);
+MQTTStatus_t iotc_device_client_mqtt_publish_topic(IotcTopicId id, const void *payload, size_t len);
+MQTTStatus_t iotc_device_client_mqtt_publish_async(const char *topic, const void *payload, size_t payload_len,
+		MQTTQoS_t qos, IotConnectPublishCallback cb, void *cb_context);
+
+char *iotc_device_client_mqtt_buffer_alloc(size_t *capacity);
+char *iotc_device_client_mqtt_buffer_alloc_for_lane(IotcPublishLane lane, TickType_t wait_ticks, size_t *capacity);
+void iotc_device_client_mqtt_buffer_free(char *buf);
+MQTTStatus_t iotc_device_client_mqtt_publish_buffer(const char *topic, uint16_t topic_len, char *buf, size_t len,
+		MQTTQoS_t qos);
+bool iotc_device_client_mqtt_wait_for_window(TickType_t wait_ticks);
+bool iotc_device_client_mqtt_wait_for_qos1_window(TickType_t wait_ticks);
+void iotc_device_client_mqtt_get_publish_stats(IotConnectPublishStats *stats);
+size_t iotc_device_client_c2d_pool_get_stats(IotcPoolStats *stats, size_t max_stats);
+void iotc_device_client_c2d_get_stats(IotConnectC2dStats *stats);
 
 
 /**
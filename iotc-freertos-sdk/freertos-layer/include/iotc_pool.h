@@ -0,0 +1,72 @@
+/*
+ * iotc_pool.h
+ *
+ * Fixed-block memory pools used for SDK-owned message buffers, and a size-classed
+ * allocator built from several of them.
+ */
+
+#ifndef IOTC_POOL_H_
+#define IOTC_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "FreeRTOS.h"
+#include "semphr.h"
+
+// @brief	Round a block size up so that every block in the pool is 8 byte aligned
+#define IOTC_POOL_BLOCK_ALIGN(size)		((((size) + 7u) / 8u) * 8u)
+
+// @brief	Declare statically allocated storage for a pool of count blocks of block_size bytes
+#define IOTC_POOL_STORAGE(name, block_size, count) \
+	static uint64_t name[((count) * IOTC_POOL_BLOCK_ALIGN(block_size)) / sizeof(uint64_t)]
+
+// @brief	Max number of size classes in an IotcClassPool
+#ifndef IOTC_POOL_MAX_CLASSES
+#define IOTC_POOL_MAX_CLASSES				( 4 )
+#endif
+
+typedef struct IotcPoolBlock {
+	struct IotcPoolBlock *next;
+} IotcPoolBlock;
+
+typedef struct {
+	uint8_t *storage;
+	size_t block_size;				// aligned size of each block
+	size_t block_count;
+	IotcPoolBlock *free_list;
+	SemaphoreHandle_t available;	// counts blocks on free_list
+	size_t in_use;
+	size_t high_water;				// max blocks ever in use at once
+	uint32_t exhausted;				// allocations that failed because the pool was empty
+} IotcPool;
+
+// @brief	Blocks of several sizes. Requests are served from the smallest class that fits.
+typedef struct {
+	IotcPool classes[IOTC_POOL_MAX_CLASSES];	// ascending block size
+	size_t class_count;
+} IotcClassPool;
+
+typedef struct {
+	size_t block_size;
+	size_t block_count;
+	size_t in_use;
+	size_t high_water;
+	uint32_t exhausted;
+} IotcPoolStats;
+
+
+int iotc_pool_init(IotcPool *pool, void *storage, size_t block_size, size_t block_count);
+void *iotc_pool_alloc(IotcPool *pool, TickType_t wait_ticks);
+void iotc_pool_free(IotcPool *pool, void *block);
+bool iotc_pool_owns(const IotcPool *pool, const void *block);
+void iotc_pool_get_stats(const IotcPool *pool, IotcPoolStats *stats);
+
+int iotc_class_pool_add(IotcClassPool *cpool, void *storage, size_t block_size, size_t block_count);
+void *iotc_class_pool_alloc(IotcClassPool *cpool, size_t size, size_t *capacity);
+void iotc_class_pool_free(IotcClassPool *cpool, void *block);
+bool iotc_class_pool_owns(const IotcClassPool *cpool, const void *block);
+size_t iotc_class_pool_get_stats(const IotcClassPool *cpool, IotcPoolStats *stats, size_t max_stats);
+
+#endif /* IOTC_POOL_H_ */
@@ -0,0 +1,89 @@
+/*
+ * iotc_publish_lanes.h
+ *
+ * Prioritised outbound publish lanes feeding the MQTT agent.
+ */
+
+#ifndef IOTC_PUBLISH_LANES_H_
+#define IOTC_PUBLISH_LANES_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "FreeRTOS.h"
+#include "core_mqtt.h"
+
+typedef enum {
+	IOTC_LANE_CONTROL = 0,		// device state and fault messages
+	IOTC_LANE_ACK,				// command and OTA acknowledgements
+	IOTC_LANE_TELEMETRY,
+	IOTC_LANE_BULK,				// deferrable traffic such as the telemetry journal drain
+	IOTC_LANE_COUNT
+} IotcPublishLane;
+
+#define IOTC_LANE_SCHED_STRICT					( 0 )	// always serve the highest priority non-empty lane
+#define IOTC_LANE_SCHED_WEIGHTED				( 1 )	// serve lanes in priority order up to their weight per round
+
+// @brief	How the dispatcher picks the next lane to publish from
+#ifndef IOTC_LANE_SCHEDULING
+#define IOTC_LANE_SCHEDULING					IOTC_LANE_SCHED_STRICT
+#endif
+
+// @brief	Max messages queued per lane
+#ifndef IOTC_LANE_CONTROL_DEPTH
+#define IOTC_LANE_CONTROL_DEPTH					( 4 )
+#endif
+#ifndef IOTC_LANE_ACK_DEPTH
+#define IOTC_LANE_ACK_DEPTH						( 4 )
+#endif
+#ifndef IOTC_LANE_TELEMETRY_DEPTH
+#define IOTC_LANE_TELEMETRY_DEPTH				( 4 )
+#endif
+#ifndef IOTC_LANE_BULK_DEPTH
+#define IOTC_LANE_BULK_DEPTH					( 2 )
+#endif
+
+// @brief	Messages served from each lane per round with IOTC_LANE_SCHED_WEIGHTED
+#ifndef IOTC_LANE_CONTROL_WEIGHT
+#define IOTC_LANE_CONTROL_WEIGHT				( 8 )
+#endif
+#ifndef IOTC_LANE_ACK_WEIGHT
+#define IOTC_LANE_ACK_WEIGHT					( 8 )
+#endif
+#ifndef IOTC_LANE_TELEMETRY_WEIGHT
+#define IOTC_LANE_TELEMETRY_WEIGHT				( 4 )
+#endif
+#ifndef IOTC_LANE_BULK_WEIGHT
+#define IOTC_LANE_BULK_WEIGHT					( 1 )
+#endif
+
+// @brief	How long the dispatcher waits for a QoS1 state record when every queued message is
+// QoS1, before checking the lanes again
+#ifndef IOTC_LANE_QOS1_RETRY_MS
+#define IOTC_LANE_QOS1_RETRY_MS					( 10 )
+#endif
+
+// @brief	Priority of the dispatcher task. Keep it below the MQTT agent task.
+#ifndef IOTC_LANE_TASK_PRIORITY
+#define IOTC_LANE_TASK_PRIORITY					( 9 )
+#endif
+
+typedef struct {
+	uint32_t enqueued;
+	uint32_t sent;					// publishes accepted by the MQTT agent
+	uint32_t failed;				// publishes that could not be started
+	uint32_t dropped;				// messages refused because the lane stayed full
+	uint16_t depth;					// messages currently queued
+	uint16_t max_depth;
+	uint32_t latency_last_ms;		// time from enqueue to hand-off to the MQTT agent
+	uint32_t latency_max_ms;
+	uint32_t latency_total_ms;		// divide by sent + failed for the mean
+} IotcPublishLaneStats;
+
+
+int iotc_publish_lanes_init(void);
+MQTTStatus_t iotc_publish_lane_enqueue(IotcPublishLane lane, const char *topic, uint16_t topic_len,
+		char *buf, size_t len, MQTTQoS_t qos, TickType_t wait_ticks);
+void iotc_publish_lanes_get_stats(IotcPublishLaneStats stats[IOTC_LANE_COUNT]);
+
+#endif /* IOTC_PUBLISH_LANES_H_ */
@@ -0,0 +1,61 @@
+/*
+ * iotc_telemetry_journal.h
+ *
+ * Store-and-forward of telemetry on littlefs while the MQTT connection is down.
+ */
+
+#ifndef IOTC_TELEMETRY_JOURNAL_H_
+#define IOTC_TELEMETRY_JOURNAL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "iotc_topics.h"
+
+// @brief	Directory holding the journal segment files
+#ifndef IOTC_JOURNAL_DIR
+#define IOTC_JOURNAL_DIR						"/iotc_tlm"
+#endif
+
+// @brief	A segment file is closed and a new one started once it reaches this size
+#ifndef IOTC_JOURNAL_SEGMENT_SIZE
+#define IOTC_JOURNAL_SEGMENT_SIZE				( 4096 )
+#endif
+
+// @brief	Retention limit. When full, the oldest segment is deleted to make room.
+#ifndef IOTC_JOURNAL_MAX_SEGMENTS
+#define IOTC_JOURNAL_MAX_SEGMENTS				( 16 )
+#endif
+
+// @brief	Number of appended records between littlefs syncs. Higher values mean fewer
+// metadata commits (less flash wear) but more records lost on a power failure.
+#ifndef IOTC_JOURNAL_SYNC_RECORDS
+#define IOTC_JOURNAL_SYNC_RECORDS				( 8 )
+#endif
+
+// @brief	Minimum time between drained records. 0 drains as fast as the publish window allows.
+#ifndef IOTC_JOURNAL_DRAIN_INTERVAL_MS
+#define IOTC_JOURNAL_DRAIN_INTERVAL_MS			( 0 )
+#endif
+
+// @brief	How often the drain task checks for a connection while idle
+#ifndef IOTC_JOURNAL_IDLE_POLL_MS
+#define IOTC_JOURNAL_IDLE_POLL_MS				( 1000 )
+#endif
+
+typedef struct {
+	uint32_t stored;				// records written to the journal
+	uint32_t drained;				// records read back and published
+	uint32_t dropped_segments;		// segments discarded undrained by retention or damage
+	uint32_t write_errors;
+	uint32_t segments;				// segment files currently held
+} IotcTelemetryJournalStats;
+
+
+int iotc_telemetry_journal_init(IotcTopicId topic);
+bool iotc_telemetry_journal_capture(const void *payload, size_t len);
+bool iotc_telemetry_journal_is_empty(void);
+void iotc_telemetry_journal_get_stats(IotcTelemetryJournalStats *stats);
+
+#endif /* IOTC_TELEMETRY_JOURNAL_H_ */
@@ -0,0 +1,62 @@
+/*
+ * iotc_telemetry_submit.h
+ *
+ * Lock-free submission of telemetry samples from any number of tasks and ISRs to the
+ * one task that sends telemetry.
+ */
+
+#ifndef IOTC_TELEMETRY_SUBMIT_H_
+#define IOTC_TELEMETRY_SUBMIT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+// @brief	Samples the ring holds. A power of two.
+#ifndef IOTC_TELEMETRY_RING_LENGTH
+#define IOTC_TELEMETRY_RING_LENGTH				( 16 )
+#endif
+
+// @brief	Largest sample payload
+#ifndef IOTC_TELEMETRY_SAMPLE_MAX_LEN
+#define IOTC_TELEMETRY_SAMPLE_MAX_LEN			( 32 )
+#endif
+
+// @brief	Task notification index used to wake the receiving task. Must be below
+// configTASK_NOTIFICATION_ARRAY_ENTRIES, which FreeRTOS defaults to 1, so the default
+// index needs FreeRTOSConfig.h to set it to at least 3.
+#ifndef IOTC_TELEMETRY_NOTIFY_IDX
+#define IOTC_TELEMETRY_NOTIFY_IDX				( 2 )
+#endif
+
+typedef struct {
+	uint16_t type;					// chosen by the application to tell its sample layouts apart
+	uint16_t len;
+	TickType_t submitted_at;
+	union {
+		uint64_t align;
+		uint8_t bytes[IOTC_TELEMETRY_SAMPLE_MAX_LEN];
+	} data;
+} IotcTelemetrySample;
+
+typedef struct {
+	uint32_t submitted;
+	uint32_t received;
+	uint32_t dropped_full;			// samples lost because the ring was full
+	uint32_t dropped_too_large;		// samples larger than IOTC_TELEMETRY_SAMPLE_MAX_LEN
+	uint16_t depth;					// samples waiting to be received
+	uint16_t high_water;			// most samples ever waiting
+} IotcTelemetrySubmitStats;
+
+
+int iotc_telemetry_submit_init(TaskHandle_t receiver);
+bool iotc_telemetry_submit(uint16_t type, const void *data, size_t len);
+bool iotc_telemetry_submit_from_isr(uint16_t type, const void *data, size_t len,
+		BaseType_t *higher_priority_task_woken);
+bool iotc_telemetry_receive(IotcTelemetrySample *sample, TickType_t wait_ticks);
+void iotc_telemetry_submit_get_stats(IotcTelemetrySubmitStats *stats);
+
+#endif /* IOTC_TELEMETRY_SUBMIT_H_ */
@@ -0,0 +1,26 @@
+/*
+ * iotc_time.h
+ *
+ * Millisecond wall clock time and ISO-8601 timestamps for telemetry, based on the
+ * SNTP synchronised time() in iotc_time.c.
+ */
+
+#ifndef IOTC_TIME_H_
+#define IOTC_TIME_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// @brief	Length of "2024-01-01T00:00:00.000Z"
+#define IOTC_ISO_TIMESTAMP_LEN					( 24 )
+
+// @brief	Buffer size for iotc_time_format_iso(), with the terminator
+#define IOTC_ISO_TIMESTAMP_BUFFER_LEN			( IOTC_ISO_TIMESTAMP_LEN + 1 )
+
+
+bool iotc_time_get_ms(uint64_t *unix_ms);
+size_t iotc_time_format_iso(char *buf, uint64_t unix_ms);
+
+
+#endif /* IOTC_TIME_H_ */
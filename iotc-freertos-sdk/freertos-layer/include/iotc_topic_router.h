@@ -0,0 +1,53 @@
+/*
+ * iotc_topic_router.h
+ *
+ * Routes incoming MQTT publishes to handlers registered per topic filter.
+ */
+
+#ifndef IOTC_TOPIC_ROUTER_H_
+#define IOTC_TOPIC_ROUTER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "core_mqtt.h"
+#include "mqtt_agent_task.h"
+
+// @brief	Max number of distinct topic filters that can be registered
+#ifndef IOTC_TOPIC_ROUTER_MAX_FILTERS
+#define IOTC_TOPIC_ROUTER_MAX_FILTERS			( 8 )
+#endif
+
+// @brief	Max number of handlers across all filters
+#ifndef IOTC_TOPIC_ROUTER_MAX_HANDLERS
+#define IOTC_TOPIC_ROUTER_MAX_HANDLERS			( 8 )
+#endif
+
+// @brief	Max number of trie nodes, one per distinct topic level across all filters
+#ifndef IOTC_TOPIC_ROUTER_MAX_NODES
+#define IOTC_TOPIC_ROUTER_MAX_NODES				( 32 )
+#endif
+
+// @brief	Bytes reserved for copies of the registered filter strings
+#ifndef IOTC_TOPIC_ROUTER_FILTER_STORAGE
+#define IOTC_TOPIC_ROUTER_FILTER_STORAGE		( 512 )
+#endif
+
+// @brief	Task notification index used to wait for a SUBACK when a subscription's QoS is raised.
+// Must differ from MQTT_NOTIFY_IDX and be below configTASK_NOTIFICATION_ARRAY_ENTRIES, so
+// the default needs that set to at least 4.
+#ifndef IOTC_TOPIC_ROUTER_NOTIFY_IDX
+#define IOTC_TOPIC_ROUTER_NOTIFY_IDX			( 3 )
+#endif
+
+// @brief	Called on the MQTT agent task for each incoming publish matching the filter it was
+// registered with. Must be kept short and must not block.
+typedef void (*IotcTopicHandler)(void *context, MQTTPublishInfo_t *publish_info);
+
+
+int iotc_topic_router_register(const char *filter, MQTTQoS_t qos, IotcTopicHandler handler, void *context);
+MQTTStatus_t iotc_topic_router_subscribe(MQTTAgentHandle_t agent_handle);
+void iotc_topic_router_dispatch(MQTTPublishInfo_t *publish_info);
+
+#endif /* IOTC_TOPIC_ROUTER_H_ */
@@ -0,0 +1,43 @@
+/*
+ * iotc_topics.h
+ *
+ * Registry of the MQTT topics used by the SDK, formatted once after identity.
+ */
+
+#ifndef IOTC_TOPICS_H_
+#define IOTC_TOPICS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "core_mqtt.h"
+#include "iotc_publish_lanes.h"
+
+// @brief	Bytes reserved for the formatted topic strings
+#ifndef IOTC_TOPICS_STORAGE
+#define IOTC_TOPICS_STORAGE						( 512 )
+#endif
+
+typedef enum {
+	IOTC_TOPIC_RPT = 0,				// telemetry reports
+	IOTC_TOPIC_ACK,					// command and OTA acknowledgements
+	IOTC_TOPIC_FLT,					// fault reports
+	IOTC_TOPIC_C2D,					// cloud-to-device subscription
+	IOTC_TOPIC_COUNT
+} IotcTopicId;
+
+typedef struct {
+	const char *name;				// NULL if the topic is not used by this connection type
+	uint16_t len;
+	MQTTQoS_t qos;					// QoS messages on this topic are published with
+	IotcPublishLane lane;			// lane messages on this topic are queued on
+	const char *source;				// iotc-c-lib string the topic was copied from, if any
+} IotcTopic;
+
+
+int iotc_topics_init(bool from_discovery);
+const IotcTopic *iotc_topic_get(IotcTopicId id);
+const IotcTopic *iotc_topic_find(const char *name);
+
+#endif /* IOTC_TOPICS_H_ */
@@ -0,0 +1,649 @@
+/*
+ * iotc_command_workers.c
+ *
+ * Pool of tasks that process cloud-to-device messages.
+ *
+ * Each message is classified when it arrives from a quick scan of its JSON for the
+ * message type and command name.  Commands registered as IOTC_CMD_CONCURRENCY_PARALLEL
+ * go to a queue shared by IOTC_CMD_PARALLEL_WORKERS tasks.  Everything else goes to a
+ * single serial worker, so serial commands run one at a time in the order they arrived.
+ *
+ * Exclusive messages (OTA, and commands registered as exclusive) also run on the serial
+ * worker, in order with serial commands.  Before running, every message takes a token
+ * from a gate that holds one token per worker; an exclusive message takes all of them,
+ * so it waits for running commands to finish and nothing else starts until it is done.
+ *
+ * Commands registered as IOTC_CMD_CONCURRENCY_INLINE skip the workers altogether and
+ * run on the MQTT agent task during submission, without waiting for the gate.
+ *
+ * Commands with the IOTC_CMD_ACK_TWO_PHASE ack policy, and OTA requests, are acked as
+ * accepted as soon as they are queued so the cloud does not wait for them to run.  If such
+ * a message is later discarded to make room for another, it is acked as failed.  A command
+ * replaced by a newer identical one under IOTC_CMD_OVERFLOW_COALESCE is always acked as
+ * failed, as superseded.
+ *
+ * A message whose ack id was seen recently is a redelivery by the broker; it is answered
+ * with the ack sent the first time, see iotc_c2d_check_duplicate(), and not run again.
+ *
+ * Messages are submitted from the MQTT agent task, which must not wait for the workers,
+ * so each queue is a ring that is filled without blocking.  When a ring is full the
+ * IOTC_CMD_OVERFLOW_POLICY decides which message is lost.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+
+#include "iotcl.h"
+#include "iotcl_log.h"
+#include "iotc_mqtt_client.h"
+#include "iotc_c2d.h"
+#include "iotc_commands.h"
+#include "iotc_command_workers.h"
+
+// @brief	Values of the "ct" field of a C2D message
+#define C2D_TYPE_COMMAND		( 0 )
+#define C2D_TYPE_OTA			( 1 )
+
+#define GATE_TOKENS				( IOTC_CMD_PARALLEL_WORKERS + 1 )
+
+#define FNV1A_OFFSET_BASIS		( 2166136261u )
+#define FNV1A_PRIME				( 16777619u )
+
+// @brief	Ack sent when a message is queued
+#define EARLY_ACK_NONE			( 0 )
+#define EARLY_ACK_COMMAND		( 1 )
+#define EARLY_ACK_OTA			( 2 )
+
+typedef struct {
+	char *message;
+	TickType_t submitted_at;
+	IotcCommandConcurrency concurrency;
+	uint32_t command_hash;				// hash of the "cmd" value, 0 if the message is not a command
+	uint8_t early_ack;
+} WorkerJob;
+
+typedef struct {
+	WorkerJob *jobs;
+	uint16_t capacity;
+	uint16_t head;						// oldest waiting job
+	uint16_t count;
+	SemaphoreHandle_t available;		// counts jobs not yet claimed by a worker
+	IotcCommandQueueStats stats;
+} WorkerQueue;
+
+static WorkerJob serial_jobs[IOTC_CMD_SERIAL_QUEUE_LENGTH];
+static WorkerQueue serial_queue = { .jobs = serial_jobs, .capacity = IOTC_CMD_SERIAL_QUEUE_LENGTH };
+
+#if IOTC_CMD_PARALLEL_WORKERS > 0
+static WorkerJob parallel_jobs[IOTC_CMD_PARALLEL_QUEUE_LENGTH];
+static WorkerQueue parallel_queue = { .jobs = parallel_jobs, .capacity = IOTC_CMD_PARALLEL_QUEUE_LENGTH };
+#endif
+
+// @brief	One token per worker. Exclusive messages take them all.
+static SemaphoreHandle_t gate = NULL;
+
+// @brief	Held while taking gate tokens so an exclusive message is not starved by parallel ones
+static SemaphoreHandle_t gate_entry = NULL;
+
+static IotcCommandMessageFree message_free = NULL;
+static IotcCommandWorkerStats worker_stats[IOTC_CMD_CONCURRENCY_COUNT];
+
+
+static void worker_task(void *pvParameters);
+static void process_job(WorkerJob *job);
+static WorkerQueue *queue_for(IotcCommandConcurrency concurrency);
+static int queue_push(WorkerQueue *queue, const WorkerJob *job, WorkerJob *evicted);
+static void queue_pop(WorkerQueue *queue, WorkerJob *job);
+#if IOTC_CMD_OVERFLOW_POLICY == IOTC_CMD_OVERFLOW_COALESCE
+static int queue_find_duplicate(const WorkerQueue *queue, const WorkerJob *job);
+#endif
+static void classify_message(WorkerJob *job);
+static void send_early_ack(uint8_t early_ack, const char *ack_id, bool accepted);
+static void discard_job(const WorkerJob *job);
+#if IOTC_CMD_OVERFLOW_POLICY == IOTC_CMD_OVERFLOW_COALESCE
+static void send_superseded_ack(const WorkerJob *job);
+#endif
+static bool find_ack_id(const char *message, char *ack_id);
+static const char *find_json_value(const char *json, const char *key);
+static size_t json_string_len(const char *str);
+static void gate_enter(IotcCommandConcurrency concurrency);
+static void gate_exit(IotcCommandConcurrency concurrency);
+
+
+/* @brief	Create the worker queues and tasks
+ *
+ * @param	free_message, called to release each message once it has been processed
+ */
+int iotc_command_workers_init(IotcCommandMessageFree free_message)
+{
+	BaseType_t xResult;
+
+	if (serial_queue.available != NULL) {
+		return 0;
+	}
+
+	message_free = free_message;
+
+	serial_queue.available = xSemaphoreCreateCounting(IOTC_CMD_SERIAL_QUEUE_LENGTH, 0);
+	gate = xSemaphoreCreateCounting(GATE_TOKENS, GATE_TOKENS);
+	gate_entry = xSemaphoreCreateMutex();
+	if (serial_queue.available == NULL || gate == NULL || gate_entry == NULL) {
+		IOTCL_ERROR(0, "Failed to create command worker queue");
+		return -1;
+	}
+
+	xResult = xTaskCreate(worker_task, "iotc_cmd", IOTC_CMD_SERIAL_WORKER_STACK_SIZE, (void *) &serial_queue,
+			IOTC_CMD_WORKER_PRIORITY, NULL);
+	if (xResult != pdTRUE) {
+		IOTCL_ERROR(xResult, "Failed to create serial command worker");
+		return -1;
+	}
+
+#if IOTC_CMD_PARALLEL_WORKERS > 0
+	parallel_queue.available = xSemaphoreCreateCounting(IOTC_CMD_PARALLEL_QUEUE_LENGTH, 0);
+	if (parallel_queue.available == NULL) {
+		IOTCL_ERROR(0, "Failed to create parallel command queue");
+		return -1;
+	}
+
+	for (int i = 0; i < IOTC_CMD_PARALLEL_WORKERS; i++) {
+		xResult = xTaskCreate(worker_task, "iotc_cmd_par", IOTC_CMD_PARALLEL_WORKER_STACK_SIZE,
+				(void *) &parallel_queue, IOTC_CMD_WORKER_PRIORITY, NULL);
+		if (xResult != pdTRUE) {
+			IOTCL_ERROR(xResult, "Failed to create parallel command worker");
+			return -1;
+		}
+	}
+#endif
+
+	return 0;
+}
+
+
+/* @brief	Queue a cloud-to-device message for processing without waiting
+ *
+ * @param	message, NUL terminated JSON. On success it is owned by the workers and released
+ *          with the free_message function given to iotc_command_workers_init().
+ *
+ * Returns -1 if the queue was full and the overflow policy dropped this message, in which
+ * case the caller still owns it.  A repeated message is released and 0 is returned.  A waiting message dropped to make room for this one is
+ * released here and is never processed.  It is acked as failed if it had been acked as
+ * accepted, or if a newer identical command replaced it.
+ * An inline command has been run and its message released by the time this returns.
+ */
+int iotc_command_workers_submit(char *message)
+{
+	WorkerJob job = {
+		.message = message,
+		.submitted_at = xTaskGetTickCount(),
+	};
+	WorkerJob evicted = { .message = NULL };
+	char ack_id[IOTC_C2D_ACK_ID_MAX_LEN + 1];
+	bool has_ack_id = find_ack_id(message, ack_id);
+	WorkerQueue *queue;
+	int status;
+
+	if (has_ack_id && iotc_c2d_check_duplicate(ack_id)) {
+		IOTCL_INFO("Ignoring repeated c2d message %s", ack_id);
+		message_free(message);
+		return 0;
+	}
+
+	classify_message(&job);
+	if (job.concurrency == IOTC_CMD_CONCURRENCY_INLINE) {
+		process_job(&job);
+		return 0;
+	}
+
+	queue = queue_for(job.concurrency);
+
+	if (queue->available == NULL) {
+		discard_job(&job);
+		return -1;
+	}
+
+	taskENTER_CRITICAL();
+	status = queue_push(queue, &job, &evicted);
+	if (status != 0) {
+		worker_stats[job.concurrency].rejected++;
+	} else if (evicted.message != NULL) {
+		worker_stats[evicted.concurrency].rejected++;
+	}
+	taskEXIT_CRITICAL();
+
+	if (evicted.message != NULL) {
+#if IOTC_CMD_OVERFLOW_POLICY == IOTC_CMD_OVERFLOW_COALESCE
+		send_superseded_ack(&evicted);
+#else
+		discard_job(&evicted);
+#endif
+		message_free(evicted.message);
+	}
+
+	// Exactly one ack for the new message.  Once queued it may be released by a worker at
+	// any time, so the ack id copied before the push is used.
+	if (status != 0) {
+		discard_job(&job);
+		return status;
+	}
+
+	if (has_ack_id) {
+		send_early_ack(job.early_ack, ack_id, true);
+	}
+	if (evicted.message == NULL) {
+		xSemaphoreGive(queue->available);
+	}
+
+	return status;
+}
+
+
+/* @brief	Get job counts and queue and execution times for each concurrency class
+ */
+void iotc_command_workers_get_stats(IotcCommandWorkerStats stats[IOTC_CMD_CONCURRENCY_COUNT])
+{
+	taskENTER_CRITICAL();
+	memcpy(stats, worker_stats, sizeof(worker_stats));
+	taskEXIT_CRITICAL();
+}
+
+
+/* @brief	Get drop counts and depth of the serial and parallel queues
+ */
+void iotc_command_workers_get_queue_stats(IotcCommandQueueStats stats[IOTC_CMD_QUEUE_COUNT])
+{
+	memset(stats, 0, sizeof(IotcCommandQueueStats) * IOTC_CMD_QUEUE_COUNT);
+
+	taskENTER_CRITICAL();
+	stats[IOTC_CMD_QUEUE_SERIAL] = serial_queue.stats;
+#if IOTC_CMD_PARALLEL_WORKERS > 0
+	stats[IOTC_CMD_QUEUE_PARALLEL] = parallel_queue.stats;
+#endif
+	taskEXIT_CRITICAL();
+}
+
+
+/* @brief	Worker task, processes messages from the queue passed as its parameter
+ */
+static void worker_task(void *pvParameters)
+{
+	WorkerQueue *queue = (WorkerQueue *) pvParameters;
+	WorkerJob job;
+
+	while (1) {
+		if (xSemaphoreTake(queue->available, portMAX_DELAY) != pdTRUE) {
+			continue;
+		}
+
+		taskENTER_CRITICAL();
+		queue_pop(queue, &job);
+		taskEXIT_CRITICAL();
+
+		gate_enter(job.concurrency);
+		process_job(&job);
+		gate_exit(job.concurrency);
+	}
+}
+
+
+/* @brief	Decode and dispatch a message, release it and record how long it waited and ran
+ */
+static void process_job(WorkerJob *job)
+{
+	IotcCommandWorkerStats *stats = &worker_stats[job->concurrency];
+	TickType_t started_at = xTaskGetTickCount();
+	uint32_t queue_ms;
+	uint32_t exec_ms;
+	int status;
+
+	if ((status = iotc_c2d_process(job->message)) != 0) {
+		IOTCL_ERROR(status, "Failed to process c2d message");
+	}
+	exec_ms = (uint32_t) ((xTaskGetTickCount() - started_at) * portTICK_PERIOD_MS);
+	queue_ms = (uint32_t) ((started_at - job->submitted_at) * portTICK_PERIOD_MS);
+
+	message_free(job->message);
+
+	taskENTER_CRITICAL();
+	stats->jobs++;
+	stats->queue_time_total_ms += queue_ms;
+	stats->exec_time_total_ms += exec_ms;
+	if (queue_ms > stats->queue_time_max_ms) {
+		stats->queue_time_max_ms = queue_ms;
+	}
+	if (exec_ms > stats->exec_time_max_ms) {
+		stats->exec_time_max_ms = exec_ms;
+	}
+	taskEXIT_CRITICAL();
+}
+
+
+/* @brief	The queue for messages of a concurrency class
+ */
+static WorkerQueue *queue_for(IotcCommandConcurrency concurrency)
+{
+#if IOTC_CMD_PARALLEL_WORKERS > 0
+	if (concurrency == IOTC_CMD_CONCURRENCY_PARALLEL) {
+		return &parallel_queue;
+	}
+#else
+	(void) concurrency;
+#endif
+
+	return &serial_queue;
+}
+
+
+/* @brief	Add a job to a queue, applying the overflow policy if it is full. Call in a critical section.
+ *
+ * @param	evicted, set to a job that was removed from the queue to make room. Its message must be freed.
+ *
+ * Returns -1 if the job was not added.  When a job replaces another the number of waiting
+ * jobs is unchanged, so the caller only signals the workers when nothing was evicted.
+ */
+static int queue_push(WorkerQueue *queue, const WorkerJob *job, WorkerJob *evicted)
+{
+	IotcCommandQueueStats *stats = &queue->stats;
+
+	stats->capacity = queue->capacity;
+	stats->submitted++;
+
+	if (queue->count < queue->capacity) {
+		queue->jobs[(queue->head + queue->count) % queue->capacity] = *job;
+		queue->count++;
+		stats->depth = queue->count;
+		if (stats->depth > stats->high_water) {
+			stats->high_water = stats->depth;
+		}
+		return 0;
+	}
+
+#if IOTC_CMD_OVERFLOW_POLICY == IOTC_CMD_OVERFLOW_DROP_OLDEST
+	// An OTA request is never discarded in favour of a command
+	if (queue->jobs[queue->head].concurrency != IOTC_CMD_CONCURRENCY_EXCLUSIVE) {
+		*evicted = queue->jobs[queue->head];
+		queue->head = (queue->head + 1) % queue->capacity;
+		queue->jobs[(queue->head + queue->count - 1) % queue->capacity] = *job;
+		stats->dropped_oldest++;
+		return 0;
+	}
+#elif IOTC_CMD_OVERFLOW_POLICY == IOTC_CMD_OVERFLOW_COALESCE
+	{
+		int i = queue_find_duplicate(queue, job);
+
+		// Keep the waiting job's place in the queue but run the newer message, with its
+		// own submission time and ack
+		if (i >= 0) {
+			*evicted = queue->jobs[i];
+			queue->jobs[i] = *job;
+			stats->coalesced++;
+			return 0;
+		}
+	}
+#endif
+
+	stats->dropped_newest++;
+	return -1;
+}
+
+
+/* @brief	Remove the oldest job from a queue. Call in a critical section after taking queue->available.
+ */
+static void queue_pop(WorkerQueue *queue, WorkerJob *job)
+{
+	*job = queue->jobs[queue->head];
+	queue->head = (queue->head + 1) % queue->capacity;
+	queue->count--;
+	queue->stats.depth = queue->count;
+}
+
+
+#if IOTC_CMD_OVERFLOW_POLICY == IOTC_CMD_OVERFLOW_COALESCE
+/* @brief	Find a waiting command with the same "cmd" value as job. Returns its index or -1.
+ */
+static int queue_find_duplicate(const WorkerQueue *queue, const WorkerJob *job)
+{
+	const char *cmd;
+	size_t len;
+
+	if (job->command_hash == 0) {
+		return -1;
+	}
+
+	cmd = find_json_value(job->message, "cmd") + 1;
+	len = json_string_len(cmd);
+
+	for (uint16_t n = 0; n < queue->count; n++) {
+		int i = (queue->head + n) % queue->capacity;
+		const char *other;
+
+		if (queue->jobs[i].command_hash != job->command_hash) {
+			continue;
+		}
+		other = find_json_value(queue->jobs[i].message, "cmd") + 1;
+		if (json_string_len(other) == len && strncmp(other, cmd, len) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+#endif
+
+
+/*
+ *
+ */
+static void gate_enter(IotcCommandConcurrency concurrency)
+{
+	int tokens = (concurrency == IOTC_CMD_CONCURRENCY_EXCLUSIVE) ? GATE_TOKENS : 1;
+
+	xSemaphoreTake(gate_entry, portMAX_DELAY);
+	for (int i = 0; i < tokens; i++) {
+		xSemaphoreTake(gate, portMAX_DELAY);
+	}
+	xSemaphoreGive(gate_entry);
+}
+
+
+/*
+ *
+ */
+static void gate_exit(IotcCommandConcurrency concurrency)
+{
+	int tokens = (concurrency == IOTC_CMD_CONCURRENCY_EXCLUSIVE) ? GATE_TOKENS : 1;
+
+	for (int i = 0; i < tokens; i++) {
+		xSemaphoreGive(gate);
+	}
+}
+
+
+/* @brief	Decide how a message must be run without fully parsing it
+ *
+ * Sets the job's concurrency, the hash of its "cmd" value if it is a command, and the
+ * ack to send when it is queued.
+ *
+ * OTA is always exclusive.  Commands use the concurrency they were registered with.
+ * Anything that cannot be classified runs serially.
+ */
+static void classify_message(WorkerJob *job)
+{
+	char name[IOTC_COMMAND_NAME_MAX_LEN + 1];
+	const IotcCommandDesc *desc;
+	const char *value;
+	uint32_t hash;
+	size_t len;
+
+	job->concurrency = IOTC_CMD_CONCURRENCY_SERIAL;
+	job->command_hash = 0;
+	job->early_ack = EARLY_ACK_NONE;
+
+	value = find_json_value(job->message, "ct");
+	if (value == NULL || !isdigit((unsigned char) *value)) {
+		return;
+	}
+
+	switch (atoi(value)) {
+	case C2D_TYPE_OTA:
+		job->concurrency = IOTC_CMD_CONCURRENCY_EXCLUSIVE;
+		job->early_ack = IOTC_CMD_OTA_EARLY_ACK ? EARLY_ACK_OTA : EARLY_ACK_NONE;
+		break;
+
+	case C2D_TYPE_COMMAND:
+		value = find_json_value(job->message, "cmd");
+		if (value == NULL || *value != '"') {
+			break;
+		}
+		value++;
+
+		hash = FNV1A_OFFSET_BASIS;
+		len = json_string_len(value);
+		for (size_t i = 0; i < len; i++) {
+			hash = (hash ^ (uint8_t) value[i]) * FNV1A_PRIME;
+		}
+		job->command_hash = hash ? hash : 1;
+
+		for (len = 0; len < IOTC_COMMAND_NAME_MAX_LEN && value[len] != '"' && value[len] != ' '
+				&& value[len] != '\\' && value[len] != '\0'; len++) {
+			name[len] = value[len];
+		}
+		name[len] = '\0';
+		desc = iotc_command_find(name, NULL);
+		if (desc) {
+			job->concurrency = desc->concurrency;
+			if (desc->ack_policy == IOTC_CMD_ACK_TWO_PHASE && desc->concurrency != IOTC_CMD_CONCURRENCY_INLINE) {
+				job->early_ack = EARLY_ACK_COMMAND;
+			}
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+
+/* @brief	Ack a message as accepted when it is queued, or as failed if it is discarded
+ */
+static void send_early_ack(uint8_t early_ack, const char *ack_id, bool accepted)
+{
+	if (early_ack == EARLY_ACK_NONE) {
+		return;
+	}
+
+	if (early_ack == EARLY_ACK_OTA) {
+		iotc_c2d_send_ota_ack(ack_id, accepted ? IOTCL_C2D_EVT_OTA_DOWNLOADING : IOTCL_C2D_EVT_OTA_DOWNLOAD_FAILED,
+				accepted ? NULL : "Dropped, device busy");
+	} else {
+		iotc_c2d_send_cmd_ack(ack_id, accepted ? IOTCL_C2D_EVT_CMD_SUCCESS : IOTCL_C2D_EVT_CMD_FAILED,
+				accepted ? "Accepted" : "Dropped, device busy");
+	}
+}
+
+
+/* @brief	Report a message that will not be processed and let a redelivery of it through
+ */
+static void discard_job(const WorkerJob *job)
+{
+	char ack_id[IOTC_C2D_ACK_ID_MAX_LEN + 1];
+
+	if (find_ack_id(job->message, ack_id)) {
+		send_early_ack(job->early_ack, ack_id, false);
+		iotc_c2d_forget(ack_id);
+	}
+}
+
+
+#if IOTC_CMD_OVERFLOW_POLICY == IOTC_CMD_OVERFLOW_COALESCE
+/* @brief	Ack a waiting command as failed because a newer identical command replaced it
+ *
+ * The ack is remembered, so a redelivery of the replaced command gets the same answer.
+ */
+static void send_superseded_ack(const WorkerJob *job)
+{
+	char ack_id[IOTC_C2D_ACK_ID_MAX_LEN + 1];
+
+	if (find_ack_id(job->message, ack_id)) {
+		iotc_c2d_send_cmd_ack(ack_id, IOTCL_C2D_EVT_CMD_FAILED, "Superseded by a newer command");
+	}
+}
+#endif
+
+
+/* @brief	Copy the "ack" value of a message into ack_id, which holds IOTC_C2D_ACK_ID_MAX_LEN + 1 bytes
+ *
+ * Returns false if the message has no ack id or it is too long.
+ */
+static bool find_ack_id(const char *message, char *ack_id)
+{
+	const char *value = find_json_value(message, "ack");
+	size_t len;
+
+	if (value == NULL || *value != '"') {
+		return false;
+	}
+	value++;
+	len = json_string_len(value);
+	if (len == 0 || len > IOTC_C2D_ACK_ID_MAX_LEN) {
+		return false;
+	}
+	memcpy(ack_id, value, len);
+	ack_id[len] = '\0';
+
+	return true;
+}
+
+
+/* @brief	Find the value of a top level "key": in a JSON object
+ *
+ * Returns a pointer to the first character of the value, or NULL.  This is only good
+ * enough for classification; the message is parsed properly when it is processed.
+ */
+static const char *find_json_value(const char *json, const char *key)
+{
+	size_t key_len = strlen(key);
+	const char *p = json;
+
+	while ((p = strchr(p, '"')) != NULL) {
+		p++;
+		if (strncmp(p, key, key_len) == 0 && p[key_len] == '"') {
+			const char *v = p + key_len + 1;
+
+			while (*v == ' ' || *v == '\t' || *v == '\r' || *v == '\n') {
+				v++;
+			}
+			if (*v == ':') {
+				v++;
+				while (*v == ' ' || *v == '\t' || *v == '\r' || *v == '\n') {
+					v++;
+				}
+				return v;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+
+/* @brief	Length of a JSON string value up to its closing quote, without unescaping
+ */
+static size_t json_string_len(const char *str)
+{
+	size_t len = 0;
+
+	while (str[len] != '"' && str[len] != '\0') {
+		if (str[len] == '\\' && str[len + 1] != '\0') {
+			len++;
+		}
+		len++;
+	}
+
+	return len;
+}
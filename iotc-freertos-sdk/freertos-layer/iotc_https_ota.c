@@ -291,6 +291,8 @@ int iotc_ota_fw_apply(void) {
 #include "core_mqtt_agent.h"
 #include "subscription_manager.h"
 #include "mqtt_agent_task.h"
+#include "iotc_topic_router.h"
+#include "iotc_topics.h"
 
 /*
 AWS S3 does not have an official limit for the length of a presigned URL. However, some have encountered a presigned URL for an S3 object that was 1669 characters long, which is close to the unofficial URL length limit of 2 KB.
@@ -361,13 +363,11 @@ static void on_c2d_message( void * subscription_context, MQTTPublishInfo_t * pub
  */
 static bool subscribe_to_c2d_topic(void)
 {
-    char device_id[DEVICE_ID_MAX_LEN];
-    char sub_topic[TOPIC_STR_MAX_LEN];
-    if (KVStore_getString(CS_CORE_THING_NAME, device_id, DEVICE_ID_MAX_LEN) <= 0) {
-	    IOTCL_ERROR(0, "Unable to get device ID");
+    const IotcTopic *c2d_topic = iotc_topic_get(IOTC_TOPIC_C2D);
+    if (c2d_topic == NULL) {
+	    IOTCL_ERROR(0, "Unable to get c2d topic");
 	    return false;
 	}
-    sprintf(sub_topic, "iot/%s/cmd", device_id);
 
     MQTTAgentHandle_t agent_handle = xGetMqttAgentHandle();
     if (agent_handle == NULL )  {
@@ -375,18 +375,18 @@ static bool subscribe_to_c2d_topic(void)
 	    return false;
     }
 
-    MQTTStatus_t mqtt_status = MqttAgent_SubscribeSync( agent_handle,
-		sub_topic,
-		1 /* qos */,
-		on_c2d_message,
-		NULL
-    );
+    // Shares the c2d subscription made at connect if the topics are the same
+    if (iotc_topic_router_register(c2d_topic->name, MQTTQoS1, on_c2d_message, NULL) != 0) {
+        return false;
+    }
+
+    MQTTStatus_t mqtt_status = iotc_topic_router_subscribe(agent_handle);
     if (MQTTSuccess != mqtt_status) {
         IOTCL_ERROR(mqtt_status, "Failed to SUBSCRIBE to topic");
         return false;
     }
 
-    IOTCL_INFO("Subscribed to c2d topic %s", sub_topic);
+    IOTCL_INFO("Subscribed to c2d topic %s", c2d_topic->name);
 
     return true;
 }
@@ -16,6 +16,7 @@
 #include "FreeRTOS.h"
 #include "task.h"
 #include "queue.h"
+#include "semphr.h"
 
 #include "mbedtls_transport.h"
 
@@ -34,6 +35,9 @@
 #include "iotcl_log.h"
 #include "iotcl_util.h"
 #include <iotc_mqtt_client.h>
+#include "iotc_topic_router.h"
+#include "iotc_topics.h"
+#include "iotc_command_workers.h"
 #include "sys_evt.h"
 
 // @brief 	Defines the structure to use as the command callback context in this demo.
@@ -45,27 +49,81 @@ struct MQTTAgentCommandContext
 };
 
 
+// @brief	State of an asynchronous publish, held until the MQTT agent completes the command.
+// The agent keeps a pointer to publish_info so it must outlive the MQTTAgent_Publish() call.
+typedef struct {
+    MQTTPublishInfo_t publish_info;
+    IotConnectPublishCallback cb;
+    void *cb_context;
+    bool in_use;
+} PublishSlot;
+
+#if defined(MQTT_COMMAND_CONTEXTS_POOL_SIZE) && (MQTT_PUBLISH_MAX_IN_FLIGHT > MQTT_COMMAND_CONTEXTS_POOL_SIZE)
+#error "MQTT_PUBLISH_MAX_IN_FLIGHT must not exceed MQTT_COMMAND_CONTEXTS_POOL_SIZE"
+#endif
+
+#if (MQTT_QOS1_MAX_IN_FLIGHT < 1)
+#error "MQTT_QOS1_RESERVED_STATES leaves no QoS1 state records for the SDK"
+#endif
+
+
 // @brief 	The MQTT agent manages the MQTT contexts.  This set the handle to the context used by this demo.
 extern MQTTAgentContext_t xGlobalMqttAgentContext;
 
 // @beief Handle to MQTT agent
 static MQTTAgentHandle_t xMQTTAgentHandle = NULL;
 
-// @brief 	Handle to message queue of acknowledgements offloaded onto vMQTTSubscribeTask.
-static QueueHandle_t mqtt_command_queue = NULL;
+// @brief	The task running the MQTT agent, which also runs inline command handlers
+static TaskHandle_t agent_task = NULL;
+
+// @brief	In-flight window for asynchronous publishes. Counts free slots in publish_slots.
+static SemaphoreHandle_t publish_window = NULL;
+static PublishSlot publish_slots[MQTT_PUBLISH_MAX_IN_FLIGHT];
+
+// @brief	Counts free outgoing QoS1 state records available to the SDK
+static SemaphoreHandle_t qos1_window = NULL;
+
+static IotConnectPublishStats publish_stats;
+
+// @brief	SDK-owned publish buffers handed to the MQTT agent until the publish completes
+IOTC_POOL_STORAGE(publish_buffer_storage, MQTT_PUBLISH_MAX_LEN, MQTT_PUBLISH_BUFFER_COUNT);
+static IotcPool publish_buffer_pool;
+
+// @brief	Publish buffers only handed out to the control and ack lanes
+IOTC_POOL_STORAGE(priority_buffer_storage, MQTT_PUBLISH_MAX_LEN, MQTT_PUBLISH_PRIORITY_BUFFER_COUNT);
+static IotcPool priority_buffer_pool;
+
+// @brief	Size-classed pool for inbound cloud-to-device messages, allocated on the MQTT agent task
+IOTC_POOL_STORAGE(c2d_small_storage, MQTT_C2D_POOL_SMALL_SIZE, MQTT_C2D_POOL_SMALL_COUNT);
+IOTC_POOL_STORAGE(c2d_medium_storage, MQTT_C2D_POOL_MEDIUM_SIZE, MQTT_C2D_POOL_MEDIUM_COUNT);
+IOTC_POOL_STORAGE(c2d_large_storage, MQTT_C2D_POOL_LARGE_SIZE, MQTT_C2D_POOL_LARGE_COUNT);
+static IotcClassPool c2d_pool;
+
+static IotConnectC2dStats c2d_stats;
 
 
 // Prototypes
-static void mqtt_command_task(void *pvParameters);
-static void publish_complete_callback(MQTTAgentCommandContext_t * pxCommandContext,
-                                      MQTTAgentReturnInfo_t * pxReturnInfo);
-static BaseType_t publish_and_wait_for_ack(MQTTAgentHandle_t xAgentHandle,
-                                           const char * pcTopic,
-                                           const void * pvPublishData,
-                                           size_t xPublishDataLen);
-static MQTTStatus_t subscribe_to_topic(MQTTQoS_t xQoS,
-		const char *pcTopicFilter);
+static void publish_wait_callback(void *context, MQTTStatus_t status);
+static void publish_async_complete_callback(MQTTAgentCommandContext_t * pxCommandContext,
+                                            MQTTAgentReturnInfo_t * pxReturnInfo);
+static void publish_buffer_complete_callback(void *context, MQTTStatus_t status);
+static void publish_copy_complete_callback(void *context, MQTTStatus_t status);
+static PublishSlot *publish_slot_acquire(void);
+static void publish_slot_release(PublishSlot *slot);
+static bool qos1_state_acquire(void);
+static void qos1_state_release(void);
+static MQTTStatus_t publish_to_topic(const IotcTopic *topic, const void *payload, size_t len);
+static MQTTStatus_t publish_async_len(const char *topic, uint16_t topic_len, const void *payload,
+		size_t payload_len, MQTTQoS_t qos, IotConnectPublishCallback cb, void *cb_context, PublishSlot **started);
+static MQTTStatus_t publish_and_wait_for_ack(const char * pcTopic,
+                                             uint16_t usTopicLen,
+                                             const void * pvPublishData,
+                                             size_t xPublishDataLen,
+                                             MQTTQoS_t xQoS);
 static void incoming_message_callback(void *pvIncomingPublishCallbackContext, MQTTPublishInfo_t *pxPublishInfo);
+static bool on_agent_task(void);
+static char *c2d_message_alloc(size_t len);
+static void c2d_message_free(char *message);
 
 
 /* @brief	Initialize the MQTT client and associated tasks for publishing and receiving commands
@@ -92,16 +150,51 @@ int iotc_device_client_connect(IotConnectDeviceClientConfig *c) {
 	}
 
 	xResult = xTaskCreate(vMQTTAgentTask, "MQTTAgent", 4096, (void*) c, 10,
-			NULL);
+			&agent_task);
     
 	if (xResult != pdTRUE) {
 		IOTCL_ERROR(xResult, "Failed to create MQTT Agent task");
 		return -1;
 	}
 
-	mqtt_command_queue = xQueueCreate(MQTT_COMMAND_QUEUE_LENGTH, sizeof(char*));
-	if (mqtt_command_queue == NULL) {
-		IOTCL_ERROR(0, "Failed to create Ack message queue");
+	// Workers must be running before subscribing, messages can arrive straight away
+	if (iotc_command_workers_init(c2d_message_free) != 0) {
+		return -1;
+	}
+
+	publish_window = xSemaphoreCreateCounting(MQTT_PUBLISH_MAX_IN_FLIGHT, MQTT_PUBLISH_MAX_IN_FLIGHT);
+	if (publish_window == NULL) {
+		IOTCL_ERROR(0, "Failed to create publish window semaphore");
+		return -1;
+	}
+
+	qos1_window = xSemaphoreCreateCounting(MQTT_QOS1_MAX_IN_FLIGHT, MQTT_QOS1_MAX_IN_FLIGHT);
+	if (qos1_window == NULL) {
+		IOTCL_ERROR(0, "Failed to create QoS1 window semaphore");
+		return -1;
+	}
+
+	if (iotc_pool_init(&publish_buffer_pool, publish_buffer_storage, MQTT_PUBLISH_MAX_LEN,
+			MQTT_PUBLISH_BUFFER_COUNT) != 0) {
+		IOTCL_ERROR(0, "Failed to create publish buffer pool");
+		return -1;
+	}
+
+	if (iotc_pool_init(&priority_buffer_pool, priority_buffer_storage, MQTT_PUBLISH_MAX_LEN,
+			MQTT_PUBLISH_PRIORITY_BUFFER_COUNT) != 0) {
+		IOTCL_ERROR(0, "Failed to create priority publish buffer pool");
+		return -1;
+	}
+
+	if (iotc_publish_lanes_init() != 0) {
+		return -1;
+	}
+
+	memset(&c2d_pool, 0, sizeof(c2d_pool));
+	if (iotc_class_pool_add(&c2d_pool, c2d_small_storage, MQTT_C2D_POOL_SMALL_SIZE, MQTT_C2D_POOL_SMALL_COUNT) != 0 ||
+			iotc_class_pool_add(&c2d_pool, c2d_medium_storage, MQTT_C2D_POOL_MEDIUM_SIZE, MQTT_C2D_POOL_MEDIUM_COUNT) != 0 ||
+			iotc_class_pool_add(&c2d_pool, c2d_large_storage, MQTT_C2D_POOL_LARGE_SIZE, MQTT_C2D_POOL_LARGE_COUNT) != 0) {
+		IOTCL_ERROR(0, "Failed to create c2d message pool");
 		return -1;
 	}
 
@@ -111,21 +204,17 @@ int iotc_device_client_connect(IotConnectDeviceClientConfig *c) {
     vSleepUntilMQTTAgentConnected();
 
 
-	xMQTTStatus = subscribe_to_topic(MQTTQoS1, c->c2d_topic);// Deliver at least once
+	if (iotc_topic_router_register(c->c2d_topic, MQTTQoS1, incoming_message_callback, NULL) != 0) {// Deliver at least once
+		return -1;
+	}
+
+	xMQTTStatus = iotc_topic_router_subscribe(xMQTTAgentHandle);
 
 	if( xMQTTStatus != MQTTSuccess ) {
 		IOTCL_ERROR(xMQTTStatus, "Failed to subscribe to topic: %s.", c->c2d_topic);
 		return -1;
 	}
 
-	xResult = xTaskCreate(mqtt_command_task, "mqtt_cmd", 2048, NULL, 9,
-			NULL);
-
-    if (xResult != pdTRUE ) {
-		IOTCL_ERROR(xResult, "Failed to create iotc_pub_events_task");
-    	return -1;
-    }
-    
 	return 0;
 }
 
@@ -156,195 +245,605 @@ bool iotc_device_client_is_connected(void)
  * @param   topic, MQTT topic to publish to
  * @param	json_str, JSON formatted string to publish on this topic.
  *
- * This publishes a message and waits for an acknowledgement.  This can be
- * called to send telemetry from any task. It should not be called from
+ * This is the send callback used by iotc-c-lib, which frees json_str on return.  The
+ * topic is looked up in the topic registry to find its length, QoS and publish lane, then
+ * the message is published as iotc_device_client_mqtt_publish_topic() does.  Topics that
+ * are not registered go on the control lane with MQTT_PUBLISH_QOS.
+ *
+ * This can be called to send telemetry from any task. It should not be called from
  * code running on the MQTT Agent Task such as the incoming_message_callback.
  * in order to avoid blocking the MQTT Agent Task and potentially causing a
  * deadlock.
  */
 void iotc_device_client_mqtt_publish(const char *topic, const char *json_str)
 {
-	int len = strlen(json_str);
-	int status = publish_and_wait_for_ack(xMQTTAgentHandle, topic, json_str,
-			len);
+	const IotcTopic *registered = iotc_topic_find(topic);
+	IotcTopic adhoc;
+
+	if (registered == NULL) {
+		adhoc.name = topic;
+		adhoc.len = (uint16_t) strnlen(topic, UINT16_MAX);
+		adhoc.qos = MQTT_PUBLISH_QOS;
+		adhoc.lane = IOTC_LANE_CONTROL;
+		adhoc.source = NULL;
+		registered = &adhoc;
+	}
 
-	if (status != MQTTSuccess) {
-		IOTCL_ERROR(status, "Publishing a message to %s failed\r\n", topic);
+	(void) publish_to_topic(registered, json_str, strlen(json_str));
+}
+
+
+/* @brief	Publish a message to one of the SDK's registered topics
+ *
+ * @param	id, topic to publish to
+ * @param	payload, data to publish. Copied, so it may be reused on return.
+ * @param	len, length of payload in bytes
+ *
+ * The message is copied into an SDK-owned publish buffer and queued on the topic's
+ * publish lane with the topic's QoS, so the caller does not wait for it to be sent.
+ * Messages too large for a publish buffer, or sent when no buffer frees up in time, are
+ * published and waited for in place.
+ *
+ * This can be called from any task except the MQTT Agent Task.
+ */
+MQTTStatus_t iotc_device_client_mqtt_publish_topic(IotcTopicId id, const void *payload, size_t len)
+{
+	const IotcTopic *topic = iotc_topic_get(id);
+
+	if (topic == NULL) {
+		IOTCL_ERROR(id, "Topic %d is not available", id);
+		return MQTTBadParameter;
 	}
+
+	return publish_to_topic(topic, payload, len);
 }
 
 
-/*-----------------------------------------------------------*/
+/* @brief	Get an SDK-owned buffer to build a message in for iotc_device_client_mqtt_publish_buffer()
+ *
+ * @param	capacity, optional, set to the usable size of the buffer (MQTT_PUBLISH_MAX_LEN)
+ *
+ * Waits up to MQTT_PUBLISH_BUFFER_WAIT_MS for a buffer to be released. Returns NULL on timeout.
+ * A buffer that is not published must be returned with iotc_device_client_mqtt_buffer_free().
+ */
+char *iotc_device_client_mqtt_buffer_alloc(size_t *capacity)
+{
+	char *buf = NULL;
 
+	if (publish_buffer_pool.available != NULL) {
+		buf = iotc_pool_alloc(&publish_buffer_pool, pdMS_TO_TICKS(MQTT_PUBLISH_BUFFER_WAIT_MS));
+	}
 
-/* @brief 	Task that offloads publishing to the ACK_PUBLISH_TOPIC_FORMAT topic
+	if (capacity) {
+		*capacity = buf ? MQTT_PUBLISH_MAX_LEN : 0;
+	}
+
+	return buf;
+}
+
+
+/* @brief	Get a publish buffer for a message that will be queued on lane
  *
- * @param 	pvParameters, The parameters passed to the task.
+ * Control and ack lane messages take one of the reserved priority buffers if one is free
+ * and otherwise share the main pool.  wait_ticks may be 0 to never block.
  */
-static void mqtt_command_task(void *pvParameters)
+char *iotc_device_client_mqtt_buffer_alloc_for_lane(IotcPublishLane lane, TickType_t wait_ticks, size_t *capacity)
 {
-    ( void ) pvParameters;
-    BaseType_t xStatus;
-	char *message;
-    int status;
-    
-    while (1) {
-		xStatus = xQueueReceive(mqtt_command_queue, &message, portMAX_DELAY);
-        if (xStatus != pdPASS) {
-            IOTCL_ERROR(xStatus, "mqtt command task recv error");
-            break;
-        }
+	char *buf = NULL;
 
-		if (message) {
-			if ((status = iotcl_c2d_process_event(message)) != IOTCL_SUCCESS) {
-				IOTCL_ERROR(status, "Failed to process c2d message");
-            }
+	if (lane <= IOTC_LANE_ACK && priority_buffer_pool.available != NULL) {
+		buf = iotc_pool_alloc(&priority_buffer_pool, 0);
+	}
+
+	if (!buf && publish_buffer_pool.available != NULL) {
+		buf = iotc_pool_alloc(&publish_buffer_pool, wait_ticks);
+	}
+
+	if (capacity) {
+		*capacity = buf ? MQTT_PUBLISH_MAX_LEN : 0;
+	}
+
+	return buf;
+}
 
-			free(message);
-        }
-    }
 
-    vTaskDelete( NULL );
+/*
+ *
+ */
+void iotc_device_client_mqtt_buffer_free(char *buf)
+{
+	if (iotc_pool_owns(&priority_buffer_pool, buf)) {
+		iotc_pool_free(&priority_buffer_pool, buf);
+	} else {
+		iotc_pool_free(&publish_buffer_pool, buf);
+	}
 }
 
 
-/* @brief	Completion routine when a message has been published.
+/* @brief	Publish len bytes of an SDK-owned buffer without copying it
+ *
+ * @param   topic, MQTT topic to publish to. Must remain valid until the publish completes.
+ * @param	topic_len, length of topic, see iotc_topic_get()
+ * @param	buf, buffer obtained from iotc_device_client_mqtt_buffer_alloc()
+ * @param	len, number of bytes of buf to publish
+ * @param	qos, MQTTQoS0 or MQTTQoS1
  *
+ * Ownership of buf passes to the SDK whatever the result: it is released once the MQTT
+ * agent completes the publish, or immediately if the publish could not be started.
+ * The caller can reuse its own resources as soon as this returns.
  */
-static void publish_complete_callback( MQTTAgentCommandContext_t * pxCommandContext,
-                                       MQTTAgentReturnInfo_t * pxReturnInfo )
+MQTTStatus_t iotc_device_client_mqtt_publish_buffer(const char *topic, uint16_t topic_len, char *buf, size_t len,
+		MQTTQoS_t qos)
 {
-    TaskHandle_t xTaskHandle = ( TaskHandle_t ) pxCommandContext;
+	MQTTStatus_t status;
 
-    configASSERT( pxReturnInfo != NULL );
+	configASSERT( iotc_pool_owns(&publish_buffer_pool, buf) || iotc_pool_owns(&priority_buffer_pool, buf) );
 
-    uint32_t ulNotifyValue = pxReturnInfo->returnCode;
+	status = publish_async_len(topic, topic_len, buf, len, qos, publish_buffer_complete_callback, buf, NULL);
 
-    if( xTaskHandle != NULL ) {
-        /* Send the context's ulNotificationValue as the notification value so
-         * the receiving task can check the value it set in the context matches
-         * the value it receives in the notification. */
-        ( void ) xTaskNotifyIndexed( xTaskHandle,
-                                     MQTT_NOTIFY_IDX,
-                                     ulNotifyValue,
-                                     eSetValueWithOverwrite );
-    }
+	if (status != MQTTSuccess) {
+		iotc_device_client_mqtt_buffer_free(buf);
+	}
+
+	return status;
 }
 
 
-/* @brief	Publish to an MQTT topic and wait for an acknowledgement
+/* @brief	Publish a message without waiting for it to be sent
+ *
+ * @param   topic, MQTT topic to publish to
+ * @param	payload, data to publish
+ * @param	payload_len, length of payload in bytes
+ * @param	qos, MQTTQoS0 or MQTTQoS1
+ * @param	cb, optional callback invoked on the MQTT agent task on completion
+ * @param	cb_context, passed to cb
+ *
+ * Up to MQTT_PUBLISH_MAX_IN_FLIGHT publishes may be outstanding at once. When the window
+ * is full this waits up to MQTT_PUBLISH_WINDOW_WAIT_MS for a slot to free up.  QoS1
+ * publishes also need one of MQTT_QOS1_MAX_IN_FLIGHT state records, which are held until
+ * the PUBACK arrives, and wait the same time for one to be released.
+ *
+ * The topic and payload are referenced, not copied, and must remain valid until cb is called.
+ * cb is only called if this function returns MQTTSuccess.  Like iotc_device_client_mqtt_publish()
+ * this must not be called from the MQTT Agent Task.
+ */
+MQTTStatus_t iotc_device_client_mqtt_publish_async(const char *topic, const void *payload, size_t payload_len,
+		MQTTQoS_t qos, IotConnectPublishCallback cb, void *cb_context)
+{
+    configASSERT( topic != NULL );
+
+    return publish_async_len(topic, ( uint16_t ) strnlen( topic, UINT16_MAX ), payload, payload_len,
+            qos, cb, cb_context, NULL);
+}
+
+
+/* @brief	iotc_device_client_mqtt_publish_async() for a topic whose length is already known
  *
+ * @param	started, optional, set to the slot of the publish if it was started
  */
-static BaseType_t publish_and_wait_for_ack( MQTTAgentHandle_t xAgentHandle,
-                                           const char * pcTopic,
-                                           const void * pvPublishData,
-                                           size_t xPublishDataLen )
+static MQTTStatus_t publish_async_len(const char *topic, uint16_t topic_len, const void *payload,
+		size_t payload_len, MQTTQoS_t qos, IotConnectPublishCallback cb, void *cb_context, PublishSlot **started)
 {
     MQTTStatus_t xStatus;
-    size_t uxTopicLen = 0;
+    PublishSlot *slot;
 
-    configASSERT( pcTopic != NULL );
-    configASSERT( pvPublishData != NULL );
-    configASSERT( xPublishDataLen > 0 );
+    configASSERT( topic != NULL );
+    configASSERT( payload != NULL );
+    configASSERT( payload_len > 0 );
+    configASSERT( qos == MQTTQoS0 || qos == MQTTQoS1 );
+
+    slot = publish_slot_acquire();
+    if (slot == NULL) {
+        IOTCL_ERROR(MQTTNoMemory, "Timed out waiting for publish window on %s", topic);
+        return MQTTNoMemory;
+    }
 
-    uxTopicLen = strnlen( pcTopic, UINT16_MAX );
+    if (qos == MQTTQoS1 && !qos1_state_acquire()) {
+        IOTCL_ERROR(MQTTNoMemory, "Timed out waiting for a QoS1 state record on %s", topic);
+        publish_slot_release(slot);
+        return MQTTNoMemory;
+    }
 
-    MQTTPublishInfo_t xPublishInfo = {
-        .qos             = MQTT_PUBLISH_QOS,
-        .retain          = 0,
-        .dup             = 0,
-        .pTopicName      = pcTopic,
-        .topicNameLength = ( uint16_t ) uxTopicLen,
-        .pPayload        = pvPublishData,
-        .payloadLength   = xPublishDataLen
-    };
+    slot->publish_info.qos = qos;
+    slot->publish_info.retain = 0;
+    slot->publish_info.dup = 0;
+    slot->publish_info.pTopicName = topic;
+    slot->publish_info.topicNameLength = topic_len;
+    slot->publish_info.pPayload = payload;
+    slot->publish_info.payloadLength = payload_len;
+    slot->cb = cb;
+    slot->cb_context = cb_context;
 
     MQTTAgentCommandInfo_t xCommandParams = {
         .blockTimeMs                 = MQTT_PUBLISH_BLOCK_TIME_MS,
-        .cmdCompleteCallback         = publish_complete_callback,
-        .pCmdCompleteCallbackContext = ( void * ) xTaskGetCurrentTaskHandle(),
+        .cmdCompleteCallback         = publish_async_complete_callback,
+        .pCmdCompleteCallbackContext = ( MQTTAgentCommandContext_t * ) slot,
     };
 
-    if (xPublishInfo.qos > MQTTQoS0) {
-        xCommandParams.pCmdCompleteCallbackContext = ( void * ) xTaskGetCurrentTaskHandle();
+    xStatus = MQTTAgent_Publish( xMQTTAgentHandle, &slot->publish_info, &xCommandParams );
+
+    if (xStatus != MQTTSuccess) {
+        IOTCL_ERROR(xStatus, "MQTTAgent_Publish failed");
+        if (qos == MQTTQoS1) {
+            qos1_state_release();
+        }
+        publish_slot_release(slot);
+    } else if (started) {
+        *started = slot;
     }
 
-    /* Clear the notification index */
-    xTaskNotifyStateClearIndexed( NULL, MQTT_NOTIFY_IDX );
+    taskENTER_CRITICAL();
+    if (xStatus == MQTTSuccess) {
+        publish_stats.published++;
+    } else {
+        publish_stats.failed++;
+    }
+    taskEXIT_CRITICAL();
 
-    xStatus = MQTTAgent_Publish( xAgentHandle, &xPublishInfo, &xCommandParams );
+    return xStatus;
+}
 
-    if (xStatus == MQTTSuccess) {
-        uint32_t ulNotifyValue = 0;
-        BaseType_t xResult = pdFALSE;
-
-        xResult = xTaskNotifyWaitIndexed( MQTT_NOTIFY_IDX,
-                                          0xFFFFFFFF,
-                                          0xFFFFFFFF,
-                                          &ulNotifyValue,
-                                          pdMS_TO_TICKS( MQTT_PUBLISH_NOTIFICATION_WAIT_MS ) );
-
-        if( xResult ) {
-            xStatus = ( MQTTStatus_t ) ulNotifyValue;
-            if( xStatus != MQTTSuccess ) {
-                IOTCL_ERROR(xStatus, "MQTT Agent returned error during publish operation");
-                xResult = pdFALSE;
-            }
-        } else {
-			IOTCL_ERROR(xResult,
-					"Timed out while waiting for publish ACK or Sent event. xTimeout = %d",
-            							pdMS_TO_TICKS( MQTT_PUBLISH_NOTIFICATION_WAIT_MS ) );
-            xResult = pdFALSE;
+
+/* @brief	Wait until the in-flight window has room for another publish
+ *
+ * Used by the publish lane dispatcher so it only commits to a message once it can be
+ * handed to the MQTT agent straight away.  The slot is not reserved.
+ */
+bool iotc_device_client_mqtt_wait_for_window(TickType_t wait_ticks)
+{
+	if (publish_window == NULL || xSemaphoreTake(publish_window, wait_ticks) != pdTRUE) {
+		return false;
+	}
+
+	xSemaphoreGive(publish_window);
+	return true;
+}
+
+
+/* @brief	Wait until a QoS1 state record is free
+ *
+ * Lets the publish lane dispatcher skip QoS1 messages instead of blocking on them.
+ * The record is not reserved.
+ */
+bool iotc_device_client_mqtt_wait_for_qos1_window(TickType_t wait_ticks)
+{
+	if (qos1_window == NULL || xSemaphoreTake(qos1_window, wait_ticks) != pdTRUE) {
+		return false;
+	}
+
+	xSemaphoreGive(qos1_window);
+	return true;
+}
+
+
+/* @brief	Get publish counters and current in-flight usage
+ */
+void iotc_device_client_mqtt_get_publish_stats(IotConnectPublishStats *stats)
+{
+	taskENTER_CRITICAL();
+	*stats = publish_stats;
+	taskEXIT_CRITICAL();
+}
+
+
+/* @brief	Get usage of the inbound cloud-to-device message pool, one entry per size class
+ *
+ * Returns the number of entries written to stats.
+ */
+size_t iotc_device_client_c2d_pool_get_stats(IotcPoolStats *stats, size_t max_stats)
+{
+	return iotc_class_pool_get_stats(&c2d_pool, stats, max_stats);
+}
+
+
+/*
+ *
+ */
+void iotc_device_client_c2d_get_stats(IotConnectC2dStats *stats)
+{
+	taskENTER_CRITICAL();
+	*stats = c2d_stats;
+	taskEXIT_CRITICAL();
+}
+
+
+/*-----------------------------------------------------------*/
+
+
+/* @brief	Completion routine when a message publish_and_wait_for_ack() waits on has been published.
+ *
+ */
+static void publish_wait_callback(void *context, MQTTStatus_t status)
+{
+    TaskHandle_t xTaskHandle = ( TaskHandle_t ) context;
+
+    ( void ) xTaskNotifyIndexed( xTaskHandle,
+                                 MQTT_NOTIFY_IDX,
+                                 ( uint32_t ) status,
+                                 eSetValueWithOverwrite );
+}
+
+
+/* @brief	Completion routine for iotc_device_client_mqtt_publish_async()
+ *
+ * Runs on the MQTT agent task.  Reports the result and returns the slot to the window.
+ */
+static void publish_async_complete_callback( MQTTAgentCommandContext_t * pxCommandContext,
+                                             MQTTAgentReturnInfo_t * pxReturnInfo )
+{
+    PublishSlot *slot = ( PublishSlot * ) pxCommandContext;
+    IotConnectPublishCallback cb;
+    void *cb_context;
+
+    configASSERT( slot != NULL );
+    configASSERT( pxReturnInfo != NULL );
+
+    // Taken in the critical section that a task giving up waiting replaces it in, see
+    // publish_and_wait_for_ack(), so exactly one of the two callbacks runs
+    taskENTER_CRITICAL();
+    if (pxReturnInfo->returnCode != MQTTSuccess) {
+        publish_stats.failed++;
+    }
+    cb = slot->cb;
+    cb_context = slot->cb_context;
+    slot->cb = NULL;
+    slot->cb_context = NULL;
+    taskEXIT_CRITICAL();
+
+    if (cb) {
+        cb(cb_context, pxReturnInfo->returnCode);
+    }
+
+    if (slot->publish_info.qos == MQTTQoS1) {
+        qos1_state_release();
+    }
+    publish_slot_release(slot);
+}
+
+
+/* @brief	Completion routine for iotc_device_client_mqtt_publish_buffer()
+ *
+ * Runs on the MQTT agent task.  The agent is done with the payload so the buffer can be reused.
+ */
+static void publish_buffer_complete_callback(void *context, MQTTStatus_t status)
+{
+	if (status != MQTTSuccess) {
+		IOTCL_ERROR(status, "MQTT Agent returned error during publish operation");
+	}
+
+	iotc_device_client_mqtt_buffer_free((char *) context);
+}
+
+
+/* @brief	Completion routine of a publish publish_and_wait_for_ack() gave up waiting for
+ *
+ * Runs on the MQTT agent task.  Releases the copy of the topic and payload.
+ */
+static void publish_copy_complete_callback(void *context, MQTTStatus_t status)
+{
+	( void ) status;
+
+	vPortFree(context);
+}
+
+
+/* @brief	Wait for room in the in-flight window and claim a free publish slot
+ *
+ * Returns NULL if no slot became free within MQTT_PUBLISH_WINDOW_WAIT_MS.
+ */
+static PublishSlot *publish_slot_acquire(void)
+{
+    PublishSlot *slot = NULL;
+
+    if (publish_window == NULL ||
+            xSemaphoreTake(publish_window, pdMS_TO_TICKS(MQTT_PUBLISH_WINDOW_WAIT_MS)) != pdTRUE) {
+        taskENTER_CRITICAL();
+        publish_stats.window_timeouts++;
+        taskEXIT_CRITICAL();
+        return NULL;
+    }
+
+    taskENTER_CRITICAL();
+    publish_stats.in_flight++;
+    for (int i = 0; i < MQTT_PUBLISH_MAX_IN_FLIGHT; i++) {
+        if (!publish_slots[i].in_use) {
+            publish_slots[i].in_use = true;
+            slot = &publish_slots[i];
+            break;
         }
-    } else {
-        IOTCL_ERROR(xStatus, "MQTTAgent_Publish failed");
     }
+    taskEXIT_CRITICAL();
 
-	return xStatus;
+    // The semaphore count tracks free slots so one is always available here
+    configASSERT( slot != NULL );
+    return slot;
 }
 
 
 /*
  *
  */
-static MQTTStatus_t subscribe_to_topic(MQTTQoS_t xQoS,
-		const char *pcTopicFilter)
+static void publish_slot_release(PublishSlot *slot)
 {
-    MQTTStatus_t xMQTTStatus;
-    int retries = 0;
-    
-    do
-    {
-        xMQTTStatus = MqttAgent_SubscribeSync( xMQTTAgentHandle,
-                                               pcTopicFilter,
-                                               xQoS,
-                                               incoming_message_callback,
-                                               NULL );
-        
-        retries++;
-    } while( xMQTTStatus != MQTTSuccess && retries < 20);
-
-    if( xMQTTStatus != MQTTSuccess ) {
-        IOTCL_ERROR(xMQTTStatus, "Failed to subscribe to topic");
-    } else {
-        IOTCL_INFO("Subscribed to topic %s", pcTopicFilter);
+    taskENTER_CRITICAL();
+    publish_stats.in_flight--;
+    slot->in_use = false;
+    slot->cb = NULL;
+    slot->cb_context = NULL;
+    taskEXIT_CRITICAL();
+
+    xSemaphoreGive(publish_window);
+}
+
+
+/* @brief	Wait for a free outgoing QoS1 state record
+ *
+ * This is the backpressure that keeps the SDK from exhausting the MQTT agent's
+ * MQTT_STATE_ARRAY_MAX_COUNT records, which would make further QoS1 publishes fail.
+ */
+static bool qos1_state_acquire(void)
+{
+    if (qos1_window == NULL ||
+            xSemaphoreTake(qos1_window, pdMS_TO_TICKS(MQTT_PUBLISH_WINDOW_WAIT_MS)) != pdTRUE) {
+        taskENTER_CRITICAL();
+        publish_stats.qos1_timeouts++;
+        taskEXIT_CRITICAL();
+        return false;
     }
 
-    return xMQTTStatus;
+    taskENTER_CRITICAL();
+    publish_stats.qos1_in_flight++;
+    if (publish_stats.qos1_in_flight > publish_stats.qos1_high_water) {
+        publish_stats.qos1_high_water = publish_stats.qos1_in_flight;
+    }
+    taskEXIT_CRITICAL();
+    return true;
+}
+
+
+/*
+ *
+ */
+static void qos1_state_release(void)
+{
+    taskENTER_CRITICAL();
+    publish_stats.qos1_in_flight--;
+    taskEXIT_CRITICAL();
+
+    xSemaphoreGive(qos1_window);
+}
+
+
+/* @brief	Copy a message into a publish buffer and queue it on the topic's lane
+ *
+ * Falls back to publishing a heap copy and waiting for completion when the message does
+ * not fit a publish buffer or none frees up in time.
+ */
+static MQTTStatus_t publish_to_topic(const IotcTopic *topic, const void *payload, size_t len)
+{
+	size_t capacity = 0;
+	char *buf = NULL;
+	MQTTStatus_t status;
+
+	// Inline command handlers and their acks run on the agent task, which must never wait for itself
+	bool no_wait = on_agent_task();
+
+	if (len <= MQTT_PUBLISH_MAX_LEN) {
+		buf = iotc_device_client_mqtt_buffer_alloc_for_lane(topic->lane,
+				no_wait ? 0 : pdMS_TO_TICKS(MQTT_PUBLISH_BUFFER_WAIT_MS), &capacity);
+	}
+
+	if (buf) {
+		memcpy(buf, payload, len);
+		status = iotc_publish_lane_enqueue(topic->lane, topic->name, topic->len, buf, len, topic->qos,
+				no_wait ? 0 : pdMS_TO_TICKS(MQTT_PUBLISH_WINDOW_WAIT_MS));
+	} else if (no_wait) {
+		status = MQTTNoMemory;
+	} else {
+		status = publish_and_wait_for_ack(topic->name, topic->len, payload, len, topic->qos);
+	}
+
+	if (status != MQTTSuccess) {
+		IOTCL_ERROR(status, "Publishing a message to %s failed\r\n", topic->name);
+	}
+
+	return status;
+}
+
+
+/* @brief	Publish to an MQTT topic and wait for an acknowledgement
+ *
+ * The topic and payload are copied to the heap first, as the publish holds a slot, and
+ * for QoS1 a state record, until the agent completes it, even if this gives up waiting
+ * first.  The caller's memory may then already be freed while the agent still sends the
+ * copy or waits for the PUBACK, and the completion releases it instead of this task.
+ * Returns MQTTRecvFailed if it did not complete in time.
+ */
+static MQTTStatus_t publish_and_wait_for_ack( const char * pcTopic,
+                                              uint16_t usTopicLen,
+                                              const void * pvPublishData,
+                                              size_t xPublishDataLen,
+                                              MQTTQoS_t xQoS )
+{
+    TaskHandle_t xTaskHandle = xTaskGetCurrentTaskHandle();
+    PublishSlot *slot = NULL;
+    MQTTStatus_t xStatus;
+    uint32_t ulNotifyValue = 0;
+    bool detached;
+    char *copy;
+
+    configASSERT( pcTopic != NULL );
+    configASSERT( pvPublishData != NULL );
+    configASSERT( xPublishDataLen > 0 );
+
+    copy = pvPortMalloc(usTopicLen + xPublishDataLen);
+    if (copy == NULL) {
+        IOTCL_ERROR(MQTTNoMemory, "No memory to publish %u bytes", (unsigned) xPublishDataLen);
+        return MQTTNoMemory;
+    }
+    memcpy(copy, pcTopic, usTopicLen);
+    memcpy(&copy[usTopicLen], pvPublishData, xPublishDataLen);
+
+    /* Clear the notification index */
+    xTaskNotifyStateClearIndexed( NULL, MQTT_NOTIFY_IDX );
+
+    xStatus = publish_async_len(copy, usTopicLen, &copy[usTopicLen], xPublishDataLen, xQoS,
+            publish_wait_callback, ( void * ) xTaskHandle, &slot);
+    if (xStatus != MQTTSuccess) {
+        vPortFree(copy);
+        return xStatus;
+    }
+
+    if (xTaskNotifyWaitIndexed( MQTT_NOTIFY_IDX,
+                                0xFFFFFFFF,
+                                0xFFFFFFFF,
+                                &ulNotifyValue,
+                                pdMS_TO_TICKS( MQTT_PUBLISH_NOTIFICATION_WAIT_MS ) )) {
+        vPortFree(copy);
+        xStatus = ( MQTTStatus_t ) ulNotifyValue;
+        if( xStatus != MQTTSuccess ) {
+            IOTCL_ERROR(xStatus, "MQTT Agent returned error during publish operation");
+        }
+        return xStatus;
+    }
+
+    // Hand the copy to the completion.  The slot still has this task's callback unless the
+    // completion has already taken it, and then its notification is about to arrive.
+    taskENTER_CRITICAL();
+    detached = slot->cb == publish_wait_callback && slot->cb_context == ( void * ) xTaskHandle;
+    if (detached) {
+        slot->cb = publish_copy_complete_callback;
+        slot->cb_context = copy;
+        publish_stats.ack_timeouts++;
+    }
+    taskEXIT_CRITICAL();
+
+    if (!detached) {
+        ( void ) xTaskNotifyWaitIndexed( MQTT_NOTIFY_IDX, 0, 0xFFFFFFFF, &ulNotifyValue, portMAX_DELAY );
+        vPortFree(copy);
+        return ( MQTTStatus_t ) ulNotifyValue;
+    }
+
+    // Nothing may be left for the next wait on this index
+    xTaskNotifyStateClearIndexed( NULL, MQTT_NOTIFY_IDX );
+    ( void ) ulTaskNotifyValueClearIndexed( NULL, MQTT_NOTIFY_IDX, 0xFFFFFFFF );
+
+    IOTCL_ERROR(MQTTRecvFailed, "Timed out while waiting for publish ACK or Sent event. xTimeout = %d",
+            pdMS_TO_TICKS( MQTT_PUBLISH_NOTIFICATION_WAIT_MS ) );
+    return MQTTRecvFailed;
 }
 
 
 /* @brief	 Callback on receipt of a cloud-to-device message
  *
- * Passed into MQTTAgent_Subscribe() as the callback to execute when there is an
- * incoming publish on the topic being subscribed to.
+ * Registered with the topic router as the handler for publishes on the c2d topic.
  *
  * This callback runs on the context of the MQTT Agent Task.  This should be kept as
  * short as possible and not perform any blocking operations otherwise there is a
  * potential for deadlock or the connection dropping.
  *
- * Here we offload the processing of commands onto the mqtt_command_task by placing
- * the received JSON message into a queue that the mqtt_command_task reads from.
+ * Here we offload the processing of commands onto the command workers by copying the
+ * received JSON message into a buffer and queuing it for them, see iotc_command_workers.c.
  *
  * @param[in] pvIncomingPublishCallbackContext Context of the initial command.
  * @param[in] pxPublishInfo Deserialized publish.
@@ -352,29 +851,82 @@ static MQTTStatus_t subscribe_to_topic(MQTTQoS_t xQoS,
 static void incoming_message_callback( void * pvIncomingPublishCallbackContext, MQTTPublishInfo_t * pxPublishInfo )
 {
     ( void ) pvIncomingPublishCallbackContext;
-	int status;
 	char *buf;
+	size_t len = pxPublishInfo->payloadLength;
+
+	c2d_stats.received++;
+
+	if (len > MQTT_C2D_MAX_PAYLOAD_LENGTH) {
+#if MQTT_C2D_OVERSIZE_POLICY == MQTT_C2D_OVERSIZE_TRUNCATE
+		IOTCL_WARN(len, "Truncating %u byte c2d message to %u bytes", (unsigned) len, (unsigned) MQTT_C2D_MAX_PAYLOAD_LENGTH);
+		c2d_stats.oversize_truncated++;
+		len = MQTT_C2D_MAX_PAYLOAD_LENGTH;
+#else
+		IOTCL_ERROR(len, "Dropping %u byte c2d message, limit is %u", (unsigned) len, (unsigned) MQTT_C2D_MAX_PAYLOAD_LENGTH);
+		c2d_stats.oversize_dropped++;
+		return;
+#endif
+	}
 
-	buf = malloc(MQTT_PAYLOAD_BUFFER_LENGTH);
+	buf = c2d_message_alloc(len + 1);
 
 	if (!buf) {
 		IOTCL_ERROR(0, "failed to allocate message buf");
+		c2d_stats.alloc_failed++;
 		return;
     }
 
-	if (pxPublishInfo->payloadLength < MQTT_PAYLOAD_BUFFER_LENGTH) {
-		memcpy(buf, pxPublishInfo->pPayload, pxPublishInfo->payloadLength);
-		buf[pxPublishInfo->payloadLength] = '\0';
-	} else {
-		memcpy(buf, pxPublishInfo->pPayload, MQTT_PAYLOAD_BUFFER_LENGTH);
-		buf[MQTT_PAYLOAD_BUFFER_LENGTH - 1] = '\0';
+	memcpy(buf, pxPublishInfo->pPayload, len);
+	buf[len] = '\0';
+
+	if (iotc_command_workers_submit(buf) != 0) {
+		IOTCL_WARN(0, "Command workers busy, dropping c2d message");
+		c2d_message_free(buf);
 	}
+}
 
-	status = xQueueSendToBack(mqtt_command_queue, &buf,
-			MQTT_COMMAND_QUEUE_TIMEOUT_MS);
 
-	if (status != pdTRUE) {
-		free(buf);
-    }
+/* @brief	True when called from the MQTT agent task, which must not wait on the agent
+ */
+static bool on_agent_task(void)
+{
+	return agent_task != NULL && xTaskGetCurrentTaskHandle() == agent_task;
 }
 
+
+/* @brief	Allocate a buffer of size bytes for a cloud-to-device message
+ *
+ * Most messages are served by the size-classed pool in fixed time without waiting.
+ * Messages bigger than the largest class are given a heap buffer of exactly the
+ * required size rather than reserving worst case pool blocks for them.
+ */
+static char *c2d_message_alloc(size_t size)
+{
+	char *buf = NULL;
+
+	if (size <= MQTT_C2D_POOL_LARGE_SIZE) {
+		buf = iotc_class_pool_alloc(&c2d_pool, size, NULL);
+	}
+
+	if (!buf && size > MQTT_C2D_POOL_LARGE_SIZE) {
+		buf = malloc(size);
+		if (buf) {
+			c2d_stats.heap_allocated++;
+		}
+	}
+
+	return buf;
+}
+
+
+/*
+ *
+ */
+static void c2d_message_free(char *message)
+{
+	if (iotc_class_pool_owns(&c2d_pool, message)) {
+		iotc_class_pool_free(&c2d_pool, message);
+	} else {
+		free(message);
+	}
+}
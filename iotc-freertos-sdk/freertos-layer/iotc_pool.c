@@ -0,0 +1,243 @@
+/*
+ * iotc_pool.c
+ *
+ * Fixed-block memory pool.  Blocks are kept on an intrusive free list so allocation
+ * and release are O(1), and a counting semaphore lets callers optionally wait for a
+ * block to be returned.  Safe to use from any task, including the MQTT agent task
+ * provided wait_ticks is 0.
+ *
+ * IotcClassPool groups a few pools of increasing block size so that variable sized
+ * messages do not each have to take a worst case block.  The number of classes is a
+ * small compile time bound so class selection stays constant time.
+ */
+
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+
+#include "iotcl_log.h"
+#include "iotc_pool.h"
+
+
+/* @brief	Initialize a pool over caller supplied storage
+ *
+ * @param	storage, at least block_count * IOTC_POOL_BLOCK_ALIGN(block_size) bytes, 8 byte aligned.
+ *          Use IOTC_POOL_STORAGE() to declare it.
+ */
+int iotc_pool_init(IotcPool *pool, void *storage, size_t block_size, size_t block_count)
+{
+	if (!pool || !storage || block_count == 0 || block_size == 0) {
+		return -1;
+	}
+
+	memset(pool, 0, sizeof(*pool));
+	pool->storage = (uint8_t *) storage;
+	pool->block_size = IOTC_POOL_BLOCK_ALIGN(block_size < sizeof(IotcPoolBlock) ? sizeof(IotcPoolBlock) : block_size);
+	pool->block_count = block_count;
+
+	for (size_t i = block_count; i > 0; i--) {
+		IotcPoolBlock *block = (IotcPoolBlock *) &pool->storage[(i - 1) * pool->block_size];
+		block->next = pool->free_list;
+		pool->free_list = block;
+	}
+
+	pool->available = xSemaphoreCreateCounting(block_count, block_count);
+	if (pool->available == NULL) {
+		IOTCL_ERROR(0, "Failed to create pool semaphore");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/* @brief	Take a block from the pool
+ *
+ * Waits up to wait_ticks for a block to be freed when the pool is empty.
+ * Returns NULL if no block is available.
+ */
+void *iotc_pool_alloc(IotcPool *pool, TickType_t wait_ticks)
+{
+	IotcPoolBlock *block;
+
+	if (xSemaphoreTake(pool->available, wait_ticks) != pdTRUE) {
+		taskENTER_CRITICAL();
+		pool->exhausted++;
+		taskEXIT_CRITICAL();
+		return NULL;
+	}
+
+	taskENTER_CRITICAL();
+	block = pool->free_list;
+	pool->free_list = block->next;
+	pool->in_use++;
+	if (pool->in_use > pool->high_water) {
+		pool->high_water = pool->in_use;
+	}
+	taskEXIT_CRITICAL();
+
+	return block;
+}
+
+
+/* @brief	Return a block to the pool it was allocated from
+ */
+void iotc_pool_free(IotcPool *pool, void *p)
+{
+	IotcPoolBlock *block = (IotcPoolBlock *) p;
+
+	if (block == NULL) {
+		return;
+	}
+
+	configASSERT( iotc_pool_owns(pool, p) );
+
+	taskENTER_CRITICAL();
+	block->next = pool->free_list;
+	pool->free_list = block;
+	pool->in_use--;
+	taskEXIT_CRITICAL();
+
+	xSemaphoreGive(pool->available);
+}
+
+
+/* @brief	Determine if a pointer is the start of a block belonging to this pool
+ */
+bool iotc_pool_owns(const IotcPool *pool, const void *p)
+{
+	const uint8_t *b = (const uint8_t *) p;
+
+	if (b < pool->storage || b >= pool->storage + pool->block_size * pool->block_count) {
+		return false;
+	}
+
+	return ((size_t) (b - pool->storage) % pool->block_size) == 0;
+}
+
+
+/*
+ *
+ */
+void iotc_pool_get_stats(const IotcPool *pool, IotcPoolStats *stats)
+{
+	taskENTER_CRITICAL();
+	stats->block_size = pool->block_size;
+	stats->block_count = pool->block_count;
+	stats->in_use = pool->in_use;
+	stats->high_water = pool->high_water;
+	stats->exhausted = pool->exhausted;
+	taskEXIT_CRITICAL();
+}
+
+
+/* @brief	Add a size class to a class pool
+ *
+ * Classes must be added in ascending block size order.  cpool must be zeroed before
+ * the first class is added.
+ */
+int iotc_class_pool_add(IotcClassPool *cpool, void *storage, size_t block_size, size_t block_count)
+{
+	if (cpool->class_count >= IOTC_POOL_MAX_CLASSES) {
+		IOTCL_ERROR(0, "Too many pool size classes");
+		return -1;
+	}
+
+	if (cpool->class_count > 0 &&
+			IOTC_POOL_BLOCK_ALIGN(block_size) <= cpool->classes[cpool->class_count - 1].block_size) {
+		IOTCL_ERROR(0, "Pool size classes must be added in ascending order");
+		return -1;
+	}
+
+	if (iotc_pool_init(&cpool->classes[cpool->class_count], storage, block_size, block_count) != 0) {
+		return -1;
+	}
+
+	cpool->class_count++;
+	return 0;
+}
+
+
+/* @brief	Allocate a block of at least size bytes without waiting
+ *
+ * Uses the smallest class that fits, moving up to a larger class if it is empty.
+ * Each empty class that is passed over counts as an exhaustion for that class.
+ *
+ * @param	capacity, optional, set to the usable size of the returned block
+ */
+void *iotc_class_pool_alloc(IotcClassPool *cpool, size_t size, size_t *capacity)
+{
+	for (size_t i = 0; i < cpool->class_count; i++) {
+		IotcPool *pool = &cpool->classes[i];
+		void *block;
+
+		if (pool->block_size < size) {
+			continue;
+		}
+
+		block = iotc_pool_alloc(pool, 0);
+		if (block) {
+			if (capacity) {
+				*capacity = pool->block_size;
+			}
+			return block;
+		}
+	}
+
+	if (capacity) {
+		*capacity = 0;
+	}
+	return NULL;
+}
+
+
+/* @brief	Return a block to the class it was allocated from
+ */
+void iotc_class_pool_free(IotcClassPool *cpool, void *block)
+{
+	if (block == NULL) {
+		return;
+	}
+
+	for (size_t i = 0; i < cpool->class_count; i++) {
+		if (iotc_pool_owns(&cpool->classes[i], block)) {
+			iotc_pool_free(&cpool->classes[i], block);
+			return;
+		}
+	}
+
+	configASSERT( 0 );	// not allocated from this pool
+}
+
+
+/*
+ *
+ */
+bool iotc_class_pool_owns(const IotcClassPool *cpool, const void *block)
+{
+	for (size_t i = 0; i < cpool->class_count; i++) {
+		if (iotc_pool_owns(&cpool->classes[i], block)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/* @brief	Get statistics for each size class
+ *
+ * Returns the number of entries written to stats.
+ */
+size_t iotc_class_pool_get_stats(const IotcClassPool *cpool, IotcPoolStats *stats, size_t max_stats)
+{
+	size_t n = (cpool->class_count < max_stats) ? cpool->class_count : max_stats;
+
+	for (size_t i = 0; i < n; i++) {
+		iotc_pool_get_stats(&cpool->classes[i], &stats[i]);
+	}
+
+	return n;
+}
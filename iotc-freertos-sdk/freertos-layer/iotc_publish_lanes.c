@@ -0,0 +1,272 @@
+/*
+ * iotc_publish_lanes.c
+ *
+ * Prioritised outbound publish lanes.
+ *
+ * Each lane is a queue of SDK-owned publish buffers.  Producers enqueue without waiting
+ * on the MQTT agent and a single dispatcher task hands messages to the agent.  The
+ * dispatcher waits for space in the in-flight window before choosing a message, so a
+ * message that arrives on a higher priority lane while the window is full is sent ahead
+ * of anything already queued on a lower priority lane.  Lanes whose next message is QoS1
+ * are skipped while no QoS1 state record is free, so QoS0 messages are not held up
+ * behind them.
+ *
+ * With IOTC_LANE_SCHED_STRICT the highest priority non-empty lane is always served.
+ * IOTC_LANE_SCHED_WEIGHTED serves up to the lane's weight of messages per round so that
+ * a steady stream of acknowledgements cannot starve telemetry completely.
+ */
+
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "queue.h"
+#include "semphr.h"
+
+#include "core_mqtt.h"
+
+#include "iotcl_log.h"
+#include "iotc_mqtt_client.h"
+#include "iotc_publish_lanes.h"
+
+#define LANE_TOTAL_DEPTH	(IOTC_LANE_CONTROL_DEPTH + IOTC_LANE_ACK_DEPTH + \
+							 IOTC_LANE_TELEMETRY_DEPTH + IOTC_LANE_BULK_DEPTH)
+
+typedef struct {
+	char *buf;
+	const char *topic;
+	uint16_t topic_len;
+	size_t len;
+	MQTTQoS_t qos;
+	TickType_t enqueued_at;
+} LaneMessage;
+
+static const UBaseType_t lane_depths[IOTC_LANE_COUNT] = {
+	IOTC_LANE_CONTROL_DEPTH,
+	IOTC_LANE_ACK_DEPTH,
+	IOTC_LANE_TELEMETRY_DEPTH,
+	IOTC_LANE_BULK_DEPTH,
+};
+
+#if IOTC_LANE_SCHEDULING == IOTC_LANE_SCHED_WEIGHTED
+static const uint16_t lane_weights[IOTC_LANE_COUNT] = {
+	IOTC_LANE_CONTROL_WEIGHT,
+	IOTC_LANE_ACK_WEIGHT,
+	IOTC_LANE_TELEMETRY_WEIGHT,
+	IOTC_LANE_BULK_WEIGHT,
+};
+
+static uint16_t lane_credits[IOTC_LANE_COUNT];
+#endif
+
+static QueueHandle_t lane_queues[IOTC_LANE_COUNT];
+
+// @brief	Counts messages queued across all lanes
+static SemaphoreHandle_t lanes_pending = NULL;
+
+static IotcPublishLaneStats lane_stats[IOTC_LANE_COUNT];
+
+
+static void lane_dispatch_task(void *pvParameters);
+static int lane_select(bool qos1_ok);
+static bool lane_ready(int lane, bool qos1_ok);
+
+
+/* @brief	Create the lane queues and the dispatcher task
+ */
+int iotc_publish_lanes_init(void)
+{
+	BaseType_t xResult;
+
+	if (lanes_pending != NULL) {
+		return 0;
+	}
+
+	for (int i = 0; i < IOTC_LANE_COUNT; i++) {
+		lane_queues[i] = xQueueCreate(lane_depths[i], sizeof(LaneMessage));
+		if (lane_queues[i] == NULL) {
+			IOTCL_ERROR(i, "Failed to create publish lane queue");
+			return -1;
+		}
+	}
+
+	lanes_pending = xSemaphoreCreateCounting(LANE_TOTAL_DEPTH, 0);
+	if (lanes_pending == NULL) {
+		IOTCL_ERROR(0, "Failed to create publish lane semaphore");
+		return -1;
+	}
+
+	xResult = xTaskCreate(lane_dispatch_task, "iotc_lanes", 1024, NULL, IOTC_LANE_TASK_PRIORITY, NULL);
+	if (xResult != pdTRUE) {
+		IOTCL_ERROR(xResult, "Failed to create publish lane task");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/* @brief	Queue an SDK-owned publish buffer on a lane
+ *
+ * @param	lane, priority lane to queue on
+ * @param   topic, MQTT topic to publish to. Must remain valid until the publish completes.
+ * @param	topic_len, length of topic, see iotc_topic_get()
+ * @param	buf, buffer obtained from iotc_device_client_mqtt_buffer_alloc()
+ * @param	len, number of bytes of buf to publish
+ * @param	qos, MQTTQoS0 or MQTTQoS1
+ * @param	wait_ticks, how long to wait for room in the lane.  Use 0 on the MQTT agent task.
+ *
+ * As with iotc_device_client_mqtt_publish_buffer(), ownership of buf passes to the SDK
+ * whatever the result.  MQTTSuccess means the message was queued, not that it was sent.
+ */
+MQTTStatus_t iotc_publish_lane_enqueue(IotcPublishLane lane, const char *topic, uint16_t topic_len,
+		char *buf, size_t len, MQTTQoS_t qos, TickType_t wait_ticks)
+{
+	LaneMessage msg = {
+		.buf = buf,
+		.topic = topic,
+		.topic_len = topic_len,
+		.len = len,
+		.qos = qos,
+		.enqueued_at = xTaskGetTickCount(),
+	};
+	UBaseType_t depth;
+
+	configASSERT( lane < IOTC_LANE_COUNT );
+
+	if (lanes_pending == NULL) {
+		// Lanes not running yet, publish directly
+		return iotc_device_client_mqtt_publish_buffer(topic, topic_len, buf, len, qos);
+	}
+
+	if (xQueueSendToBack(lane_queues[lane], &msg, wait_ticks) != pdTRUE) {
+		taskENTER_CRITICAL();
+		lane_stats[lane].dropped++;
+		taskEXIT_CRITICAL();
+		iotc_device_client_mqtt_buffer_free(buf);
+		return MQTTNoMemory;
+	}
+
+	depth = uxQueueMessagesWaiting(lane_queues[lane]);
+
+	taskENTER_CRITICAL();
+	lane_stats[lane].enqueued++;
+	if (depth > lane_stats[lane].max_depth) {
+		lane_stats[lane].max_depth = (uint16_t) depth;
+	}
+	taskEXIT_CRITICAL();
+
+	xSemaphoreGive(lanes_pending);
+
+	return MQTTSuccess;
+}
+
+
+/* @brief	Get counters, depth and latency for each lane
+ */
+void iotc_publish_lanes_get_stats(IotcPublishLaneStats stats[IOTC_LANE_COUNT])
+{
+	taskENTER_CRITICAL();
+	memcpy(stats, lane_stats, sizeof(lane_stats));
+	taskEXIT_CRITICAL();
+
+	for (int i = 0; i < IOTC_LANE_COUNT; i++) {
+		stats[i].depth = lane_queues[i] ? (uint16_t) uxQueueMessagesWaiting(lane_queues[i]) : 0;
+	}
+}
+
+
+/* @brief	Hand queued messages to the MQTT agent in lane priority order
+ */
+static void lane_dispatch_task(void *pvParameters)
+{
+	(void) pvParameters;
+	LaneMessage msg;
+	MQTTStatus_t status;
+	uint32_t latency_ms;
+	int lane;
+
+	while (1) {
+		xSemaphoreTake(lanes_pending, portMAX_DELAY);
+
+		// Choose the lane only once a publish can start so late high priority messages go first
+		while (!iotc_device_client_mqtt_wait_for_window(pdMS_TO_TICKS(MQTT_PUBLISH_WINDOW_WAIT_MS))) {
+			;
+		}
+
+		lane = lane_select(iotc_device_client_mqtt_wait_for_qos1_window(0));
+		if (lane < 0) {
+			// Everything queued is QoS1 and waiting for a PUBACK to free a state record
+			xSemaphoreGive(lanes_pending);
+			(void) iotc_device_client_mqtt_wait_for_qos1_window(pdMS_TO_TICKS(IOTC_LANE_QOS1_RETRY_MS));
+			continue;
+		}
+
+		if (xQueueReceive(lane_queues[lane], &msg, 0) != pdTRUE) {
+			continue;
+		}
+
+		latency_ms = (uint32_t) ((xTaskGetTickCount() - msg.enqueued_at) * portTICK_PERIOD_MS);
+
+		status = iotc_device_client_mqtt_publish_buffer(msg.topic, msg.topic_len, msg.buf, msg.len, msg.qos);
+
+		taskENTER_CRITICAL();
+		if (status == MQTTSuccess) {
+			lane_stats[lane].sent++;
+		} else {
+			lane_stats[lane].failed++;
+		}
+		lane_stats[lane].latency_last_ms = latency_ms;
+		lane_stats[lane].latency_total_ms += latency_ms;
+		if (latency_ms > lane_stats[lane].latency_max_ms) {
+			lane_stats[lane].latency_max_ms = latency_ms;
+		}
+		taskEXIT_CRITICAL();
+	}
+}
+
+
+/* @brief	Pick the lane to publish from next, or -1 if none has a message that can be sent
+ *
+ * @param	qos1_ok, false to skip lanes whose next message is QoS1
+ */
+static int lane_select(bool qos1_ok)
+{
+#if IOTC_LANE_SCHEDULING == IOTC_LANE_SCHED_WEIGHTED
+	for (int pass = 0; pass < 2; pass++) {
+		for (int i = 0; i < IOTC_LANE_COUNT; i++) {
+			if (lane_credits[i] > 0 && lane_ready(i, qos1_ok)) {
+				lane_credits[i]--;
+				return i;
+			}
+		}
+
+		// Every waiting lane has used its share of this round
+		for (int i = 0; i < IOTC_LANE_COUNT; i++) {
+			lane_credits[i] = lane_weights[i];
+		}
+	}
+#else
+	for (int i = 0; i < IOTC_LANE_COUNT; i++) {
+		if (lane_ready(i, qos1_ok)) {
+			return i;
+		}
+	}
+#endif
+
+	return -1;
+}
+
+
+/* @brief	Determine if a lane has a message that can be sent now
+ */
+static bool lane_ready(int lane, bool qos1_ok)
+{
+	LaneMessage head;
+
+	if (xQueuePeek(lane_queues[lane], &head, 0) != pdTRUE) {
+		return false;
+	}
+
+	return qos1_ok || head.qos != MQTTQoS1;
+}
@@ -0,0 +1,452 @@
+/*
+ * iotc_telemetry_journal.c
+ *
+ * Persistent, append-only telemetry journal on the littlefs instance shared with the
+ * rest of the application.
+ *
+ * While the MQTT connection is down telemetry messages are appended to the newest of a
+ * series of numbered segment files instead of being published.  Once connected again a
+ * drain task reads the segments back oldest first and publishes each record, deleting
+ * a segment when it has been fully sent.  Segments are only ever appended to and then
+ * removed whole, and syncs are batched, which keeps littlefs metadata churn low.
+ *
+ * Each record is stored as a 16 bit little endian length followed by the payload.
+ * Delivery is at-least-once: a reboot part way through draining a segment resends
+ * that segment from its start.
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+
+#include "lfs.h"
+#include "lfs_port.h"
+
+#include "iotcl_log.h"
+#include "iotc_mqtt_client.h"
+#include "iotc_telemetry_journal.h"
+
+
+#define JOURNAL_PATH_MAX			( sizeof(IOTC_JOURNAL_DIR) + 10 )
+#define JOURNAL_RECORD_HDR_LEN		( 2 )
+
+static lfs_t *lfs = NULL;
+static SemaphoreHandle_t journal_lock = NULL;
+static const IotcTopic *journal_topic = NULL;
+
+// Segments head_seq .. head_seq + segment_count - 1 exist on the file system
+static uint32_t head_seq = 0;
+static uint32_t next_seq = 0;
+static uint32_t segment_count = 0;
+
+static lfs_file_t writer_file;
+static bool writer_open = false;
+static uint32_t writer_seq = 0;
+static uint32_t writer_size = 0;
+static uint32_t writer_unsynced = 0;
+
+static lfs_file_t reader_file;
+static bool reader_open = false;
+
+static IotcTelemetryJournalStats journal_stats;
+
+
+static void journal_drain_task(void *pvParameters);
+static bool journal_drain_one(void);
+static void journal_scan(void);
+static void journal_close_writer(void);
+static void journal_delete_head(bool discarded);
+static void segment_path(char *path, uint32_t seq);
+
+
+/* @brief	Open the journal and start draining any records left from a previous run
+ *
+ * @param	topic, registered topic drained records are published to
+ */
+int iotc_telemetry_journal_init(IotcTopicId topic)
+{
+	BaseType_t xResult;
+	int status;
+
+	if (journal_lock != NULL) {
+		return 0;
+	}
+
+	journal_topic = iotc_topic_get(topic);
+	if (journal_topic == NULL) {
+		IOTCL_ERROR(topic, "Journal: topic not available");
+		return -1;
+	}
+
+	lfs = pxGetDefaultFsCtx();
+	if (lfs == NULL) {
+		IOTCL_ERROR(0, "Journal: no file system available");
+		return -1;
+	}
+
+	status = lfs_mkdir(lfs, IOTC_JOURNAL_DIR);
+	if (status != LFS_ERR_OK && status != LFS_ERR_EXIST) {
+		IOTCL_ERROR(status, "Journal: failed to create %s", IOTC_JOURNAL_DIR);
+		return -1;
+	}
+
+	journal_lock = xSemaphoreCreateMutex();
+	if (journal_lock == NULL) {
+		IOTCL_ERROR(0, "Journal: failed to create mutex");
+		return -1;
+	}
+
+	journal_scan();
+
+	xResult = xTaskCreate(journal_drain_task, "iotc_journal", 1024, NULL, 8, NULL);
+	if (xResult != pdTRUE) {
+		IOTCL_ERROR(xResult, "Journal: failed to create drain task");
+		return -1;
+	}
+
+	IOTCL_INFO("Journal: %lu segments pending", (unsigned long) segment_count);
+	return 0;
+}
+
+
+/* @brief	Store a telemetry message if it cannot be published now
+ *
+ * A message is journaled when the client is disconnected, or when earlier messages
+ * are still waiting to be drained so that ordering is preserved.  Never waits on the
+ * connection.
+ *
+ * Returns true if the message was taken by the journal, in which case the caller must
+ * not publish it.  Returns false if the caller should publish it as usual.
+ */
+bool iotc_telemetry_journal_capture(const void *payload, size_t len)
+{
+	uint8_t hdr[JOURNAL_RECORD_HDR_LEN];
+	char path[JOURNAL_PATH_MAX];
+	bool taken = false;
+	int status;
+
+	if (journal_lock == NULL) {
+		return false;
+	}
+
+	if (iotc_device_client_is_connected() && iotc_telemetry_journal_is_empty()) {
+		return false;
+	}
+
+	if (len == 0 || len > MQTT_PUBLISH_MAX_LEN) {
+		IOTCL_ERROR(len, "Journal: cannot store %u byte message", (unsigned) len);
+		return false;
+	}
+
+	xSemaphoreTake(journal_lock, portMAX_DELAY);
+
+	if (!writer_open) {
+		if (segment_count >= IOTC_JOURNAL_MAX_SEGMENTS) {
+			IOTCL_WARN(0, "Journal: full, discarding oldest segment");
+			journal_delete_head(true);
+		}
+
+		// The sequence number is only used up once its segment exists, or replay would see a gap
+		writer_seq = next_seq;
+		segment_path(path, writer_seq);
+		status = lfs_file_open(lfs, &writer_file, path, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+		if (status != LFS_ERR_OK) {
+			IOTCL_ERROR(status, "Journal: failed to open %s", path);
+			journal_stats.write_errors++;
+			goto done;
+		}
+		next_seq++;
+
+		if (segment_count == 0) {
+			head_seq = writer_seq;
+		}
+		segment_count++;
+		writer_open = true;
+		writer_size = 0;
+		writer_unsynced = 0;
+	}
+
+	hdr[0] = (uint8_t) (len & 0xff);
+	hdr[1] = (uint8_t) (len >> 8);
+
+	if (lfs_file_write(lfs, &writer_file, hdr, sizeof(hdr)) != sizeof(hdr) ||
+			lfs_file_write(lfs, &writer_file, payload, len) != (lfs_ssize_t) len) {
+		IOTCL_ERROR(0, "Journal: write failed");
+		journal_stats.write_errors++;
+		journal_close_writer();
+		goto done;
+	}
+
+	taken = true;
+	journal_stats.stored++;
+	writer_size += sizeof(hdr) + len;
+
+	if (writer_size >= IOTC_JOURNAL_SEGMENT_SIZE) {
+		journal_close_writer();
+	} else if (++writer_unsynced >= IOTC_JOURNAL_SYNC_RECORDS) {
+		lfs_file_sync(lfs, &writer_file);
+		writer_unsynced = 0;
+	}
+
+done:
+	xSemaphoreGive(journal_lock);
+	return taken;
+}
+
+
+/*
+ *
+ */
+bool iotc_telemetry_journal_is_empty(void)
+{
+	bool empty;
+
+	if (journal_lock == NULL) {
+		return true;
+	}
+
+	xSemaphoreTake(journal_lock, portMAX_DELAY);
+	empty = (segment_count == 0);
+	xSemaphoreGive(journal_lock);
+
+	return empty;
+}
+
+
+/*
+ *
+ */
+void iotc_telemetry_journal_get_stats(IotcTelemetryJournalStats *stats)
+{
+	if (journal_lock == NULL) {
+		memset(stats, 0, sizeof(*stats));
+		return;
+	}
+
+	xSemaphoreTake(journal_lock, portMAX_DELAY);
+	*stats = journal_stats;
+	stats->segments = segment_count;
+	xSemaphoreGive(journal_lock);
+}
+
+
+/*-----------------------------------------------------------*/
+
+
+/* @brief	Publish journaled records, oldest first, whenever the client is connected
+ */
+static void journal_drain_task(void *pvParameters)
+{
+	( void ) pvParameters;
+
+	while (1) {
+		if (iotc_telemetry_journal_is_empty() || !iotc_device_client_is_connected()) {
+			vTaskDelay(pdMS_TO_TICKS(IOTC_JOURNAL_IDLE_POLL_MS));
+			continue;
+		}
+
+		if (!journal_drain_one()) {
+			vTaskDelay(pdMS_TO_TICKS(IOTC_JOURNAL_IDLE_POLL_MS));
+		} else if (IOTC_JOURNAL_DRAIN_INTERVAL_MS > 0) {
+			vTaskDelay(pdMS_TO_TICKS(IOTC_JOURNAL_DRAIN_INTERVAL_MS));
+		}
+	}
+}
+
+
+/* @brief	Publish the next journaled record
+ *
+ * The record is read straight into a publish buffer and queued on the bulk lane so it
+ * never delays acknowledgements or live telemetry.  If it cannot be queued the read
+ * position is restored so the record is retried later.
+ *
+ * Returns true if progress was made.
+ */
+static bool journal_drain_one(void)
+{
+	uint8_t hdr[JOURNAL_RECORD_HDR_LEN];
+	char path[JOURNAL_PATH_MAX];
+	lfs_soff_t record_start;
+	size_t capacity;
+	size_t len;
+	char *buf;
+	bool progress = false;
+
+	buf = iotc_device_client_mqtt_buffer_alloc_for_lane(IOTC_LANE_BULK, pdMS_TO_TICKS(MQTT_PUBLISH_BUFFER_WAIT_MS),
+			&capacity);
+	if (buf == NULL) {
+		return false;
+	}
+
+	xSemaphoreTake(journal_lock, portMAX_DELAY);
+
+	if (segment_count == 0) {
+		goto done;
+	}
+
+	if (!reader_open) {
+		// Never read a segment that is still being written to; start a new one instead
+		if (writer_open && writer_seq == head_seq) {
+			journal_close_writer();
+		}
+
+		segment_path(path, head_seq);
+		if (lfs_file_open(lfs, &reader_file, path, LFS_O_RDONLY) != LFS_ERR_OK) {
+			IOTCL_ERROR(0, "Journal: failed to open %s, skipping", path);
+			journal_delete_head(true);
+			progress = true;
+			goto done;
+		}
+		reader_open = true;
+	}
+
+	record_start = lfs_file_seek(lfs, &reader_file, 0, LFS_SEEK_CUR);
+
+	if (lfs_file_read(lfs, &reader_file, hdr, sizeof(hdr)) != sizeof(hdr)) {
+		// End of segment (or a partial header from a power failure); this segment is done
+		journal_delete_head(false);
+		progress = true;
+		goto done;
+	}
+
+	len = (size_t) hdr[0] | ((size_t) hdr[1] << 8);
+	if (len == 0 || len > capacity ||
+			lfs_file_read(lfs, &reader_file, buf, len) != (lfs_ssize_t) len) {
+		IOTCL_ERROR(len, "Journal: damaged record, discarding rest of segment");
+		journal_delete_head(true);
+		progress = true;
+		goto done;
+	}
+
+	xSemaphoreGive(journal_lock);
+
+	if (iotc_publish_lane_enqueue(IOTC_LANE_BULK, journal_topic->name, journal_topic->len, buf, len, MQTT_PUBLISH_QOS,
+			pdMS_TO_TICKS(MQTT_PUBLISH_WINDOW_WAIT_MS)) != MQTTSuccess) {
+		// Buffer has been released by the enqueue call. Rewind so this record is sent next time.
+		xSemaphoreTake(journal_lock, portMAX_DELAY);
+		if (reader_open) {
+			lfs_file_seek(lfs, &reader_file, record_start, LFS_SEEK_SET);
+		}
+		xSemaphoreGive(journal_lock);
+		return false;
+	}
+
+	xSemaphoreTake(journal_lock, portMAX_DELAY);
+	journal_stats.drained++;
+	xSemaphoreGive(journal_lock);
+	return true;
+
+done:
+	xSemaphoreGive(journal_lock);
+	iotc_device_client_mqtt_buffer_free(buf);
+	return progress;
+}
+
+
+/* @brief	Find the segments left over from a previous run
+ *
+ * Segment names are their sequence number in hex, so the range is the lowest to the
+ * highest name found.  New segments continue after the highest.
+ */
+static void journal_scan(void)
+{
+	struct lfs_info info;
+	lfs_dir_t dir;
+	bool found = false;
+	uint32_t lo = 0;
+	uint32_t hi = 0;
+
+	if (lfs_dir_open(lfs, &dir, IOTC_JOURNAL_DIR) != LFS_ERR_OK) {
+		return;
+	}
+
+	while (lfs_dir_read(lfs, &dir, &info) > 0) {
+		char *end;
+		uint32_t seq;
+
+		if (info.type != LFS_TYPE_REG) {
+			continue;
+		}
+
+		seq = (uint32_t) strtoul(info.name, &end, 16);
+		if (*end != '\0') {
+			continue;
+		}
+
+		if (!found || seq < lo) {
+			lo = seq;
+		}
+		if (!found || seq > hi) {
+			hi = seq;
+		}
+		found = true;
+	}
+
+	lfs_dir_close(lfs, &dir);
+
+	if (found) {
+		head_seq = lo;
+		next_seq = hi + 1;
+		segment_count = hi - lo + 1;
+	}
+}
+
+
+/*
+ *
+ */
+static void journal_close_writer(void)
+{
+	if (writer_open) {
+		lfs_file_close(lfs, &writer_file);
+		writer_open = false;
+	}
+}
+
+
+/* @brief	Remove the oldest segment
+ *
+ * @param	discarded, true if the segment still held undrained records
+ *
+ * Must be called with journal_lock held.
+ */
+static void journal_delete_head(bool discarded)
+{
+	char path[JOURNAL_PATH_MAX];
+
+	if (segment_count == 0) {
+		return;
+	}
+
+	if (reader_open) {
+		lfs_file_close(lfs, &reader_file);
+		reader_open = false;
+	}
+
+	if (discarded) {
+		journal_stats.dropped_segments++;
+	}
+
+	if (writer_open && writer_seq == head_seq) {
+		journal_close_writer();
+	}
+
+	segment_path(path, head_seq);
+	lfs_remove(lfs, path);
+
+	head_seq++;
+	segment_count--;
+}
+
+
+/*
+ *
+ */
+static void segment_path(char *path, uint32_t seq)
+{
+	snprintf(path, JOURNAL_PATH_MAX, IOTC_JOURNAL_DIR "/%08lx", (unsigned long) seq);
+}
@@ -0,0 +1,235 @@
+/*
+ * iotc_telemetry_submit.c
+ *
+ * Bounded multi-producer, single-consumer ring of telemetry samples.  Each slot carries
+ * a sequence number, as in Dmitry Vyukov's bounded queue: a producer claims a slot by
+ * advancing the enqueue position with compare-and-swap, copies its sample in and then
+ * publishes the slot by storing its sequence number.  Producers never wait for each
+ * other or take a critical section, so tasks and ISRs can submit at any time.  When the
+ * ring is full the new sample is dropped and counted.
+ *
+ * The receiving task is only woken with a task notification while it is waiting, so
+ * submitting normally makes no kernel call at all.
+ */
+
+#include <string.h>
+#include <stdatomic.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "iotcl_log.h"
+#include "iotc_telemetry_submit.h"
+
+#if (IOTC_TELEMETRY_RING_LENGTH & (IOTC_TELEMETRY_RING_LENGTH - 1)) != 0
+#error "IOTC_TELEMETRY_RING_LENGTH must be a power of two"
+#endif
+
+#if IOTC_TELEMETRY_NOTIFY_IDX >= configTASK_NOTIFICATION_ARRAY_ENTRIES
+#error "IOTC_TELEMETRY_NOTIFY_IDX needs a larger configTASK_NOTIFICATION_ARRAY_ENTRIES"
+#endif
+
+#define RING_MASK		(IOTC_TELEMETRY_RING_LENGTH - 1)
+
+typedef struct {
+	atomic_uint_fast32_t sequence;	// position + 1 once published, position + ring length once free again
+	IotcTelemetrySample sample;
+} RingSlot;
+
+static RingSlot ring[IOTC_TELEMETRY_RING_LENGTH];
+static atomic_uint_fast32_t enqueue_pos;
+static uint32_t dequeue_pos;		// only used by the receiver
+static atomic_bool receiver_waiting;
+static TaskHandle_t receiver_task = NULL;
+
+static atomic_uint_fast32_t submitted;
+static atomic_uint_fast32_t dropped_full;
+static atomic_uint_fast32_t dropped_too_large;
+static uint32_t received;
+static uint16_t high_water;
+
+static bool ring_push(uint16_t type, const void *data, size_t len, TickType_t now);
+static bool ring_pop(IotcTelemetrySample *sample);
+
+
+/* @brief	Empty the ring and set the task that receives samples
+ *
+ * @param	receiver, the task that calls iotc_telemetry_receive(), NULL for the calling task
+ *
+ * Call before any sample is submitted.
+ */
+int iotc_telemetry_submit_init(TaskHandle_t receiver)
+{
+	if (!atomic_is_lock_free(&enqueue_pos)) {
+		IOTCL_WARN(0, "Telemetry ring atomics are not lock-free on this target");
+	}
+
+	for (uint32_t i = 0; i < IOTC_TELEMETRY_RING_LENGTH; i++) {
+		atomic_init(&ring[i].sequence, i);
+	}
+	atomic_init(&enqueue_pos, 0);
+	atomic_init(&receiver_waiting, false);
+	dequeue_pos = 0;
+	receiver_task = (receiver != NULL) ? receiver : xTaskGetCurrentTaskHandle();
+
+	return 0;
+}
+
+
+/* @brief	Queue a sample for the telemetry task. Never blocks.
+ *
+ * Returns false if the sample was dropped because the ring is full or it is too large.
+ */
+bool iotc_telemetry_submit(uint16_t type, const void *data, size_t len)
+{
+	if (!ring_push(type, data, len, xTaskGetTickCount())) {
+		return false;
+	}
+
+	if (atomic_load(&receiver_waiting)) {
+		xTaskNotifyGiveIndexed(receiver_task, IOTC_TELEMETRY_NOTIFY_IDX);
+	}
+	return true;
+}
+
+
+/* @brief	iotc_telemetry_submit() for interrupt handlers
+ *
+ * @param	higher_priority_task_woken, as for other FreeRTOS FromISR functions
+ */
+bool iotc_telemetry_submit_from_isr(uint16_t type, const void *data, size_t len,
+		BaseType_t *higher_priority_task_woken)
+{
+	if (!ring_push(type, data, len, xTaskGetTickCountFromISR())) {
+		return false;
+	}
+
+	if (atomic_load(&receiver_waiting)) {
+		vTaskNotifyGiveIndexedFromISR(receiver_task, IOTC_TELEMETRY_NOTIFY_IDX, higher_priority_task_woken);
+	}
+	return true;
+}
+
+
+/* @brief	Take the oldest sample, waiting up to wait_ticks for one to be submitted
+ *
+ * Must only be called from the receiver task.  Returns false if none arrived in time.
+ */
+bool iotc_telemetry_receive(IotcTelemetrySample *sample, TickType_t wait_ticks)
+{
+	TimeOut_t timeout;
+
+	vTaskSetTimeOutState(&timeout);
+
+	while (!ring_pop(sample)) {
+		// Announce the wait before looking again, so a sample published in between
+		// either is seen here or sends a notification
+		atomic_store(&receiver_waiting, true);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (ring_pop(sample)) {
+			break;
+		}
+
+		if (xTaskCheckForTimeOut(&timeout, &wait_ticks) != pdFALSE) {
+			atomic_store(&receiver_waiting, false);
+			return false;
+		}
+		(void) ulTaskNotifyTakeIndexed(IOTC_TELEMETRY_NOTIFY_IDX, pdTRUE, wait_ticks);
+	}
+
+	atomic_store(&receiver_waiting, false);
+	return true;
+}
+
+
+/*
+ *
+ */
+void iotc_telemetry_submit_get_stats(IotcTelemetrySubmitStats *stats)
+{
+	uint32_t claimed = (uint32_t) atomic_load(&enqueue_pos);
+
+	if (stats == NULL) {
+		return;
+	}
+
+	stats->submitted = (uint32_t) atomic_load(&submitted);
+	stats->received = received;
+	stats->dropped_full = (uint32_t) atomic_load(&dropped_full);
+	stats->dropped_too_large = (uint32_t) atomic_load(&dropped_too_large);
+	stats->depth = (uint16_t) (claimed - dequeue_pos);
+	stats->high_water = high_water;
+}
+
+
+/* @brief	Claim a slot, copy the sample in and publish it
+ */
+static bool ring_push(uint16_t type, const void *data, size_t len, TickType_t now)
+{
+	uint_fast32_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+	RingSlot *slot;
+
+	if (len > IOTC_TELEMETRY_SAMPLE_MAX_LEN || (data == NULL && len != 0)) {
+		atomic_fetch_add_explicit(&dropped_too_large, 1, memory_order_relaxed);
+		return false;
+	}
+
+	for (;;) {
+		uint_fast32_t sequence;
+		int32_t diff;
+
+		slot = &ring[pos & RING_MASK];
+		sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+		diff = (int32_t) ((uint32_t) sequence - (uint32_t) pos);
+
+		if (diff == 0) {
+			// The slot is free for this position; try to claim it
+			if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed)) {
+				break;
+			}
+		} else if (diff < 0) {
+			// The receiver has not freed this slot yet: the ring is full
+			atomic_fetch_add_explicit(&dropped_full, 1, memory_order_relaxed);
+			return false;
+		} else {
+			// Another producer claimed this position first
+			pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+		}
+	}
+
+	slot->sample.type = type;
+	slot->sample.len = (uint16_t) len;
+	slot->sample.submitted_at = now;
+	if (len) {
+		memcpy(slot->sample.data.bytes, data, len);
+	}
+
+	atomic_store_explicit(&slot->sequence, pos + 1, memory_order_seq_cst);
+	atomic_fetch_add_explicit(&submitted, 1, memory_order_relaxed);
+	return true;
+}
+
+
+/* @brief	Take the next published sample. Returns false if there is none yet.
+ */
+static bool ring_pop(IotcTelemetrySample *sample)
+{
+	RingSlot *slot = &ring[dequeue_pos & RING_MASK];
+	uint32_t depth;
+
+	if ((uint32_t) atomic_load_explicit(&slot->sequence, memory_order_acquire) != dequeue_pos + 1) {
+		return false;
+	}
+
+	depth = (uint32_t) atomic_load_explicit(&enqueue_pos, memory_order_relaxed) - dequeue_pos;
+	if (depth > high_water) {
+		high_water = (uint16_t) depth;
+	}
+
+	memcpy(sample, &slot->sample, offsetof(IotcTelemetrySample, data) + slot->sample.len);
+	atomic_store_explicit(&slot->sequence, dequeue_pos + IOTC_TELEMETRY_RING_LENGTH, memory_order_release);
+	dequeue_pos++;
+	received++;
+	return true;
+}
@@ -6,6 +6,7 @@
 
 #include "sntp.h"
 #include <time.h>
+#include <string.h>
 #include "FreeRTOS.h"
 #include "task.h"
 #include "iotcl.h"
@@ -18,6 +19,7 @@
 #include "stdbool.h"
 #include "event_groups.h"
 #include "sys_evt.h"
+#include "iotc_time.h"
 
 #define SNTP_SERVER_NAME					"pool.ntp.org"
 
@@ -27,10 +29,25 @@
 
 static volatile bool callback_received = false;	/* Indicate we have received a response and that the time has been set */
 static time_t timenow = 0;
-static uint32_t	unix_time_base;				/* System clock time offset for UTC.  */
+static uint64_t	unix_ms_base;				/* UTC in milliseconds when the tick count was 0 */
 
 /*
- * FIXME: 32-bit integers are used for some of these functions and for unix_time_base.
+ * The date and time of the last timestamp formatted.  Telemetry is stamped many times a
+ * second, so usually only the milliseconds differ from the last one.
+ */
+static struct {
+	bool valid;
+	uint64_t seconds;
+	char text[IOTC_ISO_TIMESTAMP_BUFFER_LEN];
+} iso_cache;
+
+static void time_set_ms(uint64_t unix_ms);
+static uint64_t time_now_ms(void);
+static void time_format_seconds(char *buf, uint64_t seconds);
+static void time_put_digits(char *p, uint32_t value, int count);
+
+/*
+ * FIXME: 32-bit integers are used for some of these functions and for the tick count.
  */
 uint32_t tx_time_get(void)
 {
@@ -39,14 +56,13 @@ uint32_t tx_time_get(void)
 
 void set_time(uint32_t unix_seconds)
 {
-	uint32_t system_time_in_seconds = tx_time_get() / configTICK_RATE_HZ;
-    unix_time_base = (unix_seconds - system_time_in_seconds);
+	time_set_ms((uint64_t) unix_seconds * 1000);
 }
 
 int unix_time_get(uint32_t *unix_time)
 {
     /* Return number of seconds since Unix Epoch (1/1/1970 00:00:00).  */
-	*unix_time =  unix_time_base + (tx_time_get() / configTICK_RATE_HZ);
+	*unix_time = (uint32_t) (time_now_ms() / 1000);
 	return 0;
 }
 
@@ -58,10 +74,123 @@ time_t time(time_t *t)
 	return (time_t) time_now;
 }
 
+/* @brief	Milliseconds since the Unix epoch
+ *
+ * Returns false, with the time since boot, until the time has been set by SNTP.
+ */
+bool iotc_time_get_ms(uint64_t *unix_ms)
+{
+	*unix_ms = time_now_ms();
+	return callback_received;
+}
+
+
+/* @brief	Format unix_ms as "2024-01-01T00:00:00.000Z"
+ *
+ * @param	buf, IOTC_ISO_TIMESTAMP_BUFFER_LEN bytes
+ *
+ * Only the milliseconds are formatted when unix_ms is in the same second as the last call.
+ * Returns IOTC_ISO_TIMESTAMP_LEN.
+ */
+size_t iotc_time_format_iso(char *buf, uint64_t unix_ms)
+{
+	uint64_t seconds = unix_ms / 1000;
+	bool cached;
+
+	taskENTER_CRITICAL();
+	cached = iso_cache.valid && iso_cache.seconds == seconds;
+	if (cached) {
+		memcpy(buf, iso_cache.text, IOTC_ISO_TIMESTAMP_BUFFER_LEN);
+	}
+	taskEXIT_CRITICAL();
+
+	if (!cached) {
+		time_format_seconds(buf, seconds);
+
+		taskENTER_CRITICAL();
+		memcpy(iso_cache.text, buf, IOTC_ISO_TIMESTAMP_BUFFER_LEN);
+		iso_cache.seconds = seconds;
+		iso_cache.valid = true;
+		taskEXIT_CRITICAL();
+	}
+
+	time_put_digits(&buf[20], (uint32_t) (unix_ms % 1000), 3);
+	return IOTC_ISO_TIMESTAMP_LEN;
+}
+
+
+/* @brief	Set the clock, keeping the milliseconds SNTP provides
+ */
+static void time_set_ms(uint64_t unix_ms)
+{
+	taskENTER_CRITICAL();
+	unix_ms_base = unix_ms - (uint64_t) tx_time_get() * 1000 / configTICK_RATE_HZ;
+	taskEXIT_CRITICAL();
+}
+
+
+/* @brief	Current UTC in milliseconds, or the time since boot until the clock is set
+ *
+ * The 64 bit base is read in a critical section, as it is not written atomically.
+ */
+static uint64_t time_now_ms(void)
+{
+	uint64_t base;
+	uint32_t ticks;
+
+	taskENTER_CRITICAL();
+	base = unix_ms_base;
+	ticks = tx_time_get();
+	taskEXIT_CRITICAL();
+
+	return base + (uint64_t) ticks * 1000 / configTICK_RATE_HZ;
+}
+
+
+/* @brief	Format everything but the milliseconds, without gmtime() and strftime()
+ *
+ * The date is from Howard Hinnant's civil_from_days().
+ */
+static void time_format_seconds(char *buf, uint64_t seconds)
+{
+	uint32_t days = (uint32_t) (seconds / 86400);
+	uint32_t second_of_day = (uint32_t) (seconds % 86400);
+	uint32_t z = days + 719468;
+	uint32_t era = z / 146097;
+	uint32_t doe = z - era * 146097;
+	uint32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	uint32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	uint32_t mp = (5 * doy + 2) / 153;
+	uint32_t day = doy - (153 * mp + 2) / 5 + 1;
+	uint32_t month = (mp < 10) ? mp + 3 : mp - 9;
+	uint32_t year = yoe + era * 400 + (month <= 2);
+
+	memcpy(buf, "0000-00-00T00:00:00.000Z", IOTC_ISO_TIMESTAMP_BUFFER_LEN);
+	time_put_digits(&buf[0], year, 4);
+	time_put_digits(&buf[5], month, 2);
+	time_put_digits(&buf[8], day, 2);
+	time_put_digits(&buf[11], second_of_day / 3600, 2);
+	time_put_digits(&buf[14], second_of_day / 60 % 60, 2);
+	time_put_digits(&buf[17], second_of_day % 60, 2);
+}
+
+
+/*
+ *
+ */
+static void time_put_digits(char *p, uint32_t value, int count)
+{
+	while (count-- > 0) {
+		p[count] = (char) ('0' + value % 10);
+		value /= 10;
+	}
+}
+
+
 void iotc_set_system_time_us(uint32_t sec, uint32_t us)
 {
 //    taskENTER_CRITICAL();
-    set_time(sec);
+    time_set_ms((uint64_t) sec * 1000 + us / 1000);
     callback_received = true;
 //    taskEXIT_CRITICAL();
 
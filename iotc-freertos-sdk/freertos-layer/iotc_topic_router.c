@@ -0,0 +1,622 @@
+/*
+ * iotc_topic_router.c
+ *
+ * Routes incoming MQTT publishes to handlers registered per topic filter.
+ *
+ * Filters are stored in a trie with one node per topic level.  Literal levels hang off
+ * a node's child list while '+' and '#' levels have their own links, so matching an
+ * incoming topic walks the trie one level at a time and only branches where a filter
+ * contains a wildcard.  Dispatch cost is proportional to the topic length rather than
+ * to the number of registered filters.
+ *
+ * Nodes, handlers and copies of the filter strings all come from static storage sized
+ * by the IOTC_TOPIC_ROUTER_* config macros.  Nothing is ever removed.
+ *
+ * Only one MQTT subscription is made for filters that are covered by another registered
+ * filter with at least the same QoS.  The broker delivers a single copy and the trie
+ * hands it to the handlers of every filter it matches.  A filter subscribed before a
+ * broader one was registered keeps its subscription, so the subscription manager calls
+ * the router once per matching subscription; only the first of them dispatches.
+ */
+
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "core_mqtt.h"
+#include "core_mqtt_agent.h"
+#include "mqtt_agent_task.h"
+#include "subscription_manager.h"
+
+#include "iotcl_log.h"
+#include "iotc_mqtt_client.h"
+#include "iotc_topic_router.h"
+
+#if IOTC_TOPIC_ROUTER_NOTIFY_IDX >= configTASK_NOTIFICATION_ARRAY_ENTRIES
+#error "IOTC_TOPIC_ROUTER_NOTIFY_IDX needs a larger configTASK_NOTIFICATION_ARRAY_ENTRIES"
+#endif
+
+#if IOTC_TOPIC_ROUTER_NOTIFY_IDX == MQTT_NOTIFY_IDX
+#error "IOTC_TOPIC_ROUTER_NOTIFY_IDX must differ from MQTT_NOTIFY_IDX, which publish completions notify"
+#endif
+
+// @brief	Number of attempts made to subscribe each filter
+#define TOPIC_ROUTER_SUBSCRIBE_RETRIES		( 20 )
+
+// @brief	Time to wait for the SUBACK when raising the QoS of a subscription
+#define TOPIC_ROUTER_SUBACK_WAIT_MS			( 10000 )
+
+typedef struct IotcTopicHandlerEntry {
+	IotcTopicHandler handler;
+	void *context;
+	struct IotcTopicHandlerEntry *next;
+} IotcTopicHandlerEntry;
+
+typedef struct IotcTopicNode {
+	const char *level;					// points into filter_storage, not NUL terminated
+	uint16_t level_len;
+	struct IotcTopicNode *children;		// literal child levels
+	struct IotcTopicNode *sibling;
+	struct IotcTopicNode *plus;			// '+' child level
+	struct IotcTopicNode *hash;			// '#' child level, always a leaf
+	IotcTopicHandlerEntry *handlers;
+} IotcTopicNode;
+
+typedef struct {
+	const char *filter;					// NUL terminated copy in filter_storage
+	uint16_t filter_len;
+	MQTTQoS_t qos;
+	bool subscribed;					// delivered, by its own subscription or a covering one
+	bool has_subscription;				// has its own subscription with the broker
+} IotcTopicFilter;
+
+static IotcTopicNode root;
+static IotcTopicNode nodes[IOTC_TOPIC_ROUTER_MAX_NODES];
+static size_t node_count;
+static IotcTopicHandlerEntry handler_entries[IOTC_TOPIC_ROUTER_MAX_HANDLERS];
+static size_t handler_count;
+static IotcTopicFilter filters[IOTC_TOPIC_ROUTER_MAX_FILTERS];
+static size_t filter_count;
+static char filter_storage[IOTC_TOPIC_ROUTER_FILTER_STORAGE];
+static size_t filter_storage_used;
+
+
+static const char *level_end(const char *level, const char *end);
+static IotcTopicFilter *find_filter(const char *filter, size_t len);
+static bool filter_is_valid(const char *filter, size_t len);
+static bool filter_covers(const IotcTopicFilter *outer, const IotcTopicFilter *inner);
+static bool filter_is_covered(size_t index, bool by_subscription);
+static bool filter_matches(const IotcTopicFilter *f, const char *topic, const char *end);
+static MQTTStatus_t raise_subscription_qos(MQTTAgentHandle_t agent_handle, IotcTopicFilter *f);
+static void suback_callback(MQTTAgentCommandContext_t *context, MQTTAgentReturnInfo_t *return_info);
+static IotcTopicNode *insert_filter(const char *filter, size_t len);
+static void dispatch_level(const IotcTopicNode *node, const char *level, const char *end,
+		bool consumed, MQTTPublishInfo_t *publish_info);
+static void call_handlers(const IotcTopicNode *node, MQTTPublishInfo_t *publish_info);
+static void router_incoming_publish(void *context, MQTTPublishInfo_t *publish_info);
+
+
+/* @brief	Register a handler for publishes matching an MQTT topic filter
+ *
+ * Several handlers may be registered for the same filter and a publish is given to the
+ * handlers of every filter it matches.  Filters registered after connecting are only
+ * subscribed on the next call to iotc_topic_router_subscribe().
+ *
+ * @param	filter, MQTT topic filter, may contain '+' and '#' wildcards. It is copied.
+ * @param	qos, QoS to subscribe with.  The highest QoS registered for a filter is used.
+ * @param	handler, Function called on the MQTT agent task for each matching publish.
+ * @param	context, Passed to handler.
+ */
+int iotc_topic_router_register(const char *filter, MQTTQoS_t qos, IotcTopicHandler handler, void *context)
+{
+	IotcTopicFilter *f;
+	IotcTopicNode *node;
+	IotcTopicHandlerEntry *entry;
+	const char *error = NULL;
+	size_t len;
+
+	if (!filter || !handler) {
+		return -1;
+	}
+
+	len = strnlen(filter, UINT16_MAX);
+
+	if (!filter_is_valid(filter, len)) {
+		IOTCL_ERROR(0, "Invalid topic filter %s", filter);
+		return -1;
+	}
+
+	// Keep the agent task from dispatching while the trie is modified. Nothing in
+	// here may block or log.
+	vTaskSuspendAll();
+
+	do {
+		if (handler_count >= IOTC_TOPIC_ROUTER_MAX_HANDLERS) {
+			error = "handlers";
+			break;
+		}
+
+		f = find_filter(filter, len);
+
+		if (f == NULL) {
+			if (filter_count >= IOTC_TOPIC_ROUTER_MAX_FILTERS ||
+					filter_storage_used + len + 1 > sizeof(filter_storage)) {
+				error = "filter storage";
+				break;
+			}
+
+			f = &filters[filter_count];
+			memcpy(&filter_storage[filter_storage_used], filter, len);
+			filter_storage[filter_storage_used + len] = '\0';
+			f->filter = &filter_storage[filter_storage_used];
+			f->filter_len = (uint16_t) len;
+			f->qos = qos;
+			f->subscribed = false;
+			f->has_subscription = false;
+
+			// Trie levels point into the stored copy, so it is kept even if a partial
+			// insert fails
+			filter_storage_used += len + 1;
+
+			node = insert_filter(f->filter, len);
+			if (node == NULL) {
+				error = "nodes";
+				break;
+			}
+
+			filter_count++;
+		} else {
+			node = insert_filter(f->filter, f->filter_len);
+			if (qos > f->qos) {
+				f->qos = qos;
+				f->subscribed = false;
+			}
+		}
+
+		entry = &handler_entries[handler_count++];
+		entry->handler = handler;
+		entry->context = context;
+		entry->next = node->handlers;
+		node->handlers = entry;
+	} while (0);
+
+	(void) xTaskResumeAll();
+
+	if (error) {
+		IOTCL_ERROR(0, "Topic router %s exhausted registering %s", error, filter);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/* @brief	Subscribe to every registered filter that is not already subscribed
+ *
+ * Filters covered by another registered filter of at least the same QoS share its
+ * subscription and are not subscribed separately.  They are only marked subscribed
+ * once the covering subscription has been acknowledged.
+ */
+MQTTStatus_t iotc_topic_router_subscribe(MQTTAgentHandle_t agent_handle)
+{
+	MQTTStatus_t status = MQTTSuccess;
+
+	for (size_t i = 0; i < filter_count; i++) {
+		IotcTopicFilter *f = &filters[i];
+		int retries = 0;
+
+		if (f->subscribed) {
+			continue;
+		}
+
+		if (f->has_subscription) {
+			// Only the QoS changed.  Subscribing again through the subscription manager
+			// would add a second callback for the same filter.
+			status = raise_subscription_qos(agent_handle, f);
+		} else if (filter_is_covered(i, false)) {
+			continue;
+		} else {
+			do {
+				status = MqttAgent_SubscribeSync(agent_handle, f->filter, f->qos,
+						router_incoming_publish, f);
+				retries++;
+			} while (status != MQTTSuccess && retries < TOPIC_ROUTER_SUBSCRIBE_RETRIES);
+		}
+
+		if (status != MQTTSuccess) {
+			IOTCL_ERROR(status, "Failed to subscribe to topic %s", f->filter);
+			return status;
+		}
+
+		IOTCL_INFO("Subscribed to topic %s", f->filter);
+		f->has_subscription = true;
+		f->subscribed = true;
+	}
+
+	for (size_t i = 0; i < filter_count; i++) {
+		if (!filters[i].subscribed && filter_is_covered(i, true)) {
+			IOTCL_INFO("Topic %s is covered by another subscription", filters[i].filter);
+			filters[i].subscribed = true;
+		}
+	}
+
+	return status;
+}
+
+
+/* @brief	Pass an incoming publish to the handlers of every filter it matches
+ */
+void iotc_topic_router_dispatch(MQTTPublishInfo_t *publish_info)
+{
+	const char *topic = publish_info->pTopicName;
+	const char *end = topic + publish_info->topicNameLength;
+
+	// Topics starting with '$' are not matched by wildcards at the first level
+	if (publish_info->topicNameLength > 0 && topic[0] == '$') {
+		const char *next = level_end(topic, end);
+
+		for (const IotcTopicNode *child = root.children; child; child = child->sibling) {
+			if (child->level_len == (uint16_t) (next - topic) && memcmp(child->level, topic, child->level_len) == 0) {
+				dispatch_level(child, next + 1, end, next == end, publish_info);
+			}
+		}
+		return;
+	}
+
+	dispatch_level(&root, topic, end, false, publish_info);
+}
+
+
+/*
+ *
+ */
+static void router_incoming_publish(void *context, MQTTPublishInfo_t *publish_info)
+{
+	const char *topic = publish_info->pTopicName;
+	const char *end = topic + publish_info->topicNameLength;
+
+	// Each publish is routed once, by the first subscription that matches it
+	for (size_t i = 0; i < filter_count; i++) {
+		if (filters[i].has_subscription && filter_matches(&filters[i], topic, end)) {
+			if (&filters[i] == context) {
+				iotc_topic_router_dispatch(publish_info);
+			}
+			return;
+		}
+	}
+}
+
+
+/* @brief	Send a SUBSCRIBE for a filter that is already subscribed, to change its QoS
+ *
+ * The broker replaces the existing subscription.  The subscription manager's entry for
+ * the filter is left as it is.
+ */
+static MQTTStatus_t raise_subscription_qos(MQTTAgentHandle_t agent_handle, IotcTopicFilter *f)
+{
+	// The agent reads these after MQTTAgent_Subscribe() returns
+	static MQTTSubscribeInfo_t subscribe_info;
+	static MQTTAgentSubscribeArgs_t subscribe_args;
+	uint32_t notify_value = 0;
+	MQTTStatus_t status;
+
+	subscribe_info.qos = f->qos;
+	subscribe_info.pTopicFilter = f->filter;
+	subscribe_info.topicFilterLength = f->filter_len;
+	subscribe_args.pSubscribeInfo = &subscribe_info;
+	subscribe_args.numSubscriptions = 1;
+
+	MQTTAgentCommandInfo_t command_info = {
+		.blockTimeMs = TOPIC_ROUTER_SUBACK_WAIT_MS,
+		.cmdCompleteCallback = suback_callback,
+		.pCmdCompleteCallbackContext = (MQTTAgentCommandContext_t *) xTaskGetCurrentTaskHandle(),
+	};
+
+	xTaskNotifyStateClearIndexed(NULL, IOTC_TOPIC_ROUTER_NOTIFY_IDX);
+
+	status = MQTTAgent_Subscribe(agent_handle, &subscribe_args, &command_info);
+	if (status != MQTTSuccess) {
+		return status;
+	}
+
+	if (!xTaskNotifyWaitIndexed(IOTC_TOPIC_ROUTER_NOTIFY_IDX, 0, 0xFFFFFFFF, &notify_value,
+			pdMS_TO_TICKS(TOPIC_ROUTER_SUBACK_WAIT_MS))) {
+		return MQTTRecvFailed;
+	}
+
+	return (MQTTStatus_t) notify_value;
+}
+
+
+/*
+ *
+ */
+static void suback_callback(MQTTAgentCommandContext_t *context, MQTTAgentReturnInfo_t *return_info)
+{
+	MQTTStatus_t status = return_info->returnCode;
+
+	if (status == MQTTSuccess && return_info->pSubackCodes && return_info->pSubackCodes[0] == 0x80) {
+		status = MQTTServerRefused;
+	}
+
+	(void) xTaskNotifyIndexed((TaskHandle_t) context, IOTC_TOPIC_ROUTER_NOTIFY_IDX, (uint32_t) status,
+			eSetValueWithOverwrite);
+}
+
+
+/* @brief	Match the remaining topic levels below node
+ *
+ * @param	level, Start of the next topic level.
+ * @param	consumed, true when every level of the topic has been matched by node.
+ */
+static void dispatch_level(const IotcTopicNode *node, const char *level, const char *end,
+		bool consumed, MQTTPublishInfo_t *publish_info)
+{
+	const char *next;
+	bool last;
+
+	// '#' also matches the parent level, so "a/#" receives "a"
+	if (node->hash) {
+		call_handlers(node->hash, publish_info);
+	}
+
+	if (consumed) {
+		call_handlers(node, publish_info);
+		return;
+	}
+
+	next = level_end(level, end);
+	last = (next == end);
+
+	for (const IotcTopicNode *child = node->children; child; child = child->sibling) {
+		if (child->level_len == (uint16_t) (next - level) && memcmp(child->level, level, child->level_len) == 0) {
+			dispatch_level(child, next + 1, end, last, publish_info);
+			break;
+		}
+	}
+
+	if (node->plus) {
+		dispatch_level(node->plus, next + 1, end, last, publish_info);
+	}
+}
+
+
+/*
+ *
+ */
+static void call_handlers(const IotcTopicNode *node, MQTTPublishInfo_t *publish_info)
+{
+	for (const IotcTopicHandlerEntry *entry = node->handlers; entry; entry = entry->next) {
+		entry->handler(entry->context, publish_info);
+	}
+}
+
+
+/* @brief	Return a pointer to the '/' ending the level starting at level, or end
+ */
+static const char *level_end(const char *level, const char *end)
+{
+	const char *sep = memchr(level, '/', (size_t) (end - level));
+
+	return sep ? sep : end;
+}
+
+
+/* @brief	Find or create the trie node for a filter
+ *
+ * The caller must have checked the filter with filter_is_valid().
+ */
+static IotcTopicNode *insert_filter(const char *filter, size_t len)
+{
+	const char *end = filter + len;
+	const char *level = filter;
+	IotcTopicNode *node = &root;
+
+	while (true) {
+		const char *next = level_end(level, end);
+		uint16_t level_len = (uint16_t) (next - level);
+		IotcTopicNode **link;
+		IotcTopicNode *child = NULL;
+
+		if (level_len == 1 && level[0] == '+') {
+			link = &node->plus;
+			child = node->plus;
+		} else if (level_len == 1 && level[0] == '#') {
+			link = &node->hash;
+			child = node->hash;
+		} else {
+			link = &node->children;
+			for (child = node->children; child; child = child->sibling) {
+				if (child->level_len == level_len && memcmp(child->level, level, level_len) == 0) {
+					break;
+				}
+			}
+		}
+
+		if (child == NULL) {
+			if (node_count >= IOTC_TOPIC_ROUTER_MAX_NODES) {
+				return NULL;
+			}
+
+			child = &nodes[node_count++];
+			memset(child, 0, sizeof(*child));
+			child->level = level;
+			child->level_len = level_len;
+
+			if (link == &node->children) {
+				child->sibling = node->children;
+			}
+			*link = child;
+		}
+
+		node = child;
+
+		if (next == end) {
+			return node;
+		}
+		level = next + 1;
+	}
+}
+
+
+/*
+ *
+ */
+static IotcTopicFilter *find_filter(const char *filter, size_t len)
+{
+	for (size_t i = 0; i < filter_count; i++) {
+		if (filters[i].filter_len == len && memcmp(filters[i].filter, filter, len) == 0) {
+			return &filters[i];
+		}
+	}
+
+	return NULL;
+}
+
+
+/* @brief	Determine if another filter covers filters[index]
+ *
+ * @param	by_subscription, only count filters with their own subscription
+ *
+ * Of two filters that cover each other only the later one counts as covered.
+ */
+static bool filter_is_covered(size_t index, bool by_subscription)
+{
+	const IotcTopicFilter *f = &filters[index];
+
+	for (size_t j = 0; j < filter_count; j++) {
+		if (j == index || (by_subscription && !filters[j].has_subscription)) {
+			continue;
+		}
+
+		if (filter_covers(&filters[j], f) && (j < index || !filter_covers(f, &filters[j]))) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/* @brief	Determine if a topic matches a filter
+ */
+static bool filter_matches(const IotcTopicFilter *f, const char *topic, const char *end)
+{
+	const char *o = f->filter;
+	const char *o_end = o + f->filter_len;
+	const char *t = topic;
+
+	// Wildcards do not match topics beginning with '$'
+	if (t < end && t[0] == '$' && (o[0] == '+' || o[0] == '#')) {
+		return false;
+	}
+
+	while (true) {
+		const char *o_next = level_end(o, o_end);
+		const char *t_next = level_end(t, end);
+		size_t o_len = (size_t) (o_next - o);
+
+		if (o_len == 1 && o[0] == '#') {
+			return true;
+		}
+
+		if (!(o_len == 1 && o[0] == '+') &&
+				(o_len != (size_t) (t_next - t) || memcmp(o, t, o_len) != 0)) {
+			return false;
+		}
+
+		if (o_next == o_end || t_next == end) {
+			if (o_next == o_end && t_next == end) {
+				return true;
+			}
+			// "a/#" matches "a"
+			return (t_next == end && o_next + 2 == o_end && o_next[1] == '#');
+		}
+
+		o = o_next + 1;
+		t = t_next + 1;
+	}
+}
+
+
+/* @brief	Check wildcards only occupy a whole level and '#' is last
+ */
+static bool filter_is_valid(const char *filter, size_t len)
+{
+	if (len == 0) {
+		return false;
+	}
+
+	for (size_t i = 0; i < len; i++) {
+		if (filter[i] != '+' && filter[i] != '#') {
+			continue;
+		}
+
+		if (i > 0 && filter[i - 1] != '/') {
+			return false;
+		}
+
+		if (filter[i] == '#' && i != len - 1) {
+			return false;
+		}
+
+		if (filter[i] == '+' && i != len - 1 && filter[i + 1] != '/') {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/* @brief	Determine if every topic matched by inner is also matched by outer
+ */
+static bool filter_covers(const IotcTopicFilter *outer, const IotcTopicFilter *inner)
+{
+	const char *o = outer->filter;
+	const char *o_end = o + outer->filter_len;
+	const char *i = inner->filter;
+	const char *i_end = i + inner->filter_len;
+
+	if (outer->qos < inner->qos) {
+		return false;
+	}
+
+	// Wildcards do not match topics beginning with '$'
+	if (i[0] == '$' && (o[0] == '+' || o[0] == '#')) {
+		return false;
+	}
+
+	while (true) {
+		const char *o_next = level_end(o, o_end);
+		const char *i_next = level_end(i, i_end);
+		size_t o_len = (size_t) (o_next - o);
+		size_t i_len = (size_t) (i_next - i);
+
+		if (o_len == 1 && o[0] == '#') {
+			return true;
+		}
+
+		if (i_len == 1 && i[0] == '#') {
+			return false;
+		}
+
+		if (!(o_len == 1 && o[0] == '+')) {
+			if ((i_len == 1 && i[0] == '+') || o_len != i_len || memcmp(o, i, o_len) != 0) {
+				return false;
+			}
+		}
+
+		if (o_next == o_end || i_next == i_end) {
+			if (o_next == o_end && i_next == i_end) {
+				return true;
+			}
+			// "a/#" covers "a"
+			return (i_next == i_end && o_next + 2 == o_end && o_next[1] == '#');
+		}
+
+		o = o_next + 1;
+		i = i_next + 1;
+	}
+}
@@ -0,0 +1,148 @@
+/*
+ * iotc_topics.c
+ *
+ * Registry of the MQTT topics used by the SDK.
+ *
+ * The topics are formatted once, after identity has filled in the iotc-c-lib MQTT
+ * config, and kept with their lengths so the publish path never has to format or
+ * measure a topic string.  Callers publish by IotcTopicId.  Strings handed back by
+ * iotc-c-lib's send callback are matched by pointer first, so looking them up is
+ * usually a handful of compares.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "iotcl.h"
+#include "iotcl_log.h"
+#include "iotc_mqtt_client.h"
+#include "iotc_topics.h"
+
+static IotcTopic topics[IOTC_TOPIC_COUNT];
+static char topic_storage[IOTC_TOPICS_STORAGE];
+static size_t topic_storage_used;
+
+
+static int topic_set(IotcTopicId id, const char *source, const char *format, const char *arg,
+		MQTTQoS_t qos, IotcPublishLane lane);
+
+
+/* @brief	Format the SDK's topics from the iotc-c-lib MQTT config
+ *
+ * @param	from_discovery, true if the c2d topic came from discovery and identity. Otherwise
+ *          it is built from SUBSCRIBE_TOPIC_FORMAT and the client id.
+ *
+ * Must be called after iotcl_init() and identity, before connecting.
+ */
+int iotc_topics_init(bool from_discovery)
+{
+	IotclMqttConfig *mqtt_config = iotcl_mqtt_get_config();
+
+	if (mqtt_config == NULL || mqtt_config->client_id == NULL) {
+		IOTCL_ERROR(0, "Topics: MQTT config is not available");
+		return -1;
+	}
+
+	memset(topics, 0, sizeof(topics));
+	topic_storage_used = 0;
+
+	if (mqtt_config->pub_rpt) {
+		if (topic_set(IOTC_TOPIC_RPT, mqtt_config->pub_rpt, "%s", mqtt_config->pub_rpt,
+				MQTT_PUBLISH_QOS, IOTC_LANE_TELEMETRY) != 0) {
+			return -1;
+		}
+	} else if (topic_set(IOTC_TOPIC_RPT, NULL, PUBLISH_TOPIC_FORMAT, mqtt_config->client_id,
+			MQTT_PUBLISH_QOS, IOTC_LANE_TELEMETRY) != 0) {
+		return -1;
+	}
+
+	if (mqtt_config->pub_ack && topic_set(IOTC_TOPIC_ACK, mqtt_config->pub_ack, "%s", mqtt_config->pub_ack,
+			MQTT_ACK_PUBLISH_QOS, IOTC_LANE_ACK) != 0) {
+		return -1;
+	}
+
+	if (mqtt_config->pub_flt && topic_set(IOTC_TOPIC_FLT, mqtt_config->pub_flt, "%s", mqtt_config->pub_flt,
+			MQTT_PUBLISH_QOS, IOTC_LANE_CONTROL) != 0) {
+		return -1;
+	}
+
+	if (from_discovery && mqtt_config->sub_c2d) {
+		if (topic_set(IOTC_TOPIC_C2D, mqtt_config->sub_c2d, "%s", mqtt_config->sub_c2d,
+				MQTTQoS1, IOTC_LANE_CONTROL) != 0) {
+			return -1;
+		}
+	} else if (topic_set(IOTC_TOPIC_C2D, NULL, SUBSCRIBE_TOPIC_FORMAT, mqtt_config->client_id,
+			MQTTQoS1, IOTC_LANE_CONTROL) != 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/* @brief	Get a topic by id
+ *
+ * Returns NULL if the topic is not used by this connection.
+ */
+const IotcTopic *iotc_topic_get(IotcTopicId id)
+{
+	if (id >= IOTC_TOPIC_COUNT || topics[id].name == NULL) {
+		return NULL;
+	}
+
+	return &topics[id];
+}
+
+
+/* @brief	Find the registered topic with the given name
+ *
+ * Returns NULL if name is not one of the SDK's topics.
+ */
+const IotcTopic *iotc_topic_find(const char *name)
+{
+	if (name == NULL) {
+		return NULL;
+	}
+
+	for (int i = 0; i < IOTC_TOPIC_COUNT; i++) {
+		if (topics[i].name && (name == topics[i].source || name == topics[i].name)) {
+			return &topics[i];
+		}
+	}
+
+	for (int i = 0; i < IOTC_TOPIC_COUNT; i++) {
+		if (topics[i].name && strncmp(name, topics[i].name, topics[i].len + 1) == 0) {
+			return &topics[i];
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ *
+ */
+static int topic_set(IotcTopicId id, const char *source, const char *format, const char *arg,
+		MQTTQoS_t qos, IotcPublishLane lane)
+{
+	size_t space = sizeof(topic_storage) - topic_storage_used;
+	char *name = &topic_storage[topic_storage_used];
+	int len;
+
+	len = snprintf(name, space, format, arg);
+	if (len < 0 || (size_t) len >= space || len > UINT16_MAX) {
+		IOTCL_ERROR(id, "Topics: no room for topic %d", id);
+		return -1;
+	}
+
+	topic_storage_used += (size_t) len + 1;
+
+	topics[id].name = name;
+	topics[id].len = (uint16_t) len;
+	topics[id].qos = qos;
+	topics[id].lane = lane;
+	topics[id].source = source;
+
+	return 0;
+}
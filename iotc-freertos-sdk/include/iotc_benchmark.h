@@ -0,0 +1,43 @@
+//
+// Copyright: Avnet 2024
+//
+// Shared by the benchmarks built with IOTC_ENABLE_BENCHMARKS.
+//
+
+#ifndef IOTC_BENCHMARK_H
+#define IOTC_BENCHMARK_H
+
+#ifdef IOTC_ENABLE_BENCHMARKS
+
+#include <stdint.h>
+
+#include "FreeRTOS.h"
+#include "hw_defs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// @brief	Cycle counter read by the benchmarks. Defaults to the Cortex-M DWT cycle counter.
+#ifndef IOTC_BENCHMARK_CYCLES
+#define IOTC_BENCHMARK_CYCLES()     (DWT->CYCCNT)
+#define IOTC_BENCHMARK_USE_DWT
+#endif
+
+/* @brief	Make sure IOTC_BENCHMARK_CYCLES() counts
+ */
+static inline void iotc_benchmark_init(void)
+{
+#ifdef IOTC_BENCHMARK_USE_DWT
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // IOTC_ENABLE_BENCHMARKS
+
+#endif // IOTC_BENCHMARK_H
@@ -0,0 +1,115 @@
+//
+// Copyright: Avnet 2024
+//
+
+#ifndef IOTC_C2D_H
+#define IOTC_C2D_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// @brief	Max JSON tokens (objects, arrays, keys and values) in one C2D message
+#ifndef IOTC_C2D_MAX_TOKENS
+#define IOTC_C2D_MAX_TOKENS				( 48 )
+#endif
+
+// @brief	Max nesting depth of objects and arrays in one C2D message
+#ifndef IOTC_C2D_MAX_DEPTH
+#define IOTC_C2D_MAX_DEPTH				( 6 )
+#endif
+
+// @brief	Longest ack id remembered for duplicate detection and deferred acks
+#ifndef IOTC_C2D_ACK_ID_MAX_LEN
+#define IOTC_C2D_ACK_ID_MAX_LEN			( 63 )
+#endif
+
+// @brief	Number of recently received ack ids remembered to detect messages the broker
+// delivers again, e.g. after a reconnect. 0 disables duplicate detection.
+#ifndef IOTC_C2D_DEDUP_ENTRIES
+#define IOTC_C2D_DEDUP_ENTRIES			( 8 )
+#endif
+
+// @brief	Longest ack message kept to be sent again for a duplicate; longer ones are truncated
+#ifndef IOTC_C2D_DEDUP_MESSAGE_MAX_LEN
+#define IOTC_C2D_DEDUP_MESSAGE_MAX_LEN	( 47 )
+#endif
+
+// @brief	Largest CBOR encoded ack; longer ack messages are truncated to fit
+#ifndef IOTC_C2D_CBOR_ACK_MAX_LEN
+#define IOTC_C2D_CBOR_ACK_MAX_LEN		( 192 )
+#endif
+
+// @brief	Values of the "ct" field
+#define IOTC_C2D_TYPE_COMMAND			( 0 )
+#define IOTC_C2D_TYPE_OTA				( 1 )
+
+typedef enum {
+    IOTC_C2D_TOK_OBJECT = 0,
+    IOTC_C2D_TOK_ARRAY,
+    IOTC_C2D_TOK_STRING,
+    IOTC_C2D_TOK_PRIMITIVE,		// number, true, false or null
+} IotcC2dTokenType;
+
+typedef struct {
+    uint8_t type;				// IotcC2dTokenType
+    uint16_t start;				// offset in the message; strings start after the opening quote
+    uint16_t len;
+    uint16_t count;				// keys of an object or elements of an array
+    uint16_t next;				// index of the token after this one and everything inside it
+} IotcC2dToken;
+
+// @brief	View of a string inside the decoded message. str is NUL terminated, or NULL if
+// the value is not present. It is valid for as long as the message buffer.
+typedef struct {
+    const char *str;
+    size_t len;
+} IotcC2dString;
+
+// @brief	A decoded C2D message. The strings it refers to live in the message buffer.
+typedef struct {
+    char *message;
+    int type;					// "ct" value, -1 if missing
+    uint16_t token_count;
+    int16_t urls;				// token index of the "urls" array, -1 if missing
+    IotcC2dToken tokens[IOTC_C2D_MAX_TOKENS];
+} IotcC2dEvent;
+
+typedef void (*IotcC2dCallback)(const IotcC2dEvent *event);
+
+typedef struct {
+    uint32_t checked;				// messages with an ack id looked up
+    uint32_t duplicates;			// messages dropped because their ack id was seen recently
+    uint32_t resent;				// duplicates answered with the last ack sent for them
+} IotcC2dDedupStats;
+
+
+int iotc_c2d_decode(IotcC2dEvent *event, char *message);
+int iotc_c2d_process(char *message);
+void iotc_c2d_set_callbacks(IotcC2dCallback cmd_cb, IotcC2dCallback ota_cb);
+
+int iotc_c2d_get_type(const IotcC2dEvent *event);
+IotcC2dString iotc_c2d_get_string(const IotcC2dEvent *event, int object, const char *key);
+IotcC2dString iotc_c2d_get_command(const IotcC2dEvent *event);
+IotcC2dString iotc_c2d_get_ack_id(const IotcC2dEvent *event);
+IotcC2dString iotc_c2d_get_ota_sw_version(const IotcC2dEvent *event);
+IotcC2dString iotc_c2d_get_ota_hw_version(const IotcC2dEvent *event);
+size_t iotc_c2d_get_ota_url_count(const IotcC2dEvent *event);
+IotcC2dString iotc_c2d_get_ota_url(const IotcC2dEvent *event, size_t index);
+IotcC2dString iotc_c2d_get_ota_file_name(const IotcC2dEvent *event, size_t index);
+
+bool iotc_c2d_check_duplicate(const char *ack_id);
+void iotc_c2d_forget(const char *ack_id);
+int iotc_c2d_send_cmd_ack(const char *ack_id, int status, const char *message);
+int iotc_c2d_send_ota_ack(const char *ack_id, int status, const char *message);
+void iotc_c2d_get_dedup_stats(IotcC2dDedupStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // IOTC_C2D_H
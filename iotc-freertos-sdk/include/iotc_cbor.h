@@ -0,0 +1,52 @@
+//
+// Copyright: Avnet 2024
+//
+
+#ifndef IOTC_CBOR_H
+#define IOTC_CBOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// @brief	Payload encodings the SDK can send telemetry and acks in
+typedef enum {
+    IOTC_ENCODING_DEFAULT = 0,		// IOTC_PAYLOAD_ENCODING
+    IOTC_ENCODING_JSON,
+    IOTC_ENCODING_CBOR,				// RFC 8949, with the same structure as the JSON messages
+} IotcPayloadEncoding;
+
+// @brief	Encoding used when the device configuration does not choose one
+#ifndef IOTC_PAYLOAD_ENCODING
+#define IOTC_PAYLOAD_ENCODING			IOTC_ENCODING_JSON
+#endif
+
+#define IOTC_CBOR_MAJOR_UINT			( 0 )
+#define IOTC_CBOR_MAJOR_NEGINT			( 1 )
+#define IOTC_CBOR_MAJOR_TEXT			( 3 )
+#define IOTC_CBOR_MAJOR_ARRAY			( 4 )
+#define IOTC_CBOR_MAJOR_MAP				( 5 )
+
+#define IOTC_CBOR_FALSE					( 0xf4 )
+#define IOTC_CBOR_TRUE					( 0xf5 )
+#define IOTC_CBOR_NULL					( 0xf6 )
+#define IOTC_CBOR_ARRAY_INDEFINITE		( 0x9f )
+#define IOTC_CBOR_MAP_INDEFINITE		( 0xbf )
+#define IOTC_CBOR_BREAK					( 0xff )
+
+// @brief	Largest item written by iotc_cbor_head() and iotc_cbor_number()
+#define IOTC_CBOR_HEAD_MAX_LEN			( 9 )
+
+
+size_t iotc_cbor_head(uint8_t *out, uint8_t major, uint64_t value);
+size_t iotc_cbor_number(uint8_t *out, double value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // IOTC_CBOR_H
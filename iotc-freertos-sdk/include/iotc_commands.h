@@ -0,0 +1,123 @@
+//
+// Copyright: Avnet 2024
+//
+
+#ifndef IOTC_COMMANDS_H
+#define IOTC_COMMANDS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "iotc_c2d.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// @brief	Max number of commands that can be registered
+#ifndef IOTC_COMMAND_MAX_COUNT
+#define IOTC_COMMAND_MAX_COUNT				( 32 )
+#endif
+
+// @brief	Slots in the command hash table. A power of two, at least twice IOTC_COMMAND_MAX_COUNT
+// so lookups rarely probe more than one slot.
+#ifndef IOTC_COMMAND_TABLE_SIZE
+#define IOTC_COMMAND_TABLE_SIZE				( 64 )
+#endif
+
+// @brief	Longest command name, not counting the terminator
+#ifndef IOTC_COMMAND_NAME_MAX_LEN
+#define IOTC_COMMAND_NAME_MAX_LEN			( 31 )
+#endif
+
+// @brief	Longest ack id kept for a command that completes after its handler returns
+#ifndef IOTC_COMMAND_ACK_ID_MAX_LEN
+#define IOTC_COMMAND_ACK_ID_MAX_LEN			( IOTC_C2D_ACK_ID_MAX_LEN )
+#endif
+
+// @brief	Max commands waiting for iotc_command_complete() at any time
+#ifndef IOTC_COMMAND_MAX_PENDING
+#define IOTC_COMMAND_MAX_PENDING			( 4 )
+#endif
+
+// @brief	Bytes available to an argument parser for its parsed form of the arguments
+#ifndef IOTC_COMMAND_PARSED_ARGS_SIZE
+#define IOTC_COMMAND_PARSED_ARGS_SIZE		( 32 )
+#endif
+
+typedef enum {
+    IOTC_CMD_ACK_AUTO = 0,			// ack with the handler's result when the cloud asks for an ack
+    IOTC_CMD_ACK_NONE,				// never ack
+    IOTC_CMD_ACK_HANDLER,			// the handler sends its own ack with iotc_c2d_send_cmd_ack()
+    IOTC_CMD_ACK_TWO_PHASE,			// ack "accepted" as soon as the command is queued, then ack the result
+} IotcCommandAckPolicy;
+
+// @brief	Identifies a command whose result is reported later with iotc_command_complete(). 0 is invalid.
+typedef uint32_t IotcCommandToken;
+
+typedef enum {
+    IOTC_CMD_CONCURRENCY_SERIAL = 0,	// runs in arrival order, one at a time with other serial commands
+    IOTC_CMD_CONCURRENCY_PARALLEL,		// may run alongside any other non-exclusive command
+    IOTC_CMD_CONCURRENCY_EXCLUSIVE,		// waits for all running commands and runs alone, e.g. OTA
+    IOTC_CMD_CONCURRENCY_INLINE,		// runs on the MQTT agent task as soon as it arrives, see below
+    IOTC_CMD_CONCURRENCY_COUNT
+} IotcCommandConcurrency;
+
+typedef struct {
+    const IotcC2dEvent *event;		// the decoded c2d message, for anything not covered below
+    const char *name;				// name the command was registered with
+    const char *args;				// text following the command name, "" if none
+    const void *parsed_args;		// filled in by the command's argument parser, NULL if it has none
+    const char *ack_id;				// NULL if the cloud does not want an ack
+    void *context;					// context the command was registered with
+    const char *ack_message;		// optional, set by the handler to replace the default ack message
+    IotcCommandToken token;			// set by iotc_command_defer()
+} IotcCommandRequest;
+
+// @brief	Parse a command's arguments into parsed, which has IOTC_COMMAND_PARSED_ARGS_SIZE bytes
+// and is 8 byte aligned. Return 0 if the arguments are valid.
+typedef int (*IotcCommandArgParser)(const char *args, void *parsed);
+
+// @brief	Carry out a command. Return 0 on success.
+// Handlers of IOTC_CMD_CONCURRENCY_INLINE commands run on the MQTT agent task, so they must
+// return within a millisecond or so and must not block, publish and wait, or take locks
+// held by other tasks. Their ack is queued without waiting and dropped if no buffer is free.
+typedef int (*IotcCommandHandler)(IotcCommandRequest *request);
+
+typedef struct {
+    const char *name;				// matched against the first word of the command, ignoring case
+    IotcCommandHandler handler;
+    IotcCommandArgParser parse_args;	// optional
+    IotcCommandAckPolicy ack_policy;
+    IotcCommandConcurrency concurrency;
+    void *context;					// passed to the handler in IotcCommandRequest
+} IotcCommandDesc;
+
+typedef struct {
+    uint32_t dispatched;
+    uint32_t unknown;				// commands with no registered handler
+    uint32_t bad_args;				// commands rejected by their argument parser
+    uint32_t failed;				// handlers that returned or completed with an error
+    uint32_t deferred;				// commands completed later with iotc_command_complete()
+    uint16_t registered;
+    uint16_t max_probes;			// longest hash probe sequence seen by a lookup
+} IotcCommandStats;
+
+
+int iotc_register_command(const IotcCommandDesc *desc);
+const IotcCommandDesc *iotc_command_find(const char *command, size_t *name_len);
+void iotc_command_dispatch(const IotcC2dEvent *event);
+void iotc_command_get_stats(IotcCommandStats *stats);
+
+IotcCommandToken iotc_command_defer(IotcCommandRequest *request);
+int iotc_command_complete(IotcCommandToken token, int status, const char *message);
+
+int iotc_command_parse_on_off(const char *args, void *parsed);
+int iotc_command_parse_int(const char *args, void *parsed);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // IOTC_COMMANDS_H
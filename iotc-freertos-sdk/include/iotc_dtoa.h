@@ -0,0 +1,35 @@
+//
+// Copyright: Avnet 2024
+//
+
+#ifndef IOTC_DTOA_H
+#define IOTC_DTOA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// @brief	Buffer size that holds any number the functions below write, with its terminator
+#define IOTC_DTOA_BUFFER_LEN		( 32 )
+
+// @brief	Most decimals iotc_dtoa_fixed() accepts
+#define IOTC_DTOA_MAX_DECIMALS		( 9 )
+
+
+size_t iotc_dtoa_shortest(char *buf, double value);
+size_t iotc_dtoa_fixed(char *buf, double value, int decimals);
+size_t iotc_dtoa_int(char *buf, int64_t value);
+double iotc_dtoa_round(double value, int decimals);
+
+#ifdef IOTC_ENABLE_BENCHMARKS
+void iotc_dtoa_benchmark(uint32_t iterations);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // IOTC_DTOA_H
@@ -0,0 +1,93 @@
+//
+// Copyright: Avnet 2024
+//
+
+#ifndef IOTC_TELEMETRY_AGGREGATE_H
+#define IOTC_TELEMETRY_AGGREGATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// @brief	Max number of attributes that can be aggregated
+#ifndef IOTC_TELEMETRY_AGGREGATE_MAX_COUNT
+#define IOTC_TELEMETRY_AGGREGATE_MAX_COUNT		( 4 )
+#endif
+
+// @brief	Max panes a sliding window can be divided into
+#ifndef IOTC_TELEMETRY_AGGREGATE_MAX_PANES
+#define IOTC_TELEMETRY_AGGREGATE_MAX_PANES		( 8 )
+#endif
+
+// @brief	Longest attribute name that can be aggregated, not counting the terminator
+#ifndef IOTC_TELEMETRY_AGGREGATE_NAME_MAX_LEN
+#define IOTC_TELEMETRY_AGGREGATE_NAME_MAX_LEN	( 31 )
+#endif
+
+// @brief	Which statistics a window is reported with. Each is sent as the attribute name
+// with a suffix, e.g. temperature_mean.
+#define IOTC_AGGREGATE_COUNT		( 1u << 0 )	// _count
+#define IOTC_AGGREGATE_MIN			( 1u << 1 )	// _min
+#define IOTC_AGGREGATE_MAX			( 1u << 2 )	// _max
+#define IOTC_AGGREGATE_MEAN			( 1u << 3 )	// _mean
+#define IOTC_AGGREGATE_STDDEV		( 1u << 4 )	// _stddev, the sample standard deviation
+#define IOTC_AGGREGATE_ALL			( 0x1fu )
+
+// @brief	A window of window_ms is divided into panes.  With 1 pane (or 0) windows are
+// tumbling: each sample is in one window and a summary is sent every window_ms.  With more,
+// windows slide: a summary of the last window_ms is sent every window_ms / panes.
+typedef struct {
+    const char *name;
+    uint32_t window_ms;
+    uint8_t panes;
+    uint8_t statistics;				// IOTC_AGGREGATE_* flags, 0 for all
+} IotcTelemetryAggregateRule;
+
+typedef struct {
+    uint32_t samples;				// samples folded in
+    uint32_t windows_sent;
+    uint32_t windows_empty;			// windows without samples, which are not sent
+    uint32_t send_failures;			// summaries lost for lack of a telemetry buffer, or too large for one
+} IotcTelemetryAggregateStats;
+
+// @brief	Statistics of the samples in a window or pane
+typedef struct {
+    uint32_t count;
+    double mean;
+    double m2;						// sum of squared differences from the mean
+    double min;
+    double max;
+} IotcTelemetryWindowStats;
+
+typedef struct IotcTelemetryAggregate IotcTelemetryAggregate;
+
+
+/* Aggregates are not locked. Samples must be added and summaries polled from the one task
+ * that sends telemetry.
+ */
+IotcTelemetryAggregate *iotc_telemetry_aggregate_add(const IotcTelemetryAggregateRule *rule);
+IotcTelemetryAggregate *iotc_telemetry_aggregate_find(const char *name);
+void iotc_telemetry_aggregate_sample(IotcTelemetryAggregate *agg, double value);
+void iotc_telemetry_aggregate_poll(void);
+TickType_t iotc_telemetry_aggregate_ticks_until_emit(void);
+void iotc_telemetry_aggregate_get_stats(const IotcTelemetryAggregate *agg, IotcTelemetryAggregateStats *stats);
+
+void iotc_telemetry_window_stats_fold(IotcTelemetryWindowStats *stats, double value);
+void iotc_telemetry_window_stats_merge(IotcTelemetryWindowStats *into, const IotcTelemetryWindowStats *from);
+double iotc_telemetry_window_stats_stddev(const IotcTelemetryWindowStats *stats);
+
+#ifdef IOTC_ENABLE_BENCHMARKS
+void iotc_telemetry_aggregate_benchmark(uint32_t iterations);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // IOTC_TELEMETRY_AGGREGATE_H
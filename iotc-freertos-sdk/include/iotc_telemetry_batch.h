@@ -0,0 +1,93 @@
+//
+// Copyright: Avnet 2024
+//
+
+#ifndef IOTC_TELEMETRY_BATCH_H
+#define IOTC_TELEMETRY_BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "FreeRTOS.h"
+#include "iotc_telemetry_encoder.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// @brief	Max number of telemetry records packed into one message. 1 disables batching.
+#ifndef IOTC_TELEMETRY_BATCH_MAX_RECORDS
+#define IOTC_TELEMETRY_BATCH_MAX_RECORDS		( 10 )
+#endif
+
+// @brief	Max serialized size of one batched message. Defaults to the publish buffer size.
+#ifndef IOTC_TELEMETRY_BATCH_MAX_BYTES
+#define IOTC_TELEMETRY_BATCH_MAX_BYTES			( MQTT_PUBLISH_MAX_LEN )
+#endif
+
+// @brief	Max time a record waits in an open batch before the batch is sent
+#ifndef IOTC_TELEMETRY_BATCH_WINDOW_MS
+#define IOTC_TELEMETRY_BATCH_WINDOW_MS			( 5000 )
+#endif
+
+// @brief	Set to 1 to stamp the batch once and give each record its offset in milliseconds,
+// see iotc_telemetry_encoder_set_base_time(). The backend must accept this form.
+#ifndef IOTC_TELEMETRY_BATCH_TIME_OFFSETS
+#define IOTC_TELEMETRY_BATCH_TIME_OFFSETS		( 0 )
+#endif
+
+// @brief	Encoded size assumed per record until the first record has been measured
+#ifndef IOTC_TELEMETRY_BATCH_RECORD_SIZE_ESTIMATE
+#define IOTC_TELEMETRY_BATCH_RECORD_SIZE_ESTIMATE	( 128 )
+#endif
+
+typedef enum {
+    IOTC_BATCH_FLUSH_COUNT = 0,		// max_records reached
+    IOTC_BATCH_FLUSH_SIZE,			// next record would exceed max_bytes
+    IOTC_BATCH_FLUSH_TIME,			// window_ms elapsed since the first record
+    IOTC_BATCH_FLUSH_MANUAL,		// iotc_telemetry_batch_flush() called by the application
+    IOTC_BATCH_FLUSH_REASON_COUNT
+} IotcBatchFlushReason;
+
+typedef enum {
+    IOTC_BATCH_RECORD_COMMITTED = 0,
+    IOTC_BATCH_RECORD_RETRY,		// the batch was full and has been sent; encode the record again
+    IOTC_BATCH_RECORD_DROPPED		// the record does not fit in an empty batch
+} IotcBatchRecordStatus;
+
+typedef struct {
+    uint16_t max_records;
+    size_t max_bytes;
+    uint32_t window_ms;
+    bool time_offsets;
+} IotcTelemetryBatchConfig;
+
+typedef struct {
+    uint32_t batches_sent;			// handed to the telemetry publish lane
+    uint32_t batches_journaled;		// stored by the telemetry journal instead of published
+    uint32_t batches_failed;		// lost because the publish lane did not take them
+    uint32_t records_sent;			// records in batches_sent
+    uint32_t records_dropped;		// records that did not fit in an empty batch
+    uint16_t min_batch_records;
+    uint16_t max_batch_records;
+    size_t max_batch_bytes;
+    size_t bytes_per_record;		// largest record encoded, used for size based flushing
+    uint32_t flushes[IOTC_BATCH_FLUSH_REASON_COUNT];
+} IotcTelemetryBatchStats;
+
+
+/* The batch is not locked. All calls must be made from the one task that sends telemetry. */
+void iotc_telemetry_batch_init(const IotcTelemetryBatchConfig *cfg);
+IotcTelemetryEncoder *iotc_telemetry_batch_add_record(void);
+IotcBatchRecordStatus iotc_telemetry_batch_commit_record(void);
+void iotc_telemetry_batch_flush(void);
+void iotc_telemetry_batch_poll(void);
+TickType_t iotc_telemetry_batch_ticks_until_flush(void);
+void iotc_telemetry_batch_get_stats(IotcTelemetryBatchStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // IOTC_TELEMETRY_BATCH_H
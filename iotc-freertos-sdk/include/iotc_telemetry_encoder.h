@@ -0,0 +1,66 @@
+//
+// Copyright: Avnet 2024
+//
+
+#ifndef IOTC_TELEMETRY_ENCODER_H
+#define IOTC_TELEMETRY_ENCODER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "iotc_cbor.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// @brief	Writes an IoTConnect telemetry message directly into a buffer.
+// The fields are private; use the functions below.
+typedef struct {
+    char *buf;
+    size_t size;
+    size_t len;
+    size_t record_start;		// where the open record starts, for iotc_telemetry_discard_record()
+    uint64_t base_ms;			// message timestamp that records are offsets from, if time_offsets
+    IotcPayloadEncoding encoding;
+    uint16_t records;
+    bool record_open;
+    bool first_value;			// no value has been added to the open record yet
+    bool overflow;				// something did not fit; the open record is incomplete
+    bool time_offsets;			// records carry "dto", milliseconds from the message's "dt"
+} IotcTelemetryEncoder;
+
+
+int iotc_telemetry_encoder_init(IotcTelemetryEncoder *enc, char *buf, size_t size);
+int iotc_telemetry_encoder_init_as(IotcTelemetryEncoder *enc, char *buf, size_t size, IotcPayloadEncoding encoding);
+int iotc_telemetry_encoder_set_base_time(IotcTelemetryEncoder *enc, uint64_t unix_ms);
+int iotc_telemetry_add_record(IotcTelemetryEncoder *enc, const char *iso_time);
+int iotc_telemetry_add_record_at(IotcTelemetryEncoder *enc, uint64_t unix_ms);
+int iotc_telemetry_set_number(IotcTelemetryEncoder *enc, const char *name, double value);
+int iotc_telemetry_set_number_fixed(IotcTelemetryEncoder *enc, const char *name, double value, int decimals);
+int iotc_telemetry_set_bool(IotcTelemetryEncoder *enc, const char *name, bool value);
+int iotc_telemetry_set_string(IotcTelemetryEncoder *enc, const char *name, const char *value);
+int iotc_telemetry_set_null(IotcTelemetryEncoder *enc, const char *name);
+void iotc_telemetry_discard_record(IotcTelemetryEncoder *enc);
+const char *iotc_telemetry_encoder_finish(IotcTelemetryEncoder *enc, size_t *len);
+size_t iotc_telemetry_encoder_space(const IotcTelemetryEncoder *enc);
+
+// Used by serializers generated with iotc_telemetry_fields.h. key is the quoted name and colon,
+// e.g. "\"temperature\":", and is written as is.
+int iotc_telemetry_set_number_key(IotcTelemetryEncoder *enc, const char *key, size_t key_len, double value);
+int iotc_telemetry_set_number_fixed_key(IotcTelemetryEncoder *enc, const char *key, size_t key_len, double value,
+        int decimals);
+int iotc_telemetry_set_int_key(IotcTelemetryEncoder *enc, const char *key, size_t key_len, int32_t value);
+int iotc_telemetry_set_bool_key(IotcTelemetryEncoder *enc, const char *key, size_t key_len, bool value);
+int iotc_telemetry_set_string_key(IotcTelemetryEncoder *enc, const char *key, size_t key_len, const char *value);
+
+#ifdef IOTC_ENABLE_BENCHMARKS
+void iotc_telemetry_encoder_benchmark(uint32_t iterations);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // IOTC_TELEMETRY_ENCODER_H
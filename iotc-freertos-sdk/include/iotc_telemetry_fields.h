@@ -0,0 +1,151 @@
+//
+// Copyright: Avnet 2024
+//
+// Describe a telemetry record once and generate its struct and serializer from the
+// description.  List the fields in an X-macro, each as X(kind, name), where kind is one
+// of number, int, bool or string and name is both the struct member and the telemetry
+// attribute name.  fixed1, fixed2 and fixed3 are numbers rounded to that many decimals:
+//
+/*
+ *     #define SENSOR_TELEMETRY_FIELDS(X) \
+ *         X(fixed1, temperature) \
+ *         X(int, samples) \
+ *         X(bool, door_open)
+ *
+ *     IOTC_TELEMETRY_STRUCT(SensorTelemetry, SENSOR_TELEMETRY_FIELDS)
+ *     IOTC_TELEMETRY_SERIALIZER(sensor_telemetry_encode, SensorTelemetry, SENSOR_TELEMETRY_FIELDS)
+ */
+// The serializer writes each member with the encoder call for its kind and a key that is
+// formatted at compile time, so nothing is looked up or dispatched on at run time.
+// Names must be valid C identifiers, so they never need escaping.
+//
+// IOTC_TELEMETRY_FILTERED_SERIALIZER() also generates the code to run each field through
+// its iotc_telemetry_filter, so only the fields that pass are written.  The filters only
+// learn the new values once the record is known to have been sent:
+/*
+ *     static sensor_telemetry_encode_filters_t filters;
+ *     sensor_telemetry_encode_bind_filters(&filters);   // once, after adding the filters
+ *
+ *     sensor_telemetry_encode_selection_t selection;
+ *     if (sensor_telemetry_encode_select(&filters, &record, &selection)) {
+ *         sensor_telemetry_encode(enc, &record, &selection);
+ *         if (... the record was committed ...) {
+ *             sensor_telemetry_encode_commit(&filters, &record, &selection);
+ *         }
+ *     }
+ */
+
+#ifndef IOTC_TELEMETRY_FIELDS_H
+#define IOTC_TELEMETRY_FIELDS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "iotc_telemetry_encoder.h"
+#include "iotc_telemetry_filter.h"
+
+#define IOTC_FIELD_TYPE_number          double
+#define IOTC_FIELD_TYPE_int             int32_t
+#define IOTC_FIELD_TYPE_bool            bool
+#define IOTC_FIELD_TYPE_string          const char *
+#define IOTC_FIELD_TYPE_fixed1          double
+#define IOTC_FIELD_TYPE_fixed2          double
+#define IOTC_FIELD_TYPE_fixed3          double
+
+#define IOTC_FIELD_FIXED_KIND(decimals) \
+    static inline int iotc_telemetry_set_fixed##decimals##_key(IotcTelemetryEncoder *enc, const char *key, \
+            size_t key_len, double value) \
+    { \
+        return iotc_telemetry_set_number_fixed_key(enc, key, key_len, value, decimals); \
+    } \
+    static inline bool iotc_telemetry_filter_fixed##decimals(IotcTelemetryFilter *filter, double value) \
+    { \
+        return iotc_telemetry_filter_number(filter, value); \
+    } \
+    static inline void iotc_telemetry_filter_commit_fixed##decimals(IotcTelemetryFilter *filter, double value) \
+    { \
+        iotc_telemetry_filter_commit_number(filter, value); \
+    }
+
+IOTC_FIELD_FIXED_KIND(1)
+IOTC_FIELD_FIXED_KIND(2)
+IOTC_FIELD_FIXED_KIND(3)
+
+#define IOTC_FIELD_KEY(name)            "\"" #name "\":"
+
+#define IOTC_FIELD_MEMBER(kind, name)   IOTC_FIELD_TYPE_##kind name;
+
+#define IOTC_FIELD_ENCODE(kind, name) \
+    status |= iotc_telemetry_set_##kind##_key(enc, IOTC_FIELD_KEY(name), sizeof(IOTC_FIELD_KEY(name)) - 1, record->name);
+
+// @brief	Define a struct with a member for each field
+#define IOTC_TELEMETRY_STRUCT(type, FIELDS) \
+    typedef struct { \
+        FIELDS(IOTC_FIELD_MEMBER) \
+    } type;
+
+// @brief	Define int fn(IotcTelemetryEncoder *enc, const type *record), which adds every field
+// to the open record of enc, or starts one. Returns -1 if the record did not fit.
+#define IOTC_TELEMETRY_SERIALIZER(fn, type, FIELDS) \
+    static inline int fn(IotcTelemetryEncoder *enc, const type *record) \
+    { \
+        int status = 0; \
+        FIELDS(IOTC_FIELD_ENCODE) \
+        return status ? -1 : 0; \
+    }
+
+#define IOTC_FIELD_FILTER_MEMBER(kind, name)	IotcTelemetryFilter *name;
+#define IOTC_FIELD_SELECTION_MEMBER(kind, name)	bool name;
+#define IOTC_FIELD_FILTER_BIND(kind, name)		filters->name = iotc_telemetry_filter_find(#name);
+
+#define IOTC_FIELD_FILTER(kind, name) \
+    selection->name = iotc_telemetry_filter_##kind(filters->name, record->name); \
+    any |= selection->name;
+
+#define IOTC_FIELD_FILTER_COMMIT(kind, name) \
+    if (selection->name) { \
+        iotc_telemetry_filter_commit_##kind(filters->name, record->name); \
+    }
+
+// kind is pasted here rather than passed on, where bool would expand to _Bool
+#define IOTC_FIELD_ENCODE_SELECTED(kind, name) \
+    if (selection->name) { \
+        status |= iotc_telemetry_set_##kind##_key(enc, IOTC_FIELD_KEY(name), sizeof(IOTC_FIELD_KEY(name)) - 1, \
+                record->name); \
+    }
+
+// @brief	Define, for a serializer named fn:
+// fn##_filters_t, the filter of each field, and fn##_bind_filters(), which looks them up once by name;
+// fn##_selection_t and fn##_select(), which filters a record and returns false if no field passed;
+// fn##_commit(), which makes the selected fields the last reported values once the record is sent;
+// fn(), which writes the selected fields like the serializer of IOTC_TELEMETRY_SERIALIZER().
+#define IOTC_TELEMETRY_FILTERED_SERIALIZER(fn, type, FIELDS) \
+    typedef struct { \
+        FIELDS(IOTC_FIELD_FILTER_MEMBER) \
+    } fn##_filters_t; \
+    typedef struct { \
+        FIELDS(IOTC_FIELD_SELECTION_MEMBER) \
+    } fn##_selection_t; \
+    static inline void fn##_bind_filters(fn##_filters_t *filters) \
+    { \
+        FIELDS(IOTC_FIELD_FILTER_BIND) \
+    } \
+    static inline bool fn##_select(const fn##_filters_t *filters, const type *record, fn##_selection_t *selection) \
+    { \
+        bool any = false; \
+        FIELDS(IOTC_FIELD_FILTER) \
+        return any; \
+    } \
+    static inline void fn##_commit(const fn##_filters_t *filters, const type *record, \
+            const fn##_selection_t *selection) \
+    { \
+        FIELDS(IOTC_FIELD_FILTER_COMMIT) \
+    } \
+    static inline int fn(IotcTelemetryEncoder *enc, const type *record, const fn##_selection_t *selection) \
+    { \
+        int status = 0; \
+        FIELDS(IOTC_FIELD_ENCODE_SELECTED) \
+        return status ? -1 : 0; \
+    }
+
+#endif // IOTC_TELEMETRY_FIELDS_H
@@ -0,0 +1,69 @@
+//
+// Copyright: Avnet 2024
+//
+
+#ifndef IOTC_TELEMETRY_FILTER_H
+#define IOTC_TELEMETRY_FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// @brief	Max number of attributes that can have a filter
+#ifndef IOTC_TELEMETRY_FILTER_MAX_COUNT
+#define IOTC_TELEMETRY_FILTER_MAX_COUNT		( 8 )
+#endif
+
+typedef enum {
+    IOTC_FILTER_ALWAYS = 0,			// report every sample, limited only by the reporting intervals
+    IOTC_FILTER_DEADBAND_ABSOLUTE,	// report a number when it moves more than deadband from the last reported value
+    IOTC_FILTER_DEADBAND_RELATIVE,	// as above, with deadband a fraction of the last reported value, e.g. 0.05
+    IOTC_FILTER_ON_CHANGE,			// report when the value differs from the last reported value
+} IotcTelemetryFilterMode;
+
+// @brief	How often one attribute is reported. Deadband modes act as IOTC_FILTER_ON_CHANGE
+// for bools and strings.
+typedef struct {
+    const char *name;				// attribute name, must stay valid while the filter is used
+    IotcTelemetryFilterMode mode;
+    double deadband;
+    uint32_t min_interval_ms;		// never report more often than this, even if the value changes
+    uint32_t max_interval_ms;		// report at least this often, even if the value has not changed. 0 for never.
+} IotcTelemetryFilterRule;
+
+typedef struct {
+    uint32_t sent;					// samples that passed the filter and were committed
+    uint32_t suppressed;			// samples the filter dropped
+} IotcTelemetryFilterStats;
+
+typedef struct IotcTelemetryFilter IotcTelemetryFilter;
+
+
+/* Filters are not locked. Samples must be filtered from the one task that sends telemetry.
+ * A NULL filter passes every sample, so attributes without a rule can be filtered too.
+ * iotc_telemetry_filter_<kind>() only decides; a sample that passed becomes the last
+ * reported value when iotc_telemetry_filter_commit_<kind>() is called after it was sent.
+ */
+IotcTelemetryFilter *iotc_telemetry_filter_add(const IotcTelemetryFilterRule *rule);
+IotcTelemetryFilter *iotc_telemetry_filter_find(const char *name);
+void iotc_telemetry_filter_reset(IotcTelemetryFilter *filter);
+bool iotc_telemetry_filter_number(IotcTelemetryFilter *filter, double value);
+bool iotc_telemetry_filter_int(IotcTelemetryFilter *filter, int32_t value);
+bool iotc_telemetry_filter_bool(IotcTelemetryFilter *filter, bool value);
+bool iotc_telemetry_filter_string(IotcTelemetryFilter *filter, const char *value);
+void iotc_telemetry_filter_commit_number(IotcTelemetryFilter *filter, double value);
+void iotc_telemetry_filter_commit_int(IotcTelemetryFilter *filter, int32_t value);
+void iotc_telemetry_filter_commit_bool(IotcTelemetryFilter *filter, bool value);
+void iotc_telemetry_filter_commit_string(IotcTelemetryFilter *filter, const char *value);
+void iotc_telemetry_filter_get_stats(const IotcTelemetryFilter *filter, IotcTelemetryFilterStats *stats);
+void iotc_telemetry_filter_get_totals(IotcTelemetryFilterStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // IOTC_TELEMETRY_FILTER_H
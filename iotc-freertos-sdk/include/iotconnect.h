@@ -13,6 +13,8 @@
 #include "iotcl_cfg.h"
 #include "iotcl_log.h"
 #include "iotcl_util.h"
+#include "iotc_c2d.h"
+#include "iotc_cbor.h"
 #include "PkiObject.h"
 
 #ifdef __cplusplus
@@ -60,9 +62,10 @@ typedef struct {
     char *cpid;   // Settings -> Company Profile.
     char *duid;   // Name of the device.
     IotConnectAuth auth_info;
-    IotclOtaCallback ota_cb; // callback for OTA events.
-    IotclCommandCallback cmd_cb; // callback for command events.
+    IotcC2dCallback ota_cb; // callback for OTA events.
+    IotcC2dCallback cmd_cb; // callback for command events.
     IotConnectStatusCallback status_cb; // callback for connection status
+    IotcPayloadEncoding payload_encoding; // encoding of telemetry and acks this device's template expects
 } IotConnectClientConfig;
 
 typedef struct {
@@ -73,6 +76,7 @@ typedef struct {
 IotConnectClientConfig *iotconnect_sdk_init_and_get_config();
 int iotconnect_sdk_init(IotConnectCustomMQTTConfig *custom_mqtt_config);
 bool iotconnect_sdk_is_connected(void);
+IotcPayloadEncoding iotconnect_sdk_get_payload_encoding(void);
 void iotconnect_sdk_send_packet(const char *data);
 
 /* Note: Neither IotConnectSdk_receive nor iotconnect_sdk_poll are used by this
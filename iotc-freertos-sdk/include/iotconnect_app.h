@@ -38,15 +38,25 @@
 #include "iotcl_log.h"
 #include "iotcl_telemetry.h"
 #include "iotcl_util.h"
+#include "iotc_telemetry_fields.h"
+#include "iotc_telemetry_submit.h"
 #include <iotconnect_config.h>
 
 // Constants
 #define APP_VERSION 			"05.09.24"		// Version string
 #define MQTT_PUBLISH_PERIOD_MS 	( 3000 )		// Size of statically allocated buffers for holding topic names and payloads.
 
-#ifndef IOTC_APP_QUEUE_SIZE_TELEMETRY
-#define IOTC_APP_QUEUE_SIZE_TELEMETRY 5
-#endif
+// Telemetry record sensor tasks and ISRs send with
+// iotc_telemetry_submit(IOTC_APP_SAMPLE_EXAMPLE, &record, sizeof(record)), or the
+// _from_isr variant.  Each field is an attribute of the same name, see iotc_telemetry_fields.h
+#define IOTC_APP_SAMPLE_EXAMPLE 1
+
+#define EXAMPLE_TELEMETRY_FIELDS(X) \
+	X(number, double_value) \
+	X(bool, bool_value) \
+	X(string, string_value)
+
+IOTC_TELEMETRY_STRUCT(exampleIotcTelemetry_t, EXAMPLE_TELEMETRY_FIELDS)
 
 #ifndef pkcs11_MQTT_ROOT_CA_CERT_LABEL
 #define pkcs11_MQTT_ROOT_CA_CERT_LABEL                          "root_ca_cert"
@@ -74,17 +84,15 @@ __weak void set_led_freq(int freq);
 #endif // IOTC_USE_LED
 
 // Prototypes
-extern MessageBufferHandle_t iotcAppQueueTelemetry;
 __weak void iotcApp_create_and_send_telemetry_json(
 		const void *pToTelemetryStruct, size_t siz);
-static void on_command(IotclC2dEventData data);
 void command_status(IotclC2dEventData data, bool status,
 		const char *command_name, const char *message);
-static void on_ota(IotclC2dEventData data);
+static void on_ota(const IotcC2dEvent *event);
 static int split_url(const char *url, char **host_name, char**resource);
 static bool is_app_version_same_as_ota(const char *version);
 static bool app_needs_ota_update(const char *version);
-static int start_ota(char *url);
+static int start_ota(const char *url);
 
 // Include libs checks
 #ifndef MBEDTLS_CIPHER_MODE_CBC
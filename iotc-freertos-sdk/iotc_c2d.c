@@ -0,0 +1,779 @@
+//
+// Copyright: Avnet 2024
+//
+// Decoder for cloud-to-device messages.  The received JSON is split into a fixed array
+// of tokens in one pass over the buffer, then strings are unescaped and NUL terminated in
+// place, so decoding needs no heap and the accessors return views into the buffer.
+// Only what the C2D messages need is supported: the message must be one JSON object of
+// at most IOTC_C2D_MAX_TOKENS tokens nested at most IOTC_C2D_MAX_DEPTH deep.
+//
+// The C2D topic is subscribed with QoS1, so the broker may deliver a message again after
+// a reconnect.  The ack ids of the last IOTC_C2D_DEDUP_ENTRIES messages are remembered
+// with the last ack sent for each, so a repeated message is answered with that ack instead
+// of being run again.  Acks must be sent with iotc_c2d_send_cmd_ack() and
+// iotc_c2d_send_ota_ack() to be remembered.
+//
+// Acks are sent as iotc-c-lib formats them, or as CBOR with the same structure when the
+// device's payload encoding is IOTC_ENCODING_CBOR.
+//
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "iotcl.h"
+#include "iotcl_log.h"
+#include "iotconnect.h"
+#include "iotc_c2d.h"
+#include "iotc_cbor.h"
+#include "iotc_mqtt_client.h"
+
+#define C2D_MAX_MESSAGE_LEN     (UINT16_MAX - 1)
+
+#define C2D_ACK_NONE            (0)
+#define C2D_ACK_CMD             (1)
+#define C2D_ACK_OTA             (2)
+
+typedef struct {
+    char ack_id[IOTC_C2D_ACK_ID_MAX_LEN + 1];       // "" if the entry is free
+    char message[IOTC_C2D_DEDUP_MESSAGE_MAX_LEN + 1];
+    uint32_t last_used;
+    int status;
+    uint8_t ack_type;                               // C2D_ACK_NONE until an ack has been sent
+    bool has_message;
+} C2dSeenEntry;
+
+static IotcC2dCallback c2d_cmd_cb = NULL;
+static IotcC2dCallback c2d_ota_cb = NULL;
+
+#if IOTC_C2D_DEDUP_ENTRIES > 0
+static C2dSeenEntry c2d_seen[IOTC_C2D_DEDUP_ENTRIES];
+static uint32_t c2d_seen_clock;
+#endif
+static IotcC2dDedupStats c2d_dedup_stats;
+
+static int c2d_tokenize(IotcC2dEvent *event);
+static size_t c2d_unescape(char *str, size_t len);
+static size_t c2d_put_utf8(char *out, uint32_t cp);
+static int c2d_hex4(const char *p, uint32_t *value);
+static int c2d_find_key(const IotcC2dEvent *event, int object, const char *key);
+static IotcC2dString c2d_string(const IotcC2dEvent *event, int index);
+static int c2d_ota_url_object(const IotcC2dEvent *event, size_t index);
+static void c2d_seen_record(const char *ack_id, uint8_t ack_type, int status, const char *message);
+static int c2d_send_ack(uint8_t ack_type, const char *ack_id, int status, const char *message);
+static int c2d_send_cbor_ack(uint8_t ack_type, const char *ack_id, int status, const char *message);
+static size_t c2d_cbor_text(uint8_t *out, size_t space, const char *str, bool truncate);
+#if IOTC_C2D_DEDUP_ENTRIES > 0
+static C2dSeenEntry *c2d_seen_find(const char *ack_id);
+#endif
+
+
+/* @brief	Set the functions called by iotc_c2d_process() for commands and OTA requests
+ */
+void iotc_c2d_set_callbacks(IotcC2dCallback cmd_cb, IotcC2dCallback ota_cb)
+{
+    c2d_cmd_cb = cmd_cb;
+    c2d_ota_cb = ota_cb;
+}
+
+
+/* @brief	Decode a C2D message and pass it to the command or OTA callback
+ *
+ * @param	message, NUL terminated JSON. It is modified and must stay valid until the callback returns.
+ *
+ * Returns 0 if the message was decoded, even if no callback handled it.
+ */
+int iotc_c2d_process(char *message)
+{
+    IotcC2dEvent event;
+    int status;
+
+    status = iotc_c2d_decode(&event, message);
+    if (status != 0) {
+        return status;
+    }
+
+    switch (event.type) {
+    case IOTC_C2D_TYPE_COMMAND:
+        if (c2d_cmd_cb) {
+            c2d_cmd_cb(&event);
+        }
+        break;
+
+    case IOTC_C2D_TYPE_OTA:
+        if (c2d_ota_cb) {
+            c2d_ota_cb(&event);
+        }
+        break;
+
+    default:
+        IOTCL_WARN(event.type, "Ignoring c2d message of type %d", event.type);
+        break;
+    }
+
+    return 0;
+}
+
+
+/* @brief	Decode a C2D message in place
+ *
+ * @param	event, filled in with the tokens. Typically on the caller's stack.
+ * @param	message, NUL terminated JSON. Strings in it are unescaped and terminated in place.
+ *
+ * Returns 0 on success.
+ */
+int iotc_c2d_decode(IotcC2dEvent *event, char *message)
+{
+    int status;
+    int index;
+
+    event->message = message;
+    event->type = -1;
+    event->urls = -1;
+    event->token_count = 0;
+
+    if (strnlen(message, C2D_MAX_MESSAGE_LEN + 1) > C2D_MAX_MESSAGE_LEN) {
+        return -1;
+    }
+
+    status = c2d_tokenize(event);
+    if (status != 0) {
+        return status;
+    }
+
+    // Terminate every string and primitive now that the delimiters are no longer needed
+    for (uint16_t i = 0; i < event->token_count; i++) {
+        IotcC2dToken *tok = &event->tokens[i];
+
+        if (tok->type == IOTC_C2D_TOK_STRING) {
+            tok->len = (uint16_t) c2d_unescape(&message[tok->start], tok->len);
+            message[tok->start + tok->len] = '\0';
+        } else if (tok->type == IOTC_C2D_TOK_PRIMITIVE) {
+            message[tok->start + tok->len] = '\0';
+        }
+    }
+
+    index = c2d_find_key(event, 0, "ct");
+    if (index >= 0 && event->tokens[index].type == IOTC_C2D_TOK_PRIMITIVE) {
+        event->type = atoi(&message[event->tokens[index].start]);
+    }
+
+    index = c2d_find_key(event, 0, "urls");
+    if (index >= 0 && event->tokens[index].type == IOTC_C2D_TOK_ARRAY) {
+        event->urls = (int16_t) index;
+    }
+
+    return 0;
+}
+
+
+/*
+ *
+ */
+int iotc_c2d_get_type(const IotcC2dEvent *event)
+{
+    return event->type;
+}
+
+
+/* @brief	Get the string value of key in the object with token index object
+ *
+ * Use object 0 for the top level of the message.
+ */
+IotcC2dString iotc_c2d_get_string(const IotcC2dEvent *event, int object, const char *key)
+{
+    return c2d_string(event, c2d_find_key(event, object, key));
+}
+
+
+/*
+ *
+ */
+IotcC2dString iotc_c2d_get_command(const IotcC2dEvent *event)
+{
+    return iotc_c2d_get_string(event, 0, "cmd");
+}
+
+
+/*
+ *
+ */
+IotcC2dString iotc_c2d_get_ack_id(const IotcC2dEvent *event)
+{
+    return iotc_c2d_get_string(event, 0, "ack");
+}
+
+
+/*
+ *
+ */
+IotcC2dString iotc_c2d_get_ota_sw_version(const IotcC2dEvent *event)
+{
+    return iotc_c2d_get_string(event, 0, "sw");
+}
+
+
+/*
+ *
+ */
+IotcC2dString iotc_c2d_get_ota_hw_version(const IotcC2dEvent *event)
+{
+    return iotc_c2d_get_string(event, 0, "hw");
+}
+
+
+/*
+ *
+ */
+size_t iotc_c2d_get_ota_url_count(const IotcC2dEvent *event)
+{
+    return (event->urls >= 0) ? event->tokens[event->urls].count : 0;
+}
+
+
+/*
+ *
+ */
+IotcC2dString iotc_c2d_get_ota_url(const IotcC2dEvent *event, size_t index)
+{
+    return iotc_c2d_get_string(event, c2d_ota_url_object(event, index), "url");
+}
+
+
+/*
+ *
+ */
+IotcC2dString iotc_c2d_get_ota_file_name(const IotcC2dEvent *event, size_t index)
+{
+    return iotc_c2d_get_string(event, c2d_ota_url_object(event, index), "fileName");
+}
+
+
+/* @brief	Check whether a message with this ack id has been received recently
+ *
+ * Call when a message arrives, before it is processed.  A new ack id is remembered,
+ * replacing the least recently used one.  For a duplicate the last ack sent for the ack
+ * id, if any, is sent again and true is returned; the message must not be processed.
+ * Messages without an ack id are never duplicates.
+ */
+bool iotc_c2d_check_duplicate(const char *ack_id)
+{
+#if IOTC_C2D_DEDUP_ENTRIES > 0
+    C2dSeenEntry *entry;
+    C2dSeenEntry cached;
+
+    if (ack_id == NULL || ack_id[0] == '\0' || strlen(ack_id) > IOTC_C2D_ACK_ID_MAX_LEN) {
+        return false;
+    }
+
+    taskENTER_CRITICAL();
+
+    c2d_dedup_stats.checked++;
+    entry = c2d_seen_find(ack_id);
+
+    if (entry != NULL) {
+        entry->last_used = ++c2d_seen_clock;
+        cached = *entry;
+        c2d_dedup_stats.duplicates++;
+        if (cached.ack_type != C2D_ACK_NONE) {
+            c2d_dedup_stats.resent++;
+        }
+        taskEXIT_CRITICAL();
+
+        if (cached.ack_type != C2D_ACK_NONE) {
+            c2d_send_ack(cached.ack_type, ack_id, cached.status, cached.has_message ? cached.message : NULL);
+        }
+        return true;
+    }
+
+    // Replace a free entry, or the least recently used one
+    entry = &c2d_seen[0];
+    for (size_t i = 1; i < IOTC_C2D_DEDUP_ENTRIES && entry->ack_id[0] != '\0'; i++) {
+        if (c2d_seen[i].ack_id[0] == '\0' || c2d_seen[i].last_used < entry->last_used) {
+            entry = &c2d_seen[i];
+        }
+    }
+    strcpy(entry->ack_id, ack_id);
+    entry->last_used = ++c2d_seen_clock;
+    entry->ack_type = C2D_ACK_NONE;
+
+    taskEXIT_CRITICAL();
+#else
+    (void) ack_id;
+#endif
+
+    return false;
+}
+
+
+/* @brief	Forget an ack id so that the message is processed if it is delivered again
+ *
+ * Used when a message is discarded without being processed.
+ */
+void iotc_c2d_forget(const char *ack_id)
+{
+#if IOTC_C2D_DEDUP_ENTRIES > 0
+    C2dSeenEntry *entry;
+
+    if (ack_id == NULL || ack_id[0] == '\0') {
+        return;
+    }
+
+    taskENTER_CRITICAL();
+    entry = c2d_seen_find(ack_id);
+    if (entry != NULL) {
+        entry->ack_id[0] = '\0';
+    }
+    taskEXIT_CRITICAL();
+#else
+    (void) ack_id;
+#endif
+}
+
+
+/* @brief	Send a command ack and remember it in case the command is delivered again
+ */
+int iotc_c2d_send_cmd_ack(const char *ack_id, int status, const char *message)
+{
+    c2d_seen_record(ack_id, C2D_ACK_CMD, status, message);
+    return c2d_send_ack(C2D_ACK_CMD, ack_id, status, message);
+}
+
+
+/* @brief	Send an OTA ack and remember it in case the OTA request is delivered again
+ */
+int iotc_c2d_send_ota_ack(const char *ack_id, int status, const char *message)
+{
+    c2d_seen_record(ack_id, C2D_ACK_OTA, status, message);
+    return c2d_send_ack(C2D_ACK_OTA, ack_id, status, message);
+}
+
+
+/*
+ *
+ */
+void iotc_c2d_get_dedup_stats(IotcC2dDedupStats *stats)
+{
+    taskENTER_CRITICAL();
+    *stats = c2d_dedup_stats;
+    taskEXIT_CRITICAL();
+}
+
+
+/* @brief	Split the message into tokens without modifying it
+ */
+static int c2d_tokenize(IotcC2dEvent *event)
+{
+    const char *json = event->message;
+    uint16_t stack[IOTC_C2D_MAX_DEPTH];     // token indexes of the open objects and arrays
+    bool key_next[IOTC_C2D_MAX_DEPTH];      // for objects, the next token is a key
+    int depth = 0;
+    bool done = false;
+    size_t pos = 0;
+
+    while (json[pos] != '\0') {
+        char c = json[pos];
+        IotcC2dToken *tok;
+        IotcC2dToken *parent = (depth > 0) ? &event->tokens[stack[depth - 1]] : NULL;
+        bool is_key = (parent && parent->type == IOTC_C2D_TOK_OBJECT && key_next[depth - 1]);
+
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == ',' || c == ':') {
+            pos++;
+            continue;
+        }
+
+        if (c == '}' || c == ']') {
+            if (parent == NULL || parent->type != ((c == '}') ? IOTC_C2D_TOK_OBJECT : IOTC_C2D_TOK_ARRAY)
+                    || (parent->type == IOTC_C2D_TOK_OBJECT && !key_next[depth - 1])) {
+                return -2;
+            }
+            parent->len = (uint16_t) (pos + 1 - parent->start);
+            parent->next = event->token_count;
+            depth--;
+            pos++;
+
+            if (depth == 0) {
+                done = true;
+            } else if (event->tokens[stack[depth - 1]].type == IOTC_C2D_TOK_OBJECT) {
+                key_next[depth - 1] = true;
+            }
+            continue;
+        }
+
+        if (done || event->token_count >= IOTC_C2D_MAX_TOKENS) {
+            return -3;
+        }
+        if (parent == NULL && c != '{') {
+            return -2;
+        }
+        if (is_key && c != '"') {
+            return -2;
+        }
+
+        tok = &event->tokens[event->token_count++];
+        tok->start = (uint16_t) pos;
+        tok->count = 0;
+
+        if (parent && (parent->type == IOTC_C2D_TOK_ARRAY || is_key)) {
+            parent->count++;
+        }
+
+        if (c == '{' || c == '[') {
+            if (depth >= IOTC_C2D_MAX_DEPTH) {
+                return -4;
+            }
+            tok->type = (c == '{') ? IOTC_C2D_TOK_OBJECT : IOTC_C2D_TOK_ARRAY;
+            stack[depth] = (uint16_t) (event->token_count - 1);
+            key_next[depth] = true;
+            depth++;
+            pos++;
+            continue;
+        }
+
+        if (c == '"') {
+            size_t end = pos + 1;
+
+            while (json[end] != '"') {
+                if (json[end] == '\0' || (unsigned char) json[end] < 0x20) {
+                    return -2;
+                }
+                if (json[end] == '\\') {
+                    end++;
+                    if (json[end] == '\0') {
+                        return -2;
+                    }
+                }
+                end++;
+            }
+            tok->type = IOTC_C2D_TOK_STRING;
+            tok->start = (uint16_t) (pos + 1);
+            tok->len = (uint16_t) (end - pos - 1);
+            pos = end + 1;
+        } else {
+            size_t end = pos;
+
+            if (!(c == '-' || (c >= '0' && c <= '9') || c == 't' || c == 'f' || c == 'n')) {
+                return -2;
+            }
+            while (json[end] != '\0' && strchr(" \t\r\n,:]}\"", json[end]) == NULL) {
+                end++;
+            }
+            tok->type = IOTC_C2D_TOK_PRIMITIVE;
+            tok->len = (uint16_t) (end - pos);
+            pos = end;
+        }
+
+        tok->next = event->token_count;
+        if (parent && parent->type == IOTC_C2D_TOK_OBJECT) {
+            key_next[depth - 1] = !is_key;
+        }
+    }
+
+    return (done && depth == 0) ? 0 : -2;
+}
+
+
+/* @brief	Unescape a JSON string in place. Returns the new length, never more than len.
+ */
+static size_t c2d_unescape(char *str, size_t len)
+{
+    size_t in = 0;
+    size_t out = 0;
+
+    // Most strings have no escapes; avoid rewriting them
+    if (memchr(str, '\\', len) == NULL) {
+        return len;
+    }
+
+    while (in < len) {
+        char c = str[in++];
+        uint32_t cp;
+
+        if (c != '\\' || in >= len) {
+            str[out++] = c;
+            continue;
+        }
+
+        c = str[in++];
+        switch (c) {
+        case 'b': str[out++] = '\b'; break;
+        case 'f': str[out++] = '\f'; break;
+        case 'n': str[out++] = '\n'; break;
+        case 'r': str[out++] = '\r'; break;
+        case 't': str[out++] = '\t'; break;
+        case 'u':
+            if (in + 4 > len || c2d_hex4(&str[in], &cp) != 0) {
+                str[out++] = '?';
+                break;
+            }
+            in += 4;
+            // Combine a surrogate pair into one code point
+            if (cp >= 0xD800 && cp <= 0xDBFF && in + 6 <= len && str[in] == '\\' && str[in + 1] == 'u') {
+                uint32_t low;
+
+                if (c2d_hex4(&str[in + 2], &low) == 0 && low >= 0xDC00 && low <= 0xDFFF) {
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    in += 6;
+                }
+            }
+            out += c2d_put_utf8(&str[out], cp);
+            break;
+        default:
+            // \" \\ \/ and anything unknown stand for the character itself
+            str[out++] = c;
+            break;
+        }
+    }
+
+    return out;
+}
+
+
+/* @brief	Write cp as UTF-8. Never writes more bytes than the escape it replaces.
+ */
+static size_t c2d_put_utf8(char *out, uint32_t cp)
+{
+    if (cp < 0x80) {
+        out[0] = (char) cp;
+        return 1;
+    } else if (cp < 0x800) {
+        out[0] = (char) (0xC0 | (cp >> 6));
+        out[1] = (char) (0x80 | (cp & 0x3F));
+        return 2;
+    } else if (cp < 0x10000) {
+        out[0] = (char) (0xE0 | (cp >> 12));
+        out[1] = (char) (0x80 | ((cp >> 6) & 0x3F));
+        out[2] = (char) (0x80 | (cp & 0x3F));
+        return 3;
+    }
+
+    out[0] = (char) (0xF0 | (cp >> 18));
+    out[1] = (char) (0x80 | ((cp >> 12) & 0x3F));
+    out[2] = (char) (0x80 | ((cp >> 6) & 0x3F));
+    out[3] = (char) (0x80 | (cp & 0x3F));
+    return 4;
+}
+
+
+/*
+ *
+ */
+static int c2d_hex4(const char *p, uint32_t *value)
+{
+    *value = 0;
+
+    for (int i = 0; i < 4; i++) {
+        char c = p[i];
+
+        *value <<= 4;
+        if (c >= '0' && c <= '9') {
+            *value |= (uint32_t) (c - '0');
+        } else if (c >= 'a' && c <= 'f') {
+            *value |= (uint32_t) (c - 'a' + 10);
+        } else if (c >= 'A' && c <= 'F') {
+            *value |= (uint32_t) (c - 'A' + 10);
+        } else {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* @brief	Return the token index of the value of key in an object, or -1
+ */
+static int c2d_find_key(const IotcC2dEvent *event, int object, const char *key)
+{
+    const IotcC2dToken *obj;
+    int i;
+
+    if (object < 0 || object >= event->token_count || event->tokens[object].type != IOTC_C2D_TOK_OBJECT) {
+        return -1;
+    }
+
+    obj = &event->tokens[object];
+    i = object + 1;
+
+    for (uint16_t k = 0; k < obj->count; k++) {
+        const IotcC2dToken *key_tok = &event->tokens[i];
+
+        if (strcmp(&event->message[key_tok->start], key) == 0) {
+            return i + 1;
+        }
+        i = event->tokens[i + 1].next;
+    }
+
+    return -1;
+}
+
+
+/*
+ *
+ */
+static IotcC2dString c2d_string(const IotcC2dEvent *event, int index)
+{
+    IotcC2dString s = { NULL, 0 };
+
+    if (index >= 0 && event->tokens[index].type == IOTC_C2D_TOK_STRING) {
+        s.str = &event->message[event->tokens[index].start];
+        s.len = event->tokens[index].len;
+    }
+
+    return s;
+}
+
+
+/* @brief	Return the token index of element index of the "urls" array, or -1
+ */
+static int c2d_ota_url_object(const IotcC2dEvent *event, size_t index)
+{
+    int i;
+
+    if (index >= iotc_c2d_get_ota_url_count(event)) {
+        return -1;
+    }
+
+    i = event->urls + 1;
+    while (index-- > 0) {
+        i = event->tokens[i].next;
+    }
+
+    return i;
+}
+
+
+/* @brief	Remember the last ack sent for an ack id that is being tracked
+ */
+static void c2d_seen_record(const char *ack_id, uint8_t ack_type, int status, const char *message)
+{
+#if IOTC_C2D_DEDUP_ENTRIES > 0
+    C2dSeenEntry *entry;
+
+    if (ack_id == NULL) {
+        return;
+    }
+
+    taskENTER_CRITICAL();
+    entry = c2d_seen_find(ack_id);
+    if (entry != NULL) {
+        entry->ack_type = ack_type;
+        entry->status = status;
+        entry->has_message = (message != NULL);
+        if (message != NULL) {
+            strncpy(entry->message, message, IOTC_C2D_DEDUP_MESSAGE_MAX_LEN);
+            entry->message[IOTC_C2D_DEDUP_MESSAGE_MAX_LEN] = '\0';
+        }
+    }
+    taskEXIT_CRITICAL();
+#else
+    (void) ack_id;
+    (void) ack_type;
+    (void) status;
+    (void) message;
+#endif
+}
+
+
+/*
+ *
+ */
+static int c2d_send_ack(uint8_t ack_type, const char *ack_id, int status, const char *message)
+{
+    if (iotconnect_sdk_get_payload_encoding() == IOTC_ENCODING_CBOR) {
+        return c2d_send_cbor_ack(ack_type, ack_id, status, message);
+    }
+
+    if (ack_type == C2D_ACK_OTA) {
+        return iotcl_mqtt_send_ota_ack(ack_id, status, message);
+    }
+
+    return iotcl_mqtt_send_cmd_ack(ack_id, status, message);
+}
+
+
+/* @brief	Send {"d":{"ack":ack_id,"type":0|1,"st":status,"msg":message}} as CBOR
+ */
+static int c2d_send_cbor_ack(uint8_t ack_type, const char *ack_id, int status, const char *message)
+{
+    // {"d":{ as a map of one entry holding a map of four
+    static const uint8_t ack_start[] = { 0xa1, 0x61, 'd', 0xa4 };
+    uint8_t buf[IOTC_C2D_CBOR_ACK_MAX_LEN];
+    size_t len = sizeof(ack_start);
+    size_t n;
+
+    if (ack_id == NULL) {
+        return IOTCL_ERR_MISSING_VALUE;
+    }
+
+    memcpy(buf, ack_start, sizeof(ack_start));
+    len += c2d_cbor_text(&buf[len], sizeof(buf) - len, "ack", false);
+    if ((n = c2d_cbor_text(&buf[len], sizeof(buf) - len, ack_id, false)) == 0) {
+        IOTCL_ERROR(IOTCL_ERR_BAD_VALUE, "Ack id too long for a CBOR ack");
+        return IOTCL_ERR_BAD_VALUE;
+    }
+    len += n;
+
+    // The rest always fits: keys and numbers take at most 22 bytes, and the message is
+    // truncated to the remaining space
+    if (sizeof(buf) - len < 22 + IOTC_CBOR_HEAD_MAX_LEN) {
+        IOTCL_ERROR(IOTCL_ERR_BAD_VALUE, "Ack id too long for a CBOR ack");
+        return IOTCL_ERR_BAD_VALUE;
+    }
+    len += c2d_cbor_text(&buf[len], sizeof(buf) - len, "type", false);
+    buf[len++] = (ack_type == C2D_ACK_OTA) ? 1 : 0;
+    len += c2d_cbor_text(&buf[len], sizeof(buf) - len, "st", false);
+    len += iotc_cbor_number(&buf[len], (double) status);
+    len += c2d_cbor_text(&buf[len], sizeof(buf) - len, "msg", false);
+    len += c2d_cbor_text(&buf[len], sizeof(buf) - len, message ? message : "", true);
+
+    return (iotc_device_client_mqtt_publish_topic(IOTC_TOPIC_ACK, buf, len) == MQTTSuccess) ? IOTCL_SUCCESS
+            : IOTCL_ERR_FAILED;
+}
+
+
+/* @brief	Write a CBOR text string into out
+ *
+ * Returns the bytes written, or 0 if it does not fit in space and truncate is false.
+ */
+static size_t c2d_cbor_text(uint8_t *out, size_t space, const char *str, bool truncate)
+{
+    size_t len = strlen(str);
+    size_t head_len;
+
+    if (space < IOTC_CBOR_HEAD_MAX_LEN) {
+        return 0;
+    }
+    if (len > space - IOTC_CBOR_HEAD_MAX_LEN) {
+        if (!truncate) {
+            return 0;
+        }
+        len = space - IOTC_CBOR_HEAD_MAX_LEN;
+        // Do not cut a UTF-8 sequence in two
+        while (len > 0 && ((unsigned char) str[len] & 0xc0) == 0x80) {
+            len--;
+        }
+    }
+
+    head_len = iotc_cbor_head(out, IOTC_CBOR_MAJOR_TEXT, len);
+    memcpy(&out[head_len], str, len);
+    return head_len + len;
+}
+
+
+#if IOTC_C2D_DEDUP_ENTRIES > 0
+/* @brief	Find the entry for an ack id. Call in a critical section.
+ */
+static C2dSeenEntry *c2d_seen_find(const char *ack_id)
+{
+    for (size_t i = 0; i < IOTC_C2D_DEDUP_ENTRIES; i++) {
+        if (c2d_seen[i].ack_id[0] != '\0' && strcmp(c2d_seen[i].ack_id, ack_id) == 0) {
+            return &c2d_seen[i];
+        }
+    }
+
+    return NULL;
+}
+#endif
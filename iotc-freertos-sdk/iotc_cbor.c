@@ -0,0 +1,95 @@
+//
+// Copyright: Avnet 2024
+//
+// The few CBOR items the telemetry encoder and C2D acks need.  Each function writes one
+// item head into out, which must hold IOTC_CBOR_HEAD_MAX_LEN bytes, and returns its
+// length.  String contents are copied by the caller after the head.
+//
+
+#include <string.h>
+#include <math.h>
+#include <float.h>
+
+#include "iotc_cbor.h"
+
+
+/* @brief	Write the head of an item: its major type and its value, count or length
+ */
+size_t iotc_cbor_head(uint8_t *out, uint8_t major, uint64_t value)
+{
+    size_t bytes;
+
+    major = (uint8_t) (major << 5);
+
+    if (value < 24) {
+        out[0] = (uint8_t) (major | value);
+        return 1;
+    } else if (value <= UINT8_MAX) {
+        out[0] = (uint8_t) (major | 24);
+        bytes = 1;
+    } else if (value <= UINT16_MAX) {
+        out[0] = (uint8_t) (major | 25);
+        bytes = 2;
+    } else if (value <= UINT32_MAX) {
+        out[0] = (uint8_t) (major | 26);
+        bytes = 4;
+    } else {
+        out[0] = (uint8_t) (major | 27);
+        bytes = 8;
+    }
+
+    // Big endian
+    for (size_t i = bytes; i > 0; i--) {
+        out[i] = (uint8_t) value;
+        value >>= 8;
+    }
+
+    return bytes + 1;
+}
+
+
+/* @brief	Write a number in its shortest exact form
+ *
+ * Whole numbers become integers, others a single precision float if that holds them
+ * exactly, else a double.  NaN and infinity are written as null, as in the JSON messages.
+ */
+size_t iotc_cbor_number(uint8_t *out, double value)
+{
+    uint64_t bits;
+    size_t bytes;
+
+    if (isnan(value) || isinf(value)) {
+        out[0] = IOTC_CBOR_NULL;
+        return 1;
+    }
+
+    // 2^64 is exact as a double; anything below it fits the head
+    if (value == floor(value) && fabs(value) < 18446744073709551616.0) {
+        if (value >= 0) {
+            return iotc_cbor_head(out, IOTC_CBOR_MAJOR_UINT, (uint64_t) value);
+        }
+        return iotc_cbor_head(out, IOTC_CBOR_MAJOR_NEGINT, (uint64_t) (-value) - 1);
+    }
+
+    // Converting a double outside the float range to float is undefined, so check first
+    if (fabs(value) <= FLT_MAX && (double) (float) value == value) {
+        float single = (float) value;
+        uint32_t single_bits;
+
+        memcpy(&single_bits, &single, sizeof(single_bits));
+        out[0] = 0xfa;
+        bits = single_bits;
+        bytes = 4;
+    } else {
+        memcpy(&bits, &value, sizeof(bits));
+        out[0] = 0xfb;
+        bytes = 8;
+    }
+
+    for (size_t i = bytes; i > 0; i--) {
+        out[i] = (uint8_t) bits;
+        bits >>= 8;
+    }
+
+    return bytes + 1;
+}
@@ -0,0 +1,441 @@
+//
+// Copyright: Avnet 2024
+//
+// Registry of cloud-to-device commands.  The first word of an incoming command is hashed
+// once and looked up in an open addressed table that is kept at most half full, so the
+// cost of finding a handler depends on the length of the command name, not on how many
+// commands are registered.  Names must match exactly (ignoring case); a command that
+// merely contains a registered name is not dispatched to it.
+//
+// A handler that starts work which finishes later calls iotc_command_defer() and reports
+// the result with iotc_command_complete().  The ack id is copied into a small table of
+// pending commands because the message it came from is released when the handler returns.
+//
+
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <limits.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "iotcl.h"
+#include "iotcl_log.h"
+#include "iotc_commands.h"
+
+#if (IOTC_COMMAND_TABLE_SIZE & (IOTC_COMMAND_TABLE_SIZE - 1)) != 0
+#error "IOTC_COMMAND_TABLE_SIZE must be a power of two"
+#endif
+
+#if IOTC_COMMAND_TABLE_SIZE < (2 * IOTC_COMMAND_MAX_COUNT)
+#error "IOTC_COMMAND_TABLE_SIZE must be at least twice IOTC_COMMAND_MAX_COUNT"
+#endif
+
+#define FNV1A_OFFSET_BASIS      (2166136261u)
+#define FNV1A_PRIME             (16777619u)
+
+typedef struct {
+    const IotcCommandDesc *desc;    // NULL if the slot is empty
+    uint32_t hash;
+    uint8_t name_len;
+} CommandSlot;
+
+typedef struct {
+    char ack_id[IOTC_COMMAND_ACK_ID_MAX_LEN + 1];   // "" if the result is not acked
+    uint16_t generation;
+    bool in_use;
+} PendingCommand;
+
+static CommandSlot command_table[IOTC_COMMAND_TABLE_SIZE];
+static PendingCommand pending_commands[IOTC_COMMAND_MAX_PENDING];
+static IotcCommandStats command_stats;
+
+static uint32_t command_hash(const char *name, size_t len);
+static size_t command_name_len(const char *command);
+static const CommandSlot *command_lookup(const char *name, size_t len, uint32_t hash);
+static void command_stats_add(uint32_t *counter);
+static bool command_acks_result(const IotcCommandDesc *desc);
+static void command_send_result(const char *ack_id, int status, const char *message);
+
+
+/* @brief	Register a cloud-to-device command
+ *
+ * @param	desc, describes the command. It is referenced, not copied, so it must stay valid.
+ *
+ * Commands are usually registered before iotconnect_sdk_init().  Returns -1 if the name
+ * is invalid or already registered, or the table is full.
+ */
+int iotc_register_command(const IotcCommandDesc *desc)
+{
+    size_t len;
+    uint32_t hash;
+    size_t i;
+
+    if (!desc || !desc->name || !desc->handler) {
+        return -1;
+    }
+
+    len = strlen(desc->name);
+    if (len == 0 || len > IOTC_COMMAND_NAME_MAX_LEN || command_name_len(desc->name) != len) {
+        IOTCL_ERROR(0, "Invalid command name \"%s\"", desc->name);
+        return -1;
+    }
+
+    hash = command_hash(desc->name, len);
+
+    taskENTER_CRITICAL();
+
+    if (command_stats.registered >= IOTC_COMMAND_MAX_COUNT || command_lookup(desc->name, len, hash) != NULL) {
+        taskEXIT_CRITICAL();
+        IOTCL_ERROR(0, "Unable to register command %s", desc->name);
+        return -1;
+    }
+
+    for (i = hash & (IOTC_COMMAND_TABLE_SIZE - 1); command_table[i].desc != NULL;
+            i = (i + 1) & (IOTC_COMMAND_TABLE_SIZE - 1)) {
+        ;
+    }
+
+    command_table[i].hash = hash;
+    command_table[i].name_len = (uint8_t) len;
+    command_table[i].desc = desc;
+    command_stats.registered++;
+
+    taskEXIT_CRITICAL();
+
+    return 0;
+}
+
+
+/* @brief	Find the registered command for a command string such as "led-red on"
+ *
+ * @param	name_len, optional, set to the length of the command name at the start of command
+ *
+ * Returns NULL if the first word of command is not a registered command.
+ */
+const IotcCommandDesc *iotc_command_find(const char *command, size_t *name_len)
+{
+    size_t len = command_name_len(command);
+    const CommandSlot *slot = NULL;
+    uint32_t hash;
+
+    if (len > 0 && len <= IOTC_COMMAND_NAME_MAX_LEN) {
+        hash = command_hash(command, len);
+
+        taskENTER_CRITICAL();
+        slot = command_lookup(command, len, hash);
+        taskEXIT_CRITICAL();
+    }
+
+    if (name_len) {
+        *name_len = len;
+    }
+
+    return slot ? slot->desc : NULL;
+}
+
+
+/* @brief	C2D command callback that runs registered commands
+ *
+ * Set as the cmd_cb in IotConnectClientConfig.  Depending on the command's ack policy
+ * the cloud is sent IOTCL_C2D_EVT_CMD_SUCCESS_WITH_ACK or IOTCL_C2D_EVT_CMD_FAILED when
+ * the handler returns, or when it calls iotc_command_complete() if it deferred the result.
+ */
+void iotc_command_dispatch(const IotcC2dEvent *event)
+{
+    uint64_t parsed[(IOTC_COMMAND_PARSED_ARGS_SIZE + sizeof(uint64_t) - 1) / sizeof(uint64_t)];
+    const char *command = iotc_c2d_get_command(event).str;
+    const IotcCommandDesc *desc;
+    IotcCommandRequest request;
+    size_t name_len;
+    int status;
+
+    memset(&request, 0, sizeof(request));
+    request.event = event;
+    request.ack_id = iotc_c2d_get_ack_id(event).str;
+
+    if (command == NULL) {
+        IOTCL_ERROR(0, "No command, internal error");
+        // could be a command without acknowledgement, so ack_id can be null
+        if (request.ack_id) {
+            iotc_c2d_send_cmd_ack(request.ack_id, IOTCL_C2D_EVT_CMD_FAILED, "Internal error");
+        }
+        return;
+    }
+
+    IOTCL_INFO("Command %s received with %s ACK ID", command, request.ack_id ? request.ack_id : "no");
+
+    desc = iotc_command_find(command, &name_len);
+    if (desc == NULL) {
+        IOTCL_WARN(0, "Command not recognized: %s", command);
+        command_stats_add(&command_stats.unknown);
+        if (request.ack_id) {
+            iotc_c2d_send_cmd_ack(request.ack_id, IOTCL_C2D_EVT_CMD_FAILED, "Not implemented");
+        }
+        return;
+    }
+
+    request.name = desc->name;
+    request.context = desc->context;
+    request.args = command + name_len;
+    while (*request.args == ' ') {
+        request.args++;
+    }
+
+    command_stats_add(&command_stats.dispatched);
+
+    if (desc->parse_args) {
+        if (desc->parse_args(request.args, parsed) != 0) {
+            IOTCL_WARN(0, "Invalid arguments for %s: %s", desc->name, request.args);
+            command_stats_add(&command_stats.bad_args);
+            if (request.ack_id && desc->ack_policy != IOTC_CMD_ACK_NONE) {
+                iotc_c2d_send_cmd_ack(request.ack_id, IOTCL_C2D_EVT_CMD_FAILED, "Invalid arguments");
+            }
+            return;
+        }
+        request.parsed_args = parsed;
+    }
+
+    status = desc->handler(&request);
+
+    if (request.token != 0) {
+        // The result is sent by iotc_command_complete()
+        return;
+    }
+
+    if (status != 0) {
+        command_stats_add(&command_stats.failed);
+    }
+
+    if (request.ack_id && command_acks_result(desc)) {
+        command_send_result(request.ack_id, status, request.ack_message);
+    }
+}
+
+
+/* @brief	Keep a command pending after its handler returns
+ *
+ * Call from the handler of a command that finishes later, e.g. once a transfer it starts
+ * has completed.  No ack is sent when the handler returns; pass the returned token to
+ * iotc_command_complete() when the result is known.
+ *
+ * Returns 0 if IOTC_COMMAND_MAX_PENDING commands are already pending, in which case the
+ * handler's return value is acked as usual.
+ */
+IotcCommandToken iotc_command_defer(IotcCommandRequest *request)
+{
+    const IotcCommandDesc *desc;
+    const char *ack_id = "";
+    PendingCommand *pending = NULL;
+    IotcCommandToken token = 0;
+
+    if (request->token != 0) {
+        return request->token;
+    }
+
+    desc = iotc_command_find(request->name, NULL);
+    if (request->ack_id && desc && command_acks_result(desc)) {
+        ack_id = request->ack_id;
+    }
+
+    if (strlen(ack_id) > IOTC_COMMAND_ACK_ID_MAX_LEN) {
+        IOTCL_ERROR(0, "Ack id of %s too long to defer", request->name);
+        return 0;
+    }
+
+    taskENTER_CRITICAL();
+    for (size_t i = 0; i < IOTC_COMMAND_MAX_PENDING; i++) {
+        if (!pending_commands[i].in_use) {
+            pending = &pending_commands[i];
+            pending->in_use = true;
+            pending->generation++;
+            token = ((uint32_t) pending->generation << 8) | (uint32_t) (i + 1);
+            break;
+        }
+    }
+    taskEXIT_CRITICAL();
+
+    if (pending == NULL) {
+        IOTCL_WARN(0, "Too many pending commands, %s completes now", request->name);
+        return 0;
+    }
+
+    strcpy(pending->ack_id, ack_id);
+    request->token = token;
+
+    return token;
+}
+
+
+/* @brief	Report the result of a command deferred with iotc_command_defer()
+ *
+ * @param	status, 0 on success
+ * @param	message, optional ack message, replaces "Command OK" or "Command error"
+ *
+ * Can be called from any task except the MQTT agent task.  Returns -1 if the token is not
+ * pending, e.g. because the command was already completed.
+ */
+int iotc_command_complete(IotcCommandToken token, int status, const char *message)
+{
+    char ack_id[IOTC_COMMAND_ACK_ID_MAX_LEN + 1];
+    size_t index = (token & 0xFF) - 1;
+    PendingCommand *pending;
+
+    if (token == 0 || index >= IOTC_COMMAND_MAX_PENDING) {
+        return -1;
+    }
+
+    pending = &pending_commands[index];
+
+    taskENTER_CRITICAL();
+    if (!pending->in_use || pending->generation != (uint16_t) (token >> 8)) {
+        taskEXIT_CRITICAL();
+        return -1;
+    }
+    strcpy(ack_id, pending->ack_id);
+    pending->in_use = false;
+    command_stats.deferred++;
+    if (status != 0) {
+        command_stats.failed++;
+    }
+    taskEXIT_CRITICAL();
+
+    if (ack_id[0] != '\0') {
+        command_send_result(ack_id, status, message);
+    }
+
+    return 0;
+}
+
+
+/*
+ *
+ */
+void iotc_command_get_stats(IotcCommandStats *stats)
+{
+    taskENTER_CRITICAL();
+    *stats = command_stats;
+    taskEXIT_CRITICAL();
+}
+
+
+/* @brief	Argument parser for commands taking "on" or "off". parsed is a bool.
+ */
+int iotc_command_parse_on_off(const char *args, void *parsed)
+{
+    size_t len = command_name_len(args);
+
+    if (len == 2 && strncasecmp(args, "on", 2) == 0) {
+        *(bool *) parsed = true;
+    } else if (len == 3 && strncasecmp(args, "off", 3) == 0) {
+        *(bool *) parsed = false;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* @brief	Argument parser for commands taking one integer. parsed is an int.
+ */
+int iotc_command_parse_int(const char *args, void *parsed)
+{
+    char *end;
+    long value = strtol(args, &end, 0);
+
+    if (end == args || (*end != '\0' && *end != ' ') || value < INT_MIN || value > INT_MAX) {
+        return -1;
+    }
+
+    *(int *) parsed = (int) value;
+    return 0;
+}
+
+
+/* @brief	Count an event. Commands may be dispatched from several command workers at once.
+ */
+static void command_stats_add(uint32_t *counter)
+{
+    taskENTER_CRITICAL();
+    (*counter)++;
+    taskEXIT_CRITICAL();
+}
+
+
+/* @brief	True if the cloud is sent the result of the command when it asks for an ack
+ */
+static bool command_acks_result(const IotcCommandDesc *desc)
+{
+    return desc->ack_policy == IOTC_CMD_ACK_AUTO || desc->ack_policy == IOTC_CMD_ACK_TWO_PHASE;
+}
+
+
+/*
+ *
+ */
+static void command_send_result(const char *ack_id, int status, const char *message)
+{
+    if (status == 0) {
+        iotc_c2d_send_cmd_ack(ack_id, IOTCL_C2D_EVT_CMD_SUCCESS_WITH_ACK, message ? message : "Command OK");
+    } else {
+        iotc_c2d_send_cmd_ack(ack_id, IOTCL_C2D_EVT_CMD_FAILED, message ? message : "Command error");
+    }
+}
+
+
+/* @brief	Case insensitive FNV-1a hash of the first len characters of name
+ */
+static uint32_t command_hash(const char *name, size_t len)
+{
+    uint32_t hash = FNV1A_OFFSET_BASIS;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t) tolower((unsigned char) name[i]);
+        hash *= FNV1A_PRIME;
+    }
+
+    return hash;
+}
+
+
+/* @brief	Length of the command name, the first word of command
+ */
+static size_t command_name_len(const char *command)
+{
+    size_t len = 0;
+
+    while (command[len] != '\0' && command[len] != ' ') {
+        len++;
+    }
+
+    return len;
+}
+
+
+/* @brief	Find a command in the table and track the longest probe sequence
+ *
+ * Call in a critical section, as commands are looked up from several command workers at
+ * once and may be registered meanwhile.
+ */
+static const CommandSlot *command_lookup(const char *name, size_t len, uint32_t hash)
+{
+    uint16_t probes = 0;
+
+    for (size_t i = hash & (IOTC_COMMAND_TABLE_SIZE - 1); command_table[i].desc != NULL;
+            i = (i + 1) & (IOTC_COMMAND_TABLE_SIZE - 1)) {
+        const CommandSlot *slot = &command_table[i];
+
+        probes++;
+        if (slot->hash == hash && slot->name_len == len && strncasecmp(slot->desc->name, name, len) == 0) {
+            if (probes > command_stats.max_probes) {
+                command_stats.max_probes = probes;
+            }
+            return slot;
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,628 @@
+//
+// Copyright: Avnet 2024
+//
+// Number formatting for telemetry without printf.  iotc_dtoa_shortest() uses Florian
+// Loitsch's Grisu2 algorithm, following the structure of the implementation in
+// nlohmann/json.  Its result always reads back as the same double, and is the shortest
+// such decimal for about 99.9% of doubles; for the other 0.1% it has a digit or two more
+// than needed.  There is no Grisu3 style fallback to a slow exact algorithm, as a longer
+// number in a telemetry message is harmless.  It only needs 64 bit integer arithmetic and
+// a small table, where printf needs bignums or long double and several hundred bytes of
+// stack.
+//
+// Output is valid JSON: fixed notation for decimal exponents from -4 to 15, otherwise
+// d.ddde+XX.  iotc_dtoa_fixed() keeps fixed notation up to 1e21.  NaN and infinity are
+// not numbers in JSON; callers write null for them.
+//
+
+#include <string.h>
+#include <math.h>
+
+#include "iotc_dtoa.h"
+
+#ifdef IOTC_ENABLE_BENCHMARKS
+#include <stdio.h>
+#include <stdlib.h>
+#include <float.h>
+
+#include "iotcl_log.h"
+#include "iotc_benchmark.h"
+#endif
+
+typedef struct {
+    uint64_t f;
+    int e;
+} DiyFp;
+
+typedef struct {
+    uint64_t f;
+    int e;
+    int k;
+} CachedPower;
+
+#define DTOA_ALPHA              (-60)
+#define DTOA_GAMMA              (-32)
+#define DTOA_CACHED_MIN_DEC_EXP (-300)
+#define DTOA_CACHED_DEC_STEP    (8)
+#define DTOA_MIN_EXP            (-4)
+#define DTOA_MAX_EXP            (15)
+#define DTOA_FIXED_MAX_EXP      (21)        // most whole digits iotc_dtoa_fixed() writes, within IOTC_DTOA_BUFFER_LEN
+
+// 10^decimals for iotc_dtoa_fixed() and iotc_dtoa_round(), all exact as doubles
+static const double dtoa_pow10[IOTC_DTOA_MAX_DECIMALS + 1] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9
+};
+
+// 10^k for k = -300, -292, ... 324, normalized to a 64 bit significand f and binary
+// exponent e and rounded to nearest, i.e. 10^k ~= f * 2^e.  Computed with exact rational
+// arithmetic.
+static const CachedPower dtoa_cached_powers[] = {
+    { 0xAB70FE17C79AC6CA, -1060, -300 },
+    { 0xFF77B1FCBEBCDC4F, -1034, -292 },
+    { 0xBE5691EF416BD60C, -1007, -284 },
+    { 0x8DD01FAD907FFC3C,  -980, -276 },
+    { 0xD3515C2831559A83,  -954, -268 },
+    { 0x9D71AC8FADA6C9B5,  -927, -260 },
+    { 0xEA9C227723EE8BCB,  -901, -252 },
+    { 0xAECC49914078536D,  -874, -244 },
+    { 0x823C12795DB6CE57,  -847, -236 },
+    { 0xC21094364DFB5637,  -821, -228 },
+    { 0x9096EA6F3848984F,  -794, -220 },
+    { 0xD77485CB25823AC7,  -768, -212 },
+    { 0xA086CFCD97BF97F4,  -741, -204 },
+    { 0xEF340A98172AACE5,  -715, -196 },
+    { 0xB23867FB2A35B28E,  -688, -188 },
+    { 0x84C8D4DFD2C63F3B,  -661, -180 },
+    { 0xC5DD44271AD3CDBA,  -635, -172 },
+    { 0x936B9FCEBB25C996,  -608, -164 },
+    { 0xDBAC6C247D62A584,  -582, -156 },
+    { 0xA3AB66580D5FDAF6,  -555, -148 },
+    { 0xF3E2F893DEC3F126,  -529, -140 },
+    { 0xB5B5ADA8AAFF80B8,  -502, -132 },
+    { 0x87625F056C7C4A8B,  -475, -124 },
+    { 0xC9BCFF6034C13053,  -449, -116 },
+    { 0x964E858C91BA2655,  -422, -108 },
+    { 0xDFF9772470297EBD,  -396, -100 },
+    { 0xA6DFBD9FB8E5B88F,  -369,  -92 },
+    { 0xF8A95FCF88747D94,  -343,  -84 },
+    { 0xB94470938FA89BCF,  -316,  -76 },
+    { 0x8A08F0F8BF0F156B,  -289,  -68 },
+    { 0xCDB02555653131B6,  -263,  -60 },
+    { 0x993FE2C6D07B7FAC,  -236,  -52 },
+    { 0xE45C10C42A2B3B06,  -210,  -44 },
+    { 0xAA242499697392D3,  -183,  -36 },
+    { 0xFD87B5F28300CA0E,  -157,  -28 },
+    { 0xBCE5086492111AEB,  -130,  -20 },
+    { 0x8CBCCC096F5088CC,  -103,  -12 },
+    { 0xD1B71758E219652C,   -77,   -4 },
+    { 0x9C40000000000000,   -50,    4 },
+    { 0xE8D4A51000000000,   -24,   12 },
+    { 0xAD78EBC5AC620000,     3,   20 },
+    { 0x813F3978F8940984,    30,   28 },
+    { 0xC097CE7BC90715B3,    56,   36 },
+    { 0x8F7E32CE7BEA5C70,    83,   44 },
+    { 0xD5D238A4ABE98068,   109,   52 },
+    { 0x9F4F2726179A2245,   136,   60 },
+    { 0xED63A231D4C4FB27,   162,   68 },
+    { 0xB0DE65388CC8ADA8,   189,   76 },
+    { 0x83C7088E1AAB65DB,   216,   84 },
+    { 0xC45D1DF942711D9A,   242,   92 },
+    { 0x924D692CA61BE758,   269,  100 },
+    { 0xDA01EE641A708DEA,   295,  108 },
+    { 0xA26DA3999AEF774A,   322,  116 },
+    { 0xF209787BB47D6B85,   348,  124 },
+    { 0xB454E4A179DD1877,   375,  132 },
+    { 0x865B86925B9BC5C2,   402,  140 },
+    { 0xC83553C5C8965D3D,   428,  148 },
+    { 0x952AB45CFA97A0B3,   455,  156 },
+    { 0xDE469FBD99A05FE3,   481,  164 },
+    { 0xA59BC234DB398C25,   508,  172 },
+    { 0xF6C69A72A3989F5C,   534,  180 },
+    { 0xB7DCBF5354E9BECE,   561,  188 },
+    { 0x88FCF317F22241E2,   588,  196 },
+    { 0xCC20CE9BD35C78A5,   614,  204 },
+    { 0x98165AF37B2153DF,   641,  212 },
+    { 0xE2A0B5DC971F303A,   667,  220 },
+    { 0xA8D9D1535CE3B396,   694,  228 },
+    { 0xFB9B7CD9A4A7443C,   720,  236 },
+    { 0xBB764C4CA7A44410,   747,  244 },
+    { 0x8BAB8EEFB6409C1A,   774,  252 },
+    { 0xD01FEF10A657842C,   800,  260 },
+    { 0x9B10A4E5E9913129,   827,  268 },
+    { 0xE7109BFBA19C0C9D,   853,  276 },
+    { 0xAC2820D9623BF429,   880,  284 },
+    { 0x80444B5E7AA7CF85,   907,  292 },
+    { 0xBF21E44003ACDD2D,   933,  300 },
+    { 0x8E679C2F5E44FF8F,   960,  308 },
+    { 0xD433179D9C8CB841,   986,  316 },
+    { 0x9E19DB92B4E31BA9,  1013,  324 },
+};
+
+static DiyFp dtoa_mul(DiyFp x, DiyFp y);
+static DiyFp dtoa_normalize(DiyFp x);
+static void dtoa_grisu2(char *digits, int *len, int *decimal_exponent, double value);
+static void dtoa_digit_gen(char *digits, int *len, int *decimal_exponent, DiyFp m_minus, DiyFp w, DiyFp m_plus);
+static void dtoa_round(char *digits, int len, uint64_t dist, uint64_t delta, uint64_t rest, uint64_t ten_k);
+static size_t dtoa_shortest(char *buf, double value, int max_exp);
+static void dtoa_split(double value, int decimals, double *whole, double *fraction);
+static size_t dtoa_format(char *buf, int len, int decimal_exponent, int max_exp);
+
+
+/* @brief	Write the shortest decimal that reads back as value
+ *
+ * @param	buf, IOTC_DTOA_BUFFER_LEN bytes
+ *
+ * Returns the length written, not counting the terminator.  value must be finite.
+ */
+size_t iotc_dtoa_shortest(char *buf, double value)
+{
+    return dtoa_shortest(buf, value, DTOA_MAX_EXP);
+}
+
+
+/* @brief	Write value rounded to at most decimals digits after the point
+ *
+ * Trailing zeros are left out, so 23.50 with 2 decimals is written as 23.5.  Whole
+ * numbers of 1e21 and more do not fit in fixed notation and are written as d.ddde+XX,
+ * like iotc_dtoa_shortest() does.  value must be finite.
+ */
+size_t iotc_dtoa_fixed(char *buf, double value, int decimals)
+{
+    double whole;
+    double fraction;
+    int64_t digits;
+    size_t len;
+    char *p = buf;
+
+    if (decimals < 0) {
+        decimals = 0;
+    } else if (decimals > IOTC_DTOA_MAX_DECIMALS) {
+        decimals = IOTC_DTOA_MAX_DECIMALS;
+    }
+
+    if (fabs(value) >= 9223372036854775808.0) {     // 2^63, past which a double has no fraction
+        return dtoa_shortest(buf, value, DTOA_FIXED_MAX_EXP);
+    }
+
+    dtoa_split(value, decimals, &whole, &fraction);
+    if (whole == 0 && fraction == 0) {
+        return iotc_dtoa_int(buf, 0);
+    }
+
+    if (value < 0) {
+        *p++ = '-';
+    }
+    p += iotc_dtoa_int(p, (int64_t) whole);
+
+    // Drop the trailing zeros of the fraction before placing the point
+    digits = (int64_t) fraction;
+    while (decimals > 0 && digits % 10 == 0) {
+        digits /= 10;
+        decimals--;
+    }
+    if (decimals > 0) {
+        *p++ = '.';
+        len = iotc_dtoa_int(p, digits);
+        memmove(&p[(size_t) decimals - len], p, len);
+        memset(p, '0', (size_t) decimals - len);
+        p += decimals;
+    }
+
+    *p = '\0';
+    return (size_t) (p - buf);
+}
+
+
+/* @brief	The double nearest to what iotc_dtoa_fixed() writes for value
+ *
+ * For binary formats, so that they carry the same value as the JSON text.  Values too
+ * large to scale exactly are returned as they are, as doubles that large are spaced about
+ * as far apart as the decimals anyway.
+ */
+double iotc_dtoa_round(double value, int decimals)
+{
+    double whole;
+    double fraction;
+    double scaled;
+
+    if (decimals < 0) {
+        decimals = 0;
+    } else if (decimals > IOTC_DTOA_MAX_DECIMALS) {
+        decimals = IOTC_DTOA_MAX_DECIMALS;
+    }
+
+    if (!isfinite(value) || fabs(value) >= 9223372036854775808.0) {
+        return value;
+    }
+
+    // Below 2^53 the sum is exact, so the division is rounded once, as parsing the decimal would be
+    dtoa_split(value, decimals, &whole, &fraction);
+    scaled = whole * dtoa_pow10[decimals] + fraction;
+    if (scaled >= 9007199254740992.0) {
+        return value;
+    }
+    if (scaled == 0) {
+        return 0;
+    }
+
+    return (value < 0) ? -scaled / dtoa_pow10[decimals] : scaled / dtoa_pow10[decimals];
+}
+
+
+/* @brief	Write a whole number
+ */
+size_t iotc_dtoa_int(char *buf, int64_t value)
+{
+    char digits[20];
+    char *d = &digits[sizeof(digits)];
+    uint64_t magnitude = (value < 0) ? (uint64_t) 0 - (uint64_t) value : (uint64_t) value;
+    size_t len;
+    char *p = buf;
+
+    do {
+        *--d = (char) ('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude != 0);
+
+    if (value < 0) {
+        *p++ = '-';
+    }
+    len = (size_t) (&digits[sizeof(digits)] - d);
+    memcpy(p, d, len);
+    p += len;
+    *p = '\0';
+
+    return (size_t) (p - buf);
+}
+
+
+#ifdef IOTC_ENABLE_BENCHMARKS
+static size_t benchmark_printf_number(char *buf, size_t size, double value);
+
+static const double benchmark_values[] = {
+    23.75, 0.1, 3.3, -12.5, 1013.25, 0.000123, 98.6000001, 1.0 / 3.0, 6.02214076e23, 299792458.5,
+};
+
+/* @brief	Compare cycles and output bytes per number with the printf formatting it replaced
+ *
+ * The printf path is what the telemetry encoder used before: 15 significant digits, or 17
+ * when 15 do not read back as the same value, as cJSON does.
+ */
+void iotc_dtoa_benchmark(uint32_t iterations)
+{
+    const size_t count = sizeof(benchmark_values) / sizeof(benchmark_values[0]);
+    char buf[IOTC_DTOA_BUFFER_LEN];
+    uint32_t printf_cycles;
+    uint32_t dtoa_cycles;
+    size_t printf_bytes = 0;
+    size_t dtoa_bytes = 0;
+
+    iotc_benchmark_init();
+
+    if (iterations == 0) {
+        return;
+    }
+
+    printf_cycles = IOTC_BENCHMARK_CYCLES();
+    for (uint32_t i = 0; i < iterations; i++) {
+        for (size_t v = 0; v < count; v++) {
+            printf_bytes += benchmark_printf_number(buf, sizeof(buf), benchmark_values[v]);
+        }
+    }
+    printf_cycles = IOTC_BENCHMARK_CYCLES() - printf_cycles;
+
+    dtoa_cycles = IOTC_BENCHMARK_CYCLES();
+    for (uint32_t i = 0; i < iterations; i++) {
+        for (size_t v = 0; v < count; v++) {
+            dtoa_bytes += iotc_dtoa_shortest(buf, benchmark_values[v]);
+        }
+    }
+    dtoa_cycles = IOTC_BENCHMARK_CYCLES() - dtoa_cycles;
+
+    IOTCL_INFO("Number benchmark, printf: %lu cycles, %lu bytes per %u numbers",
+            (unsigned long) (printf_cycles / iterations), (unsigned long) (printf_bytes / iterations),
+            (unsigned) count);
+    IOTCL_INFO("Number benchmark, iotc_dtoa: %lu cycles, %lu bytes per %u numbers",
+            (unsigned long) (dtoa_cycles / iterations), (unsigned long) (dtoa_bytes / iterations),
+            (unsigned) count);
+}
+
+
+/*
+ *
+ */
+static size_t benchmark_printf_number(char *buf, size_t size, double value)
+{
+    double test;
+    int len;
+
+    len = snprintf(buf, size, "%1.15g", value);
+    test = strtod(buf, NULL);
+    if (fabs(test - value) > fmax(fabs(test), fabs(value)) * DBL_EPSILON) {
+        len = snprintf(buf, size, "%1.17g", value);
+    }
+
+    return (len > 0 && (size_t) len < size) ? (size_t) len : 0;
+}
+#endif // IOTC_ENABLE_BENCHMARKS
+
+
+/* @brief	Product of two DiyFps, rounded to 64 bits
+ */
+static DiyFp dtoa_mul(DiyFp x, DiyFp y)
+{
+    uint64_t x_lo = x.f & 0xffffffffu;
+    uint64_t x_hi = x.f >> 32;
+    uint64_t y_lo = y.f & 0xffffffffu;
+    uint64_t y_hi = y.f >> 32;
+    uint64_t p0 = x_lo * y_lo;
+    uint64_t p1 = x_lo * y_hi;
+    uint64_t p2 = x_hi * y_lo;
+    uint64_t p3 = x_hi * y_hi;
+    uint64_t mid = (p0 >> 32) + (p1 & 0xffffffffu) + (p2 & 0xffffffffu);
+    DiyFp result;
+
+    mid += (uint64_t) 1 << 31;
+    result.f = p3 + (p2 >> 32) + (p1 >> 32) + (mid >> 32);
+    result.e = x.e + y.e + 64;
+    return result;
+}
+
+
+/*
+ *
+ */
+static DiyFp dtoa_normalize(DiyFp x)
+{
+    while ((x.f >> 63) == 0) {
+        x.f <<= 1;
+        x.e--;
+    }
+    return x;
+}
+
+
+/* @brief	Write the digits of a positive finite value and its decimal exponent
+ *
+ * value = digits * 10^decimal_exponent
+ */
+static void dtoa_grisu2(char *digits, int *len, int *decimal_exponent, double value)
+{
+    const uint64_t hidden_bit = (uint64_t) 1 << 52;
+    uint64_t bits;
+    uint64_t fraction;
+    int biased_exponent;
+    DiyFp v;
+    DiyFp m_plus;
+    DiyFp m_minus;
+    DiyFp c_minus_k;
+    DiyFp w;
+    DiyFp w_minus;
+    DiyFp w_plus;
+    const CachedPower *cached;
+    int f;
+    int k;
+
+    memcpy(&bits, &value, sizeof(bits));
+    biased_exponent = (int) (bits >> 52);
+    fraction = bits & (hidden_bit - 1);
+
+    if (biased_exponent == 0) {
+        v.f = fraction;
+        v.e = 1 - 1075;
+    } else {
+        v.f = fraction + hidden_bit;
+        v.e = biased_exponent - 1075;
+    }
+
+    // The boundaries halfway to the neighbouring doubles. The lower one is closer when
+    // value is a power of two.
+    m_plus.f = 2 * v.f + 1;
+    m_plus.e = v.e - 1;
+    if (fraction == 0 && biased_exponent > 1) {
+        m_minus.f = 4 * v.f - 1;
+        m_minus.e = v.e - 2;
+    } else {
+        m_minus.f = 2 * v.f - 1;
+        m_minus.e = v.e - 1;
+    }
+    m_plus = dtoa_normalize(m_plus);
+    m_minus.f <<= m_minus.e - m_plus.e;
+    m_minus.e = m_plus.e;
+    v = dtoa_normalize(v);
+
+    // Pick the cached power that brings the exponent into [alpha, gamma]
+    f = DTOA_ALPHA - m_plus.e - 1;
+    k = (f * 78913) / (1 << 18) + (f > 0);
+    cached = &dtoa_cached_powers[(-DTOA_CACHED_MIN_DEC_EXP + k + (DTOA_CACHED_DEC_STEP - 1)) / DTOA_CACHED_DEC_STEP];
+    c_minus_k.f = cached->f;
+    c_minus_k.e = cached->e;
+
+    w = dtoa_mul(v, c_minus_k);
+    w_minus = dtoa_mul(m_minus, c_minus_k);
+    w_plus = dtoa_mul(m_plus, c_minus_k);
+
+    // Shrink the interval by one unit each side to allow for the rounding of the products
+    w_minus.f++;
+    w_plus.f--;
+
+    *len = 0;
+    *decimal_exponent = -cached->k;
+    dtoa_digit_gen(digits, len, decimal_exponent, w_minus, w, w_plus);
+}
+
+
+/* @brief	Generate the fewest digits that fall between m_minus and m_plus
+ */
+static void dtoa_digit_gen(char *digits, int *len, int *decimal_exponent, DiyFp m_minus, DiyFp w, DiyFp m_plus)
+{
+    uint64_t delta = m_plus.f - m_minus.f;
+    uint64_t dist = m_plus.f - w.f;
+    int shift = -m_plus.e;
+    uint64_t one = (uint64_t) 1 << shift;
+    uint32_t p1 = (uint32_t) (m_plus.f >> shift);
+    uint64_t p2 = m_plus.f & (one - 1);
+    uint32_t pow10;
+    int n;
+    int m = 0;
+
+    // Digits of the integral part, p1 < 10^10
+    if (p1 >= 1000000000u) { pow10 = 1000000000u; n = 10; }
+    else if (p1 >= 100000000u) { pow10 = 100000000u; n = 9; }
+    else if (p1 >= 10000000u) { pow10 = 10000000u; n = 8; }
+    else if (p1 >= 1000000u) { pow10 = 1000000u; n = 7; }
+    else if (p1 >= 100000u) { pow10 = 100000u; n = 6; }
+    else if (p1 >= 10000u) { pow10 = 10000u; n = 5; }
+    else if (p1 >= 1000u) { pow10 = 1000u; n = 4; }
+    else if (p1 >= 100u) { pow10 = 100u; n = 3; }
+    else if (p1 >= 10u) { pow10 = 10u; n = 2; }
+    else { pow10 = 1u; n = 1; }
+
+    while (n > 0) {
+        uint64_t rest;
+
+        digits[(*len)++] = (char) ('0' + p1 / pow10);
+        p1 %= pow10;
+        n--;
+
+        rest = ((uint64_t) p1 << shift) + p2;
+        if (rest <= delta) {
+            *decimal_exponent += n;
+            dtoa_round(digits, *len, dist, delta, rest, (uint64_t) pow10 << shift);
+            return;
+        }
+        pow10 /= 10;
+    }
+
+    // Digits of the fractional part
+    for (;;) {
+        p2 *= 10;
+        digits[(*len)++] = (char) ('0' + (p2 >> shift));
+        p2 &= one - 1;
+        m++;
+
+        delta *= 10;
+        dist *= 10;
+        if (p2 <= delta) {
+            break;
+        }
+    }
+
+    *decimal_exponent -= m;
+    dtoa_round(digits, *len, dist, delta, p2, one);
+}
+
+
+/* @brief	Move the last digit towards w while it stays inside the interval
+ */
+static void dtoa_round(char *digits, int len, uint64_t dist, uint64_t delta, uint64_t rest, uint64_t ten_k)
+{
+    while (rest < dist && delta - rest >= ten_k && (rest + ten_k < dist || dist - rest > rest + ten_k - dist)) {
+        digits[len - 1]--;
+        rest += ten_k;
+    }
+}
+
+
+/* @brief	Shortest form of value, in fixed notation up to max_exp whole digits
+ */
+static size_t dtoa_shortest(char *buf, double value, int max_exp)
+{
+    char *p = buf;
+    int len = 0;
+    int decimal_exponent = 0;
+
+    if (signbit(value)) {
+        *p++ = '-';
+        value = -value;
+    }
+
+    if (value == 0) {
+        *p++ = '0';
+        *p = '\0';
+        return (size_t) (p - buf);
+    }
+
+    dtoa_grisu2(p, &len, &decimal_exponent, value);
+    return (size_t) (p - buf) + dtoa_format(p, len, decimal_exponent, max_exp);
+}
+
+
+/* @brief	Split the magnitude of value into its whole part and its fraction rounded to decimals
+ *
+ * Both parts of a double below 2^63 are exact, so only the scaled fraction is rounded, and
+ * its error is far too small to move it across a rounding boundary, unlike that of scaling
+ * the whole value.
+ */
+static void dtoa_split(double value, int decimals, double *whole, double *fraction)
+{
+    value = fabs(value);
+    *whole = trunc(value);
+    *fraction = round((value - *whole) * dtoa_pow10[decimals]);
+    if (*fraction >= dtoa_pow10[decimals]) {
+        *whole += 1;
+        *fraction = 0;
+    }
+}
+
+
+/* @brief	Place the point, or add an exponent, to digits * 10^decimal_exponent in buf
+ */
+static size_t dtoa_format(char *buf, int len, int decimal_exponent, int max_exp)
+{
+    int point = len + decimal_exponent;       // digits before the point
+    int exponent;
+    char *p;
+
+    if (len <= point && point <= max_exp) {
+        // ddd000
+        memset(&buf[len], '0', (size_t) (point - len));
+        buf[point] = '\0';
+        return (size_t) point;
+    }
+
+    if (0 < point && point <= max_exp) {
+        // dd.ddd
+        memmove(&buf[point + 1], &buf[point], (size_t) (len - point));
+        buf[point] = '.';
+        buf[len + 1] = '\0';
+        return (size_t) len + 1;
+    }
+
+    if (DTOA_MIN_EXP < point && point <= 0) {
+        // 0.000ddd
+        memmove(&buf[2 - point], buf, (size_t) len);
+        buf[0] = '0';
+        buf[1] = '.';
+        memset(&buf[2], '0', (size_t) -point);
+        buf[2 - point + len] = '\0';
+        return (size_t) (2 - point + len);
+    }
+
+    // d.ddde+XX
+    if (len == 1) {
+        p = &buf[1];
+    } else {
+        memmove(&buf[2], &buf[1], (size_t) len - 1);
+        buf[1] = '.';
+        p = &buf[len + 1];
+    }
+
+    exponent = point - 1;
+    *p++ = 'e';
+    if (exponent < 0) {
+        *p++ = '-';
+        exponent = -exponent;
+    } else {
+        *p++ = '+';
+    }
+    if (exponent >= 100) {
+        *p++ = (char) ('0' + exponent / 100);
+        exponent %= 100;
+    }
+    *p++ = (char) ('0' + exponent / 10);
+    *p++ = (char) ('0' + exponent % 10);
+    *p = '\0';
+
+    return (size_t) (p - buf);
+}
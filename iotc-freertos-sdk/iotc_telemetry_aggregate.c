@@ -0,0 +1,371 @@
+//
+// Copyright: Avnet 2024
+//
+// Folds high rate samples into windows per attribute and sends one summary record per
+// window through the telemetry batch, instead of every sample.  Windows are divided into
+// a fixed number of panes, each holding a count, min, max and a running mean and sum of
+// squared differences (Welford's method), so memory use does not depend on the sample
+// rate.  A sliding window's summary merges its panes with Chan's parallel formula.
+//
+
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "iotcl_log.h"
+#include "iotc_telemetry_encoder.h"
+#include "iotc_telemetry_batch.h"
+#include "iotc_telemetry_aggregate.h"
+
+#ifdef IOTC_ENABLE_BENCHMARKS
+#include "iotc_benchmark.h"
+#endif
+
+struct IotcTelemetryAggregate {
+    char name[IOTC_TELEMETRY_AGGREGATE_NAME_MAX_LEN + 1];
+    uint8_t panes;
+    uint8_t current;				// pane samples are folded into
+    uint8_t statistics;
+    TickType_t pane_ticks;
+    TickType_t pane_started_at;
+    IotcTelemetryWindowStats pane[IOTC_TELEMETRY_AGGREGATE_MAX_PANES];
+    IotcTelemetryAggregateStats stats;
+};
+
+static IotcTelemetryAggregate aggregates[IOTC_TELEMETRY_AGGREGATE_MAX_COUNT];
+static size_t aggregate_count = 0;
+
+static void aggregate_advance(IotcTelemetryAggregate *agg, TickType_t now);
+static bool aggregate_is_empty(const IotcTelemetryAggregate *agg);
+static void aggregate_emit(IotcTelemetryAggregate *agg);
+static void aggregate_set(IotcTelemetryEncoder *enc, const IotcTelemetryAggregate *agg, const char *suffix,
+        double value);
+
+
+/* @brief	Start aggregating the attribute named in rule
+ *
+ * The first window starts now.  Returns NULL if the rule is invalid, the name already has
+ * an aggregate or all IOTC_TELEMETRY_AGGREGATE_MAX_COUNT are in use.
+ */
+IotcTelemetryAggregate *iotc_telemetry_aggregate_add(const IotcTelemetryAggregateRule *rule)
+{
+    IotcTelemetryAggregate *agg;
+    uint8_t panes;
+
+    if (rule == NULL || rule->name == NULL || strlen(rule->name) > IOTC_TELEMETRY_AGGREGATE_NAME_MAX_LEN) {
+        IOTCL_ERROR(0, "Telemetry aggregate name missing or too long");
+        return NULL;
+    }
+
+    panes = (rule->panes == 0) ? 1 : rule->panes;
+    if (panes > IOTC_TELEMETRY_AGGREGATE_MAX_PANES || pdMS_TO_TICKS(rule->window_ms) / panes == 0) {
+        IOTCL_ERROR(0, "Telemetry aggregate %s: window too short or too many panes", rule->name);
+        return NULL;
+    }
+    if (iotc_telemetry_aggregate_find(rule->name) != NULL) {
+        IOTCL_ERROR(0, "Telemetry aggregate %s added twice", rule->name);
+        return NULL;
+    }
+    if (aggregate_count >= IOTC_TELEMETRY_AGGREGATE_MAX_COUNT) {
+        IOTCL_ERROR(0, "Too many telemetry aggregates, see IOTC_TELEMETRY_AGGREGATE_MAX_COUNT");
+        return NULL;
+    }
+
+    agg = &aggregates[aggregate_count++];
+    memset(agg, 0, sizeof(*agg));
+    strcpy(agg->name, rule->name);
+    agg->panes = panes;
+    agg->statistics = (rule->statistics == 0) ? IOTC_AGGREGATE_ALL : rule->statistics;
+    agg->pane_ticks = pdMS_TO_TICKS(rule->window_ms) / panes;
+    agg->pane_started_at = xTaskGetTickCount();
+
+    return agg;
+}
+
+
+/*
+ *
+ */
+IotcTelemetryAggregate *iotc_telemetry_aggregate_find(const char *name)
+{
+    for (size_t i = 0; i < aggregate_count; i++) {
+        if (strcmp(aggregates[i].name, name) == 0) {
+            return &aggregates[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+/* @brief	Fold a sample into the current window, first sending any window that has ended
+ */
+void iotc_telemetry_aggregate_sample(IotcTelemetryAggregate *agg, double value)
+{
+    if (agg == NULL || isnan(value)) {
+        return;
+    }
+
+    aggregate_advance(agg, xTaskGetTickCount());
+    iotc_telemetry_window_stats_fold(&agg->pane[agg->current], value);
+    agg->stats.samples++;
+}
+
+
+/* @brief	Send the summaries of windows that have ended
+ *
+ * Call this whenever the telemetry task wakes up, including on receive timeouts.
+ */
+void iotc_telemetry_aggregate_poll(void)
+{
+    TickType_t now = xTaskGetTickCount();
+
+    for (size_t i = 0; i < aggregate_count; i++) {
+        aggregate_advance(&aggregates[i], now);
+    }
+}
+
+
+/* @brief	Number of ticks before the next window ends
+ *
+ * Returns portMAX_DELAY when nothing is aggregated, so the result can be used directly
+ * as the receive timeout of the telemetry task.
+ */
+TickType_t iotc_telemetry_aggregate_ticks_until_emit(void)
+{
+    TickType_t now = xTaskGetTickCount();
+    TickType_t next = portMAX_DELAY;
+
+    for (size_t i = 0; i < aggregate_count; i++) {
+        TickType_t elapsed = now - aggregates[i].pane_started_at;
+        TickType_t remaining = (elapsed >= aggregates[i].pane_ticks) ? 0 : aggregates[i].pane_ticks - elapsed;
+
+        if (remaining < next) {
+            next = remaining;
+        }
+    }
+
+    return next;
+}
+
+
+/*
+ *
+ */
+void iotc_telemetry_aggregate_get_stats(const IotcTelemetryAggregate *agg, IotcTelemetryAggregateStats *stats)
+{
+    if (agg && stats) {
+        *stats = agg->stats;
+    }
+}
+
+
+/* @brief	Add a sample to stats, updating the mean and m2 with Welford's method
+ */
+void iotc_telemetry_window_stats_fold(IotcTelemetryWindowStats *stats, double value)
+{
+    double delta;
+
+    if (stats->count++ == 0) {
+        stats->mean = value;
+        stats->m2 = 0;
+        stats->min = value;
+        stats->max = value;
+        return;
+    }
+
+    delta = value - stats->mean;
+    stats->mean += delta / stats->count;
+    stats->m2 += delta * (value - stats->mean);
+    if (value < stats->min) {
+        stats->min = value;
+    }
+    if (value > stats->max) {
+        stats->max = value;
+    }
+}
+
+
+/* @brief	Combine the samples of from into into
+ */
+void iotc_telemetry_window_stats_merge(IotcTelemetryWindowStats *into, const IotcTelemetryWindowStats *from)
+{
+    uint32_t count;
+    double delta;
+
+    if (from->count == 0) {
+        return;
+    }
+    if (into->count == 0) {
+        *into = *from;
+        return;
+    }
+
+    count = into->count + from->count;
+    delta = from->mean - into->mean;
+    into->mean += delta * from->count / count;
+    into->m2 += from->m2 + delta * delta * ((double) into->count * from->count / count);
+    into->count = count;
+    if (from->min < into->min) {
+        into->min = from->min;
+    }
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+
+/*
+ *
+ */
+double iotc_telemetry_window_stats_stddev(const IotcTelemetryWindowStats *stats)
+{
+    return (stats->count > 1) ? sqrt(stats->m2 / (stats->count - 1)) : 0.0;
+}
+
+
+#ifdef IOTC_ENABLE_BENCHMARKS
+/* @brief	Log the cycles it takes to fold one sample, and to merge the panes of a window
+ */
+void iotc_telemetry_aggregate_benchmark(uint32_t iterations)
+{
+    IotcTelemetryWindowStats panes[IOTC_TELEMETRY_AGGREGATE_MAX_PANES];
+    IotcTelemetryWindowStats window;
+    volatile double sink;
+    uint32_t fold_cycles;
+    uint32_t merge_cycles;
+
+    iotc_benchmark_init();
+
+    if (iterations == 0) {
+        return;
+    }
+
+    memset(panes, 0, sizeof(panes));
+    fold_cycles = IOTC_BENCHMARK_CYCLES();
+    for (uint32_t i = 0; i < iterations; i++) {
+        iotc_telemetry_window_stats_fold(&panes[i % IOTC_TELEMETRY_AGGREGATE_MAX_PANES], 20.0 + (double) (i % 17) * 0.25);
+    }
+    fold_cycles = IOTC_BENCHMARK_CYCLES() - fold_cycles;
+
+    merge_cycles = IOTC_BENCHMARK_CYCLES();
+    for (uint32_t i = 0; i < iterations; i++) {
+        memset(&window, 0, sizeof(window));
+        for (size_t p = 0; p < IOTC_TELEMETRY_AGGREGATE_MAX_PANES; p++) {
+            iotc_telemetry_window_stats_merge(&window, &panes[p]);
+        }
+    }
+    merge_cycles = IOTC_BENCHMARK_CYCLES() - merge_cycles;
+    sink = window.mean;
+    (void) sink;
+
+    IOTCL_INFO("Aggregate benchmark: %lu cycles per sample, %lu cycles to merge %u panes",
+            (unsigned long) (fold_cycles / iterations), (unsigned long) (merge_cycles / iterations),
+            (unsigned) IOTC_TELEMETRY_AGGREGATE_MAX_PANES);
+}
+#endif // IOTC_ENABLE_BENCHMARKS
+
+
+/* @brief	Close every pane that has ended by now, sending a summary for each
+ */
+static void aggregate_advance(IotcTelemetryAggregate *agg, TickType_t now)
+{
+    TickType_t elapsed = now - agg->pane_started_at;
+
+    while (elapsed >= agg->pane_ticks) {
+        aggregate_emit(agg);
+
+        agg->pane_started_at += agg->pane_ticks;
+        elapsed -= agg->pane_ticks;
+        agg->current = (uint8_t) ((agg->current + 1) % agg->panes);
+        memset(&agg->pane[agg->current], 0, sizeof(agg->pane[0]));
+
+        // The windows still to close are all empty, e.g. after a long time without samples
+        if (elapsed >= agg->pane_ticks && aggregate_is_empty(agg)) {
+            agg->stats.windows_empty += elapsed / agg->pane_ticks;
+            agg->pane_started_at = now - elapsed % agg->pane_ticks;
+            break;
+        }
+    }
+}
+
+
+/*
+ *
+ */
+static bool aggregate_is_empty(const IotcTelemetryAggregate *agg)
+{
+    for (size_t i = 0; i < agg->panes; i++) {
+        if (agg->pane[i].count != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+/* @brief	Send a record summarising the panes of the window that just ended
+ */
+static void aggregate_emit(IotcTelemetryAggregate *agg)
+{
+    IotcTelemetryWindowStats window = { 0 };
+    IotcTelemetryEncoder *enc;
+    IotcBatchRecordStatus status;
+
+    for (size_t i = 0; i < agg->panes; i++) {
+        iotc_telemetry_window_stats_merge(&window, &agg->pane[i]);
+    }
+
+    if (window.count == 0) {
+        agg->stats.windows_empty++;
+        return;
+    }
+
+    // Encoded again into a fresh batch if it did not fit after the records already batched
+    do {
+        enc = iotc_telemetry_batch_add_record();
+        if (enc == NULL) {
+            agg->stats.send_failures++;
+            return;
+        }
+
+        if (agg->statistics & IOTC_AGGREGATE_COUNT) {
+            aggregate_set(enc, agg, "_count", (double) window.count);
+        }
+        if (agg->statistics & IOTC_AGGREGATE_MIN) {
+            aggregate_set(enc, agg, "_min", window.min);
+        }
+        if (agg->statistics & IOTC_AGGREGATE_MAX) {
+            aggregate_set(enc, agg, "_max", window.max);
+        }
+        if (agg->statistics & IOTC_AGGREGATE_MEAN) {
+            aggregate_set(enc, agg, "_mean", window.mean);
+        }
+        if (agg->statistics & IOTC_AGGREGATE_STDDEV) {
+            aggregate_set(enc, agg, "_stddev", iotc_telemetry_window_stats_stddev(&window));
+        }
+    } while ((status = iotc_telemetry_batch_commit_record()) == IOTC_BATCH_RECORD_RETRY);
+
+    if (status == IOTC_BATCH_RECORD_COMMITTED) {
+        agg->stats.windows_sent++;
+    } else {
+        agg->stats.send_failures++;
+    }
+}
+
+
+/*
+ *
+ */
+static void aggregate_set(IotcTelemetryEncoder *enc, const IotcTelemetryAggregate *agg, const char *suffix,
+        double value)
+{
+    char name[IOTC_TELEMETRY_AGGREGATE_NAME_MAX_LEN + sizeof("_stddev")];
+
+    snprintf(name, sizeof(name), "%s%s", agg->name, suffix);
+    iotc_telemetry_set_number(enc, name, value);
+}
@@ -0,0 +1,266 @@
+//
+// Copyright: Avnet 2024
+//
+// Coalesces telemetry records into a single IoTConnect message so that the MQTT, TLS
+// and broker cost is paid once per batch instead of once per sample.  A batch is sent
+// when it holds max_records records, when the next record would take it past
+// max_bytes, or when window_ms has passed since its first record was added.
+//
+// Records are encoded straight into an SDK publish buffer, which is handed to the
+// telemetry publish lane when the batch is sent, so a batch is never copied.
+//
+// A record that does not fit in a partly filled batch sends the batch, and the caller
+// encodes the record again into a fresh one.  Only a record that does not fit in an
+// empty batch is dropped.
+//
+// Each record is stamped with the time it was added.  With time_offsets the batch is
+// stamped when it is opened and each record carries only its offset from that.
+//
+
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "iotconnect.h"
+#include "iotconnect_config.h"
+#include "iotcl.h"
+#include "iotcl_log.h"
+#include "iotc_mqtt_client.h"
+#include "iotc_time.h"
+#include "iotc_telemetry_encoder.h"
+#include "iotc_telemetry_batch.h"
+#include "iotc_telemetry_journal.h"
+
+
+static IotcTelemetryBatchConfig batch_cfg = {
+    .max_records = IOTC_TELEMETRY_BATCH_MAX_RECORDS,
+    .max_bytes = IOTC_TELEMETRY_BATCH_MAX_BYTES,
+    .window_ms = IOTC_TELEMETRY_BATCH_WINDOW_MS,
+    .time_offsets = IOTC_TELEMETRY_BATCH_TIME_OFFSETS,
+};
+
+static IotcTelemetryBatchStats batch_stats = {
+    .bytes_per_record = IOTC_TELEMETRY_BATCH_RECORD_SIZE_ESTIMATE,
+};
+
+static IotcTelemetryEncoder batch_enc;
+static char *batch_buf = NULL;          // publish buffer of the open batch, NULL if none is open
+static uint16_t batch_records = 0;
+static TickType_t batch_opened_at = 0;
+static bool record_measured = false;    // bytes_per_record is still the estimate until set
+
+static void batch_send(IotcBatchFlushReason reason);
+
+
+/* @brief	Override the default batch limits
+ *
+ * Passing NULL keeps the compile time defaults.  Any record already batched is sent first.
+ */
+void iotc_telemetry_batch_init(const IotcTelemetryBatchConfig *cfg)
+{
+    iotc_telemetry_batch_flush();
+
+    if (cfg) {
+        batch_cfg = *cfg;
+    }
+    if (batch_cfg.max_records == 0) {
+        batch_cfg.max_records = 1;
+    }
+}
+
+
+/* @brief	Start a new record in the current batch
+ *
+ * Returns the encoder the caller adds values to with iotc_telemetry_set_*(). The record
+ * must be completed with iotc_telemetry_batch_commit_record().  Returns NULL if no publish
+ * buffer was available.
+ */
+IotcTelemetryEncoder *iotc_telemetry_batch_add_record(void)
+{
+    uint64_t now_ms;
+    size_t capacity;
+
+    if (batch_buf == NULL) {
+        batch_buf = iotc_device_client_mqtt_buffer_alloc_for_lane(IOTC_LANE_TELEMETRY,
+                pdMS_TO_TICKS(MQTT_PUBLISH_BUFFER_WAIT_MS), &capacity);
+        if (batch_buf == NULL) {
+            IOTCL_ERROR(0, "No buffer for telemetry message");
+            return NULL;
+        }
+        if (capacity > batch_cfg.max_bytes) {
+            capacity = batch_cfg.max_bytes;
+        }
+        iotc_telemetry_encoder_init_as(&batch_enc, batch_buf, capacity, iotconnect_sdk_get_payload_encoding());
+        if (batch_cfg.time_offsets && iotc_time_get_ms(&now_ms)) {
+            iotc_telemetry_encoder_set_base_time(&batch_enc, now_ms);
+        }
+        batch_opened_at = xTaskGetTickCount();
+    }
+
+    // Each record gets its own timestamp
+    iotc_telemetry_add_record(&batch_enc, NULL);
+
+    return &batch_enc;
+}
+
+
+/* @brief	Complete the record started by iotc_telemetry_batch_add_record() and send the batch if full
+ *
+ * Returns IOTC_BATCH_RECORD_RETRY if the record did not fit after the records already
+ * batched.  Those have been sent, and the caller must encode the record again, starting
+ * with iotc_telemetry_batch_add_record(), so that it goes into a fresh batch:
+ *
+ *     do {
+ *         enc = iotc_telemetry_batch_add_record();
+ *         ...
+ *     } while (iotc_telemetry_batch_commit_record() == IOTC_BATCH_RECORD_RETRY);
+ */
+IotcBatchRecordStatus iotc_telemetry_batch_commit_record(void)
+{
+    size_t record_len;
+
+    if (batch_buf == NULL || !batch_enc.record_open) {
+        return IOTC_BATCH_RECORD_DROPPED;
+    }
+
+    if (batch_enc.overflow) {
+        // The record needed more than the space left, so size based flushing should leave more
+        record_len = batch_enc.size - batch_enc.record_start;
+        if (record_len > batch_stats.bytes_per_record || !record_measured) {
+            batch_stats.bytes_per_record = record_len;
+            record_measured = true;
+        }
+
+        iotc_telemetry_discard_record(&batch_enc);
+        if (batch_records > 0) {
+            batch_send(IOTC_BATCH_FLUSH_SIZE);
+            return IOTC_BATCH_RECORD_RETRY;
+        }
+
+        IOTCL_ERROR(0, "Telemetry record too large for a message");
+        batch_stats.records_dropped++;
+        return IOTC_BATCH_RECORD_DROPPED;
+    }
+
+    record_len = batch_enc.len - batch_enc.record_start;
+    if (record_len > batch_stats.bytes_per_record || !record_measured) {
+        batch_stats.bytes_per_record = record_len;
+        record_measured = true;
+    }
+
+    batch_records++;
+
+    if (batch_records >= batch_cfg.max_records) {
+        batch_send(IOTC_BATCH_FLUSH_COUNT);
+    } else if (iotc_telemetry_encoder_space(&batch_enc) < batch_stats.bytes_per_record) {
+        batch_send(IOTC_BATCH_FLUSH_SIZE);
+    }
+
+    return IOTC_BATCH_RECORD_COMMITTED;
+}
+
+
+/* @brief	Send any batched records now
+ */
+void iotc_telemetry_batch_flush(void)
+{
+    batch_send(IOTC_BATCH_FLUSH_MANUAL);
+}
+
+
+/* @brief	Send the batch if its time window has expired
+ *
+ * Call this whenever the telemetry task wakes up, including on receive timeouts.
+ */
+void iotc_telemetry_batch_poll(void)
+{
+    if (batch_records > 0 && iotc_telemetry_batch_ticks_until_flush() == 0) {
+        batch_send(IOTC_BATCH_FLUSH_TIME);
+    }
+}
+
+
+/* @brief	Number of ticks before the open batch must be sent
+ *
+ * Returns portMAX_DELAY when there is nothing batched, so the result can be used
+ * directly as the receive timeout of the telemetry task.
+ */
+TickType_t iotc_telemetry_batch_ticks_until_flush(void)
+{
+    TickType_t elapsed;
+    TickType_t window = pdMS_TO_TICKS(batch_cfg.window_ms);
+
+    if (batch_records == 0) {
+        return portMAX_DELAY;
+    }
+
+    elapsed = xTaskGetTickCount() - batch_opened_at;
+    return (elapsed >= window) ? 0 : window - elapsed;
+}
+
+
+/*
+ *
+ */
+void iotc_telemetry_batch_get_stats(IotcTelemetryBatchStats *stats)
+{
+    if (stats) {
+        *stats = batch_stats;
+    }
+}
+
+
+/* @brief	Publish the open batch, then update statistics
+ */
+static void batch_send(IotcBatchFlushReason reason)
+{
+    char *buf = batch_buf;
+    uint16_t records = batch_records;
+    const IotcTopic *topic;
+    size_t len;
+
+    if (buf == NULL) {
+        return;
+    }
+
+    batch_buf = NULL;
+    batch_records = 0;
+
+    if (records == 0 || iotc_telemetry_encoder_finish(&batch_enc, &len) == NULL) {
+        iotc_device_client_mqtt_buffer_free(buf);
+        return;
+    }
+
+#ifdef IOTCONFIG_ENABLE_TELEMETRY_JOURNAL
+    // Offline, or still draining older telemetry: store it to be sent in order later
+    if (iotc_telemetry_journal_capture(buf, len)) {
+        iotc_device_client_mqtt_buffer_free(buf);
+        batch_stats.batches_journaled++;
+    } else
+#endif
+    {
+        if ((topic = iotc_topic_get(IOTC_TOPIC_RPT)) == NULL) {
+            iotc_device_client_mqtt_buffer_free(buf);
+            batch_stats.batches_failed++;
+        } else if (iotc_publish_lane_enqueue(topic->lane, topic->name, topic->len, buf, len, topic->qos,
+                pdMS_TO_TICKS(MQTT_PUBLISH_WINDOW_WAIT_MS)) != MQTTSuccess) {
+            // The lane releases the buffer
+            batch_stats.batches_failed++;
+        } else {
+            batch_stats.batches_sent++;
+            batch_stats.records_sent += records;
+        }
+    }
+
+    batch_stats.flushes[reason]++;
+    if (batch_stats.min_batch_records == 0 || records < batch_stats.min_batch_records) {
+        batch_stats.min_batch_records = records;
+    }
+    if (records > batch_stats.max_batch_records) {
+        batch_stats.max_batch_records = records;
+    }
+    if (len > batch_stats.max_batch_bytes) {
+        batch_stats.max_batch_bytes = len;
+    }
+}
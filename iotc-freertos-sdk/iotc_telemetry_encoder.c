@@ -0,0 +1,660 @@
+//
+// Copyright: Avnet 2024
+//
+// Writes IoTConnect telemetry messages straight into a caller supplied buffer, e.g. an
+// SDK publish buffer, without building a cJSON tree or allocating memory.  The output has
+// the same structure as iotcl_telemetry_create_serialized_string() produces for the same calls:
+//
+//     {"d":[{"dt":"2024-01-01T00:00:00.000Z","d":{"name":value,...}},...]}
+//
+// Numbers are formatted by iotc_dtoa rather than printf, as the shortest decimal that reads
+// back as the same value, or rounded to a number of decimals with the _fixed setters.
+//
+// With IOTC_ENCODING_CBOR the same structure is written as CBOR, using indefinite length
+// maps and arrays so that nothing has to be counted in advance.  CBOR messages are not
+// NUL terminated; use the length iotc_telemetry_encoder_finish() returns.
+//
+// Room for closing the open record and the message is always kept free, so a message
+// can be finished even when a value did not fit.  Names are written as given; unlike
+// iotc-c-lib, a '.' in a name does not create a nested object.
+//
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <float.h>
+#include <math.h>
+
+#include "iotcl_log.h"
+#include "iotcl_util.h"
+#include "iotc_dtoa.h"
+#include "iotc_time.h"
+#include "iotc_telemetry_encoder.h"
+
+#ifdef IOTC_ENABLE_BENCHMARKS
+#include "iotc_benchmark.h"
+#include "iotcl_telemetry.h"
+#endif
+
+#define ENCODER_MESSAGE_START   "{\"d\":["
+// Closing the open record and the message, and the terminator
+#define ENCODER_CLOSE_RESERVE   (sizeof("}}]}"))
+
+// {"d":[ and {"dt": and {"d":{ as CBOR
+static const uint8_t cbor_message_start[] = { IOTC_CBOR_MAP_INDEFINITE, 0x61, 'd', IOTC_CBOR_ARRAY_INDEFINITE };
+static const uint8_t cbor_record_dt[] = { IOTC_CBOR_MAP_INDEFINITE, 0x62, 'd', 't' };
+static const uint8_t cbor_record_dto[] = { IOTC_CBOR_MAP_INDEFINITE, 0x63, 'd', 't', 'o' };
+static const uint8_t cbor_message_d[] = { 0x61, 'd', IOTC_CBOR_ARRAY_INDEFINITE };
+static const uint8_t cbor_record_d[] = { 0x61, 'd', IOTC_CBOR_MAP_INDEFINITE };
+static const uint8_t cbor_close[] = { IOTC_CBOR_BREAK, IOTC_CBOR_BREAK };
+
+#define ENC_IS_CBOR(enc)        ((enc)->encoding == IOTC_ENCODING_CBOR)
+
+static bool enc_put(IotcTelemetryEncoder *enc, const char *str, size_t len);
+static bool enc_put_string(IotcTelemetryEncoder *enc, const char *str);
+static bool enc_put_cbor_text(IotcTelemetryEncoder *enc, const char *str, size_t len);
+static bool enc_put_literal(IotcTelemetryEncoder *enc, uint8_t cbor, const char *json, size_t json_len);
+static bool enc_put_name(IotcTelemetryEncoder *enc, const char *name);
+static bool enc_put_key(IotcTelemetryEncoder *enc, const char *key, size_t key_len);
+static bool enc_put_number(IotcTelemetryEncoder *enc, double value, int decimals);
+static int enc_open_record(IotcTelemetryEncoder *enc, const char *iso_time, const int64_t *offset_ms);
+static void enc_close_record(IotcTelemetryEncoder *enc);
+static size_t enc_format_number(char *buf, double value, int decimals);
+
+
+/* @brief	Start a JSON telemetry message in buf
+ *
+ * @param	size, bytes available in buf including the terminator
+ *
+ * Returns -1 if buf is too small to hold even an empty message.
+ */
+int iotc_telemetry_encoder_init(IotcTelemetryEncoder *enc, char *buf, size_t size)
+{
+    return iotc_telemetry_encoder_init_as(enc, buf, size, IOTC_ENCODING_JSON);
+}
+
+
+/* @brief	Start a telemetry message in buf in the given encoding
+ *
+ * IOTC_ENCODING_DEFAULT selects IOTC_PAYLOAD_ENCODING.
+ */
+int iotc_telemetry_encoder_init_as(IotcTelemetryEncoder *enc, char *buf, size_t size, IotcPayloadEncoding encoding)
+{
+    bool ok;
+
+    memset(enc, 0, sizeof(*enc));
+    enc->buf = buf;
+    enc->size = size;
+    enc->encoding = (encoding == IOTC_ENCODING_DEFAULT) ? IOTC_PAYLOAD_ENCODING : encoding;
+
+    if (ENC_IS_CBOR(enc)) {
+        ok = enc_put(enc, (const char *) cbor_message_start, sizeof(cbor_message_start));
+    } else {
+        ok = enc_put(enc, ENCODER_MESSAGE_START, sizeof(ENCODER_MESSAGE_START) - 1);
+    }
+
+    return ok ? 0 : -1;
+}
+
+
+/* @brief	Give the message a timestamp, and the records offsets from it
+ *
+ * The message becomes {"dt":"2024-01-01T00:00:00.000Z","d":[{"dto":120,"d":{...}},...]},
+ * where "dto" is the record's time in milliseconds after "dt", in place of a 24 character
+ * timestamp per record.  The backend must expand "dto" for this to be used.
+ *
+ * Must be called before the first record.  Returns -1 if records were already added.
+ */
+int iotc_telemetry_encoder_set_base_time(IotcTelemetryEncoder *enc, uint64_t unix_ms)
+{
+    char iso_time[IOTC_ISO_TIMESTAMP_BUFFER_LEN];
+
+    if (enc->records != 0) {
+        return -1;
+    }
+
+    iotc_time_format_iso(iso_time, unix_ms);
+    enc->len = 0;
+    enc->overflow = false;
+    enc->base_ms = unix_ms;
+    enc->time_offsets = true;
+
+    if (ENC_IS_CBOR(enc)) {
+        enc_put(enc, (const char *) cbor_record_dt, sizeof(cbor_record_dt));
+        enc_put_string(enc, iso_time);
+        enc_put(enc, (const char *) cbor_message_d, sizeof(cbor_message_d));
+    } else {
+        enc_put(enc, "{\"dt\":", 6);
+        enc_put_string(enc, iso_time);
+        enc_put(enc, ",\"d\":[", 6);
+    }
+
+    return enc->overflow ? -1 : 0;
+}
+
+
+/* @brief	Start a new record, like iotcl_telemetry_add_with_iso_time()
+ *
+ * @param	iso_time, timestamp of the record. NULL uses the current time, or leaves the
+ *			timestamp out if the time has not been synchronised yet.
+ *
+ * The first iotc_telemetry_set_*() call starts a record if none has been started.
+ * Returns -1 if the record did not fit.
+ */
+int iotc_telemetry_add_record(IotcTelemetryEncoder *enc, const char *iso_time)
+{
+    uint64_t unix_ms;
+
+    if (iso_time == NULL && iotc_time_get_ms(&unix_ms)) {
+        return iotc_telemetry_add_record_at(enc, unix_ms);
+    }
+
+    return enc_open_record(enc, iso_time, NULL);
+}
+
+
+/* @brief	Start a new record at a time in milliseconds since the Unix epoch
+ *
+ * Writes an offset from the message timestamp if one was set, otherwise a timestamp.
+ */
+int iotc_telemetry_add_record_at(IotcTelemetryEncoder *enc, uint64_t unix_ms)
+{
+    char iso_time[IOTC_ISO_TIMESTAMP_BUFFER_LEN];
+    int64_t offset_ms;
+
+    if (enc->time_offsets) {
+        offset_ms = (int64_t) (unix_ms - enc->base_ms);
+        return enc_open_record(enc, NULL, &offset_ms);
+    }
+
+    iotc_time_format_iso(iso_time, unix_ms);
+    return enc_open_record(enc, iso_time, NULL);
+}
+
+
+/*
+ *
+ */
+int iotc_telemetry_set_number(IotcTelemetryEncoder *enc, const char *name, double value)
+{
+    return (enc_put_name(enc, name) && enc_put_number(enc, value, -1)) ? 0 : -1;
+}
+
+
+/* @brief	Add a number rounded to at most decimals digits after the point, e.g. to leave
+ * out the noise of a sensor reading
+ */
+int iotc_telemetry_set_number_fixed(IotcTelemetryEncoder *enc, const char *name, double value, int decimals)
+{
+    return (enc_put_name(enc, name) && enc_put_number(enc, value, decimals)) ? 0 : -1;
+}
+
+
+/*
+ *
+ */
+int iotc_telemetry_set_bool(IotcTelemetryEncoder *enc, const char *name, bool value)
+{
+    bool ok = enc_put_name(enc, name) && (value ? enc_put_literal(enc, IOTC_CBOR_TRUE, "true", 4)
+            : enc_put_literal(enc, IOTC_CBOR_FALSE, "false", 5));
+
+    return ok ? 0 : -1;
+}
+
+
+/* @brief	Add a string value. A NULL value is written as null.
+ */
+int iotc_telemetry_set_string(IotcTelemetryEncoder *enc, const char *name, const char *value)
+{
+    if (value == NULL) {
+        return iotc_telemetry_set_null(enc, name);
+    }
+
+    return (enc_put_name(enc, name) && enc_put_string(enc, value)) ? 0 : -1;
+}
+
+
+/*
+ *
+ */
+int iotc_telemetry_set_null(IotcTelemetryEncoder *enc, const char *name)
+{
+    return (enc_put_name(enc, name) && enc_put_literal(enc, IOTC_CBOR_NULL, "null", 4)) ? 0 : -1;
+}
+
+
+/* @brief	Remove the open record, e.g. because one of its values did not fit
+ *
+ * Clears the overflow so that the records before it can still be sent.
+ */
+void iotc_telemetry_discard_record(IotcTelemetryEncoder *enc)
+{
+    if (!enc->record_open) {
+        return;
+    }
+
+    enc->len = enc->record_start;
+    enc->record_open = false;
+    enc->overflow = false;
+    enc->records--;
+}
+
+
+/* @brief	Complete the message
+ *
+ * @param	len, optional, set to the length of the message without the terminator
+ *
+ * Returns the NUL terminated message in the encoder's buffer, or NULL if a value did not
+ * fit and the open record was not discarded.  Nothing may be added afterwards.
+ */
+const char *iotc_telemetry_encoder_finish(IotcTelemetryEncoder *enc, size_t *len)
+{
+    if (enc->overflow) {
+        return NULL;
+    }
+
+    enc_close_record(enc);
+
+    // The reserve guarantees room for this
+    if (ENC_IS_CBOR(enc)) {
+        memcpy(&enc->buf[enc->len], cbor_close, sizeof(cbor_close));
+        enc->len += sizeof(cbor_close);
+    } else {
+        memcpy(&enc->buf[enc->len], "]}", 3);
+        enc->len += 2;
+    }
+
+    if (len) {
+        *len = enc->len;
+    }
+
+    return enc->buf;
+}
+
+
+/*
+ *
+ */
+int iotc_telemetry_set_number_key(IotcTelemetryEncoder *enc, const char *key, size_t key_len, double value)
+{
+    return (enc_put_key(enc, key, key_len) && enc_put_number(enc, value, -1)) ? 0 : -1;
+}
+
+
+/*
+ *
+ */
+int iotc_telemetry_set_number_fixed_key(IotcTelemetryEncoder *enc, const char *key, size_t key_len, double value,
+        int decimals)
+{
+    return (enc_put_key(enc, key, key_len) && enc_put_number(enc, value, decimals)) ? 0 : -1;
+}
+
+
+/* @brief	Add a whole number without going through floating point formatting
+ */
+int iotc_telemetry_set_int_key(IotcTelemetryEncoder *enc, const char *key, size_t key_len, int32_t value)
+{
+    char digits[IOTC_DTOA_BUFFER_LEN];
+
+    if (ENC_IS_CBOR(enc)) {
+        return iotc_telemetry_set_number_key(enc, key, key_len, (double) value);
+    }
+
+    return (enc_put_key(enc, key, key_len) && enc_put(enc, digits, iotc_dtoa_int(digits, value))) ? 0 : -1;
+}
+
+
+/*
+ *
+ */
+int iotc_telemetry_set_bool_key(IotcTelemetryEncoder *enc, const char *key, size_t key_len, bool value)
+{
+    bool ok = enc_put_key(enc, key, key_len) && (value ? enc_put_literal(enc, IOTC_CBOR_TRUE, "true", 4)
+            : enc_put_literal(enc, IOTC_CBOR_FALSE, "false", 5));
+
+    return ok ? 0 : -1;
+}
+
+
+/* @brief	Add a string value. A NULL value is written as null.
+ */
+int iotc_telemetry_set_string_key(IotcTelemetryEncoder *enc, const char *key, size_t key_len, const char *value)
+{
+    if (!enc_put_key(enc, key, key_len)) {
+        return -1;
+    }
+
+    return (value ? enc_put_string(enc, value) : enc_put_literal(enc, IOTC_CBOR_NULL, "null", 4)) ? 0 : -1;
+}
+
+
+/* @brief	Bytes that can still be added before the message is full
+ */
+size_t iotc_telemetry_encoder_space(const IotcTelemetryEncoder *enc)
+{
+    size_t used = enc->len + ENCODER_CLOSE_RESERVE;
+
+    return (enc->overflow || used >= enc->size) ? 0 : enc->size - used;
+}
+
+
+#ifdef IOTC_ENABLE_BENCHMARKS
+static void benchmark_encoder(uint32_t iterations, IotcPayloadEncoding encoding, const char *label);
+
+/* @brief	Compare size, heap allocations and cycles per message with the iotc-c-lib telemetry path
+ *
+ * All encode the record the example application sends, with iotc-c-lib and with this
+ * encoder as JSON and as CBOR.  The results are logged.
+ */
+void iotc_telemetry_encoder_benchmark(uint32_t iterations)
+{
+    HeapStats_t heap_before;
+    HeapStats_t heap_after;
+    uint32_t cycles;
+    size_t allocs;
+    size_t len = 0;
+
+    iotc_benchmark_init();
+
+    if (iterations == 0) {
+        return;
+    }
+
+    vPortGetHeapStats(&heap_before);
+    cycles = IOTC_BENCHMARK_CYCLES();
+    for (uint32_t i = 0; i < iterations; i++) {
+        IotclMessageHandle msg = iotcl_telemetry_create();
+        char *json_str;
+
+        iotcl_telemetry_set_number(msg, "double_value", 23.75);
+        iotcl_telemetry_set_bool(msg, "bool_value", true);
+        iotcl_telemetry_set_string(msg, "string_value", "Hello");
+        iotcl_telemetry_set_string(msg, "version", "1.0.0");
+        json_str = iotcl_telemetry_create_serialized_string(msg, false);
+        len = json_str ? strlen(json_str) : 0;
+        iotcl_telemetry_destroy_serialized(json_str);
+        iotcl_telemetry_destroy(msg);
+    }
+    cycles = IOTC_BENCHMARK_CYCLES() - cycles;
+    vPortGetHeapStats(&heap_after);
+    allocs = heap_after.xNumberOfSuccessfulAllocations - heap_before.xNumberOfSuccessfulAllocations;
+
+    IOTCL_INFO("Telemetry benchmark, iotcl_telemetry: %lu bytes, %lu cycles, %lu allocations per message",
+            (unsigned long) len, (unsigned long) (cycles / iterations), (unsigned long) (allocs / iterations));
+
+    benchmark_encoder(iterations, IOTC_ENCODING_JSON, "JSON");
+    benchmark_encoder(iterations, IOTC_ENCODING_CBOR, "CBOR");
+}
+
+
+/*
+ *
+ */
+static void benchmark_encoder(uint32_t iterations, IotcPayloadEncoding encoding, const char *label)
+{
+    static char buf[512];
+    HeapStats_t heap_before;
+    HeapStats_t heap_after;
+    uint32_t cycles;
+    size_t allocs;
+    size_t len = 0;
+
+    vPortGetHeapStats(&heap_before);
+    cycles = IOTC_BENCHMARK_CYCLES();
+    for (uint32_t i = 0; i < iterations; i++) {
+        IotcTelemetryEncoder enc;
+
+        iotc_telemetry_encoder_init_as(&enc, buf, sizeof(buf), encoding);
+        iotc_telemetry_set_number(&enc, "double_value", 23.75);
+        iotc_telemetry_set_bool(&enc, "bool_value", true);
+        iotc_telemetry_set_string(&enc, "string_value", "Hello");
+        iotc_telemetry_set_string(&enc, "version", "1.0.0");
+        (void) iotc_telemetry_encoder_finish(&enc, &len);
+    }
+    cycles = IOTC_BENCHMARK_CYCLES() - cycles;
+    vPortGetHeapStats(&heap_after);
+    allocs = heap_after.xNumberOfSuccessfulAllocations - heap_before.xNumberOfSuccessfulAllocations;
+
+    IOTCL_INFO("Telemetry benchmark, iotc_telemetry_encoder %s: %lu bytes, %lu cycles, %lu allocations per message",
+            label, (unsigned long) len, (unsigned long) (cycles / iterations), (unsigned long) (allocs / iterations));
+}
+#endif // IOTC_ENABLE_BENCHMARKS
+
+
+/*
+ *
+ */
+static bool enc_put(IotcTelemetryEncoder *enc, const char *str, size_t len)
+{
+    if (enc->overflow || enc->len + len + ENCODER_CLOSE_RESERVE > enc->size) {
+        enc->overflow = true;
+        return false;
+    }
+
+    memcpy(&enc->buf[enc->len], str, len);
+    enc->len += len;
+    return true;
+}
+
+
+/* @brief	Write a quoted string, escaped the way cJSON does
+ */
+static bool enc_put_string(IotcTelemetryEncoder *enc, const char *str)
+{
+    const char *run = str;
+
+    if (ENC_IS_CBOR(enc)) {
+        return enc_put_cbor_text(enc, str, strlen(str));
+    }
+
+    if (!enc_put(enc, "\"", 1)) {
+        return false;
+    }
+
+    for (const char *p = str; ; p++) {
+        unsigned char c = (unsigned char) *p;
+        char escape[7];
+        size_t escape_len = 2;
+
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+
+        // Copy the characters that need no escaping in one go
+        if (p > run && !enc_put(enc, run, (size_t) (p - run))) {
+            return false;
+        }
+        run = p + 1;
+
+        if (c == '\0') {
+            break;
+        }
+
+        escape[0] = '\\';
+        switch (c) {
+        case '"':  escape[1] = '"'; break;
+        case '\\': escape[1] = '\\'; break;
+        case '\b': escape[1] = 'b'; break;
+        case '\f': escape[1] = 'f'; break;
+        case '\n': escape[1] = 'n'; break;
+        case '\r': escape[1] = 'r'; break;
+        case '\t': escape[1] = 't'; break;
+        default:
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            escape_len = 6;
+            break;
+        }
+        if (!enc_put(enc, escape, escape_len)) {
+            return false;
+        }
+    }
+
+    return enc_put(enc, "\"", 1);
+}
+
+
+/*
+ *
+ */
+static bool enc_put_cbor_text(IotcTelemetryEncoder *enc, const char *str, size_t len)
+{
+    uint8_t head[IOTC_CBOR_HEAD_MAX_LEN];
+
+    return enc_put(enc, (const char *) head, iotc_cbor_head(head, IOTC_CBOR_MAJOR_TEXT, len))
+            && enc_put(enc, str, len);
+}
+
+
+/* @brief	Write true, false or null
+ */
+static bool enc_put_literal(IotcTelemetryEncoder *enc, uint8_t cbor, const char *json, size_t json_len)
+{
+    if (ENC_IS_CBOR(enc)) {
+        return enc_put(enc, (const char *) &cbor, 1);
+    }
+
+    return enc_put(enc, json, json_len);
+}
+
+
+/* @brief	Write the separator and name of a value, starting a record if none is open
+ */
+static bool enc_put_name(IotcTelemetryEncoder *enc, const char *name)
+{
+    return enc_put_key(enc, NULL, 0) && enc_put_string(enc, name) && (ENC_IS_CBOR(enc) || enc_put(enc, ":", 1));
+}
+
+
+/* @brief	Write the separator and a pre-formatted key, starting a record if none is open
+ *
+ * With a NULL key only the separator is written.  CBOR has no separators, and the quotes
+ * and colon of the key are left out.
+ */
+static bool enc_put_key(IotcTelemetryEncoder *enc, const char *key, size_t key_len)
+{
+    if (!enc->record_open) {
+        iotc_telemetry_add_record(enc, NULL);
+    }
+
+    if (ENC_IS_CBOR(enc)) {
+        enc->first_value = false;
+        return key == NULL || enc_put_cbor_text(enc, key + 1, key_len - 3);
+    }
+
+    if (!enc->first_value && !enc_put(enc, ",", 1)) {
+        return false;
+    }
+    enc->first_value = false;
+
+    return key == NULL || enc_put(enc, key, key_len);
+}
+
+
+/* @brief	Write a number, rounded to decimals unless decimals is negative
+ */
+static bool enc_put_number(IotcTelemetryEncoder *enc, double value, int decimals)
+{
+    char number[IOTC_DTOA_BUFFER_LEN];
+    size_t len;
+
+    if (ENC_IS_CBOR(enc)) {
+        if (decimals >= 0) {
+            // The same value the JSON text carries
+            value = iotc_dtoa_round(value, decimals);
+        }
+        len = iotc_cbor_number((uint8_t *) number, value);
+    } else {
+        len = enc_format_number(number, value, decimals);
+    }
+
+    return enc_put(enc, number, len);
+}
+
+
+/* @brief	Write the start of a record, with a timestamp, an offset or neither
+ */
+static int enc_open_record(IotcTelemetryEncoder *enc, const char *iso_time, const int64_t *offset_ms)
+{
+    char offset[IOTC_DTOA_BUFFER_LEN];
+
+    enc_close_record(enc);
+
+    enc->record_start = enc->len;
+    enc->record_open = true;
+    enc->first_value = true;
+    enc->records++;
+
+    if (ENC_IS_CBOR(enc)) {
+        if (offset_ms) {
+            enc_put(enc, (const char *) cbor_record_dto, sizeof(cbor_record_dto));
+            enc_put(enc, offset, iotc_cbor_number((uint8_t *) offset, (double) *offset_ms));
+            enc_put(enc, (const char *) cbor_record_d, sizeof(cbor_record_d));
+        } else if (iso_time) {
+            enc_put(enc, (const char *) cbor_record_dt, sizeof(cbor_record_dt));
+            enc_put_string(enc, iso_time);
+            enc_put(enc, (const char *) cbor_record_d, sizeof(cbor_record_d));
+        } else {
+            enc_put(enc, (const char *) cbor_record_dt, 1);
+            enc_put(enc, (const char *) cbor_record_d, sizeof(cbor_record_d));
+        }
+        return enc->overflow ? -1 : 0;
+    }
+
+    if (enc->records > 1) {
+        enc_put(enc, ",", 1);
+    }
+
+    if (offset_ms) {
+        enc_put(enc, "{\"dto\":", 7);
+        enc_put(enc, offset, iotc_dtoa_int(offset, *offset_ms));
+        enc_put(enc, ",\"d\":{", 6);
+    } else if (iso_time) {
+        enc_put(enc, "{\"dt\":", 6);
+        enc_put_string(enc, iso_time);
+        enc_put(enc, ",\"d\":{", 6);
+    } else {
+        enc_put(enc, "{\"d\":{", 6);
+    }
+
+    return enc->overflow ? -1 : 0;
+}
+
+
+/* @brief	Close the open record. Uses the reserved space, so it cannot fail.
+ */
+static void enc_close_record(IotcTelemetryEncoder *enc)
+{
+    if (!enc->record_open || enc->overflow) {
+        return;
+    }
+
+    if (ENC_IS_CBOR(enc)) {
+        memcpy(&enc->buf[enc->len], cbor_close, sizeof(cbor_close));
+    } else {
+        memcpy(&enc->buf[enc->len], "}}", 2);
+    }
+    enc->len += 2;
+    enc->record_open = false;
+}
+
+
+/* @brief	Format a number into buf, which has IOTC_DTOA_BUFFER_LEN bytes
+ *
+ * Whole numbers in int range are printed as integers, as cJSON does.  NaN and infinity
+ * are printed as null.
+ */
+static size_t enc_format_number(char *buf, double value, int decimals)
+{
+    if (isnan(value) || isinf(value)) {
+        memcpy(buf, "null", 5);
+        return 4;
+    } else if (value >= INT_MIN && value <= INT_MAX && value == (double) (int) value) {
+        return iotc_dtoa_int(buf, (int) value);
+    } else if (decimals >= 0) {
+        return iotc_dtoa_fixed(buf, value, decimals);
+    }
+
+    return iotc_dtoa_shortest(buf, value);
+}
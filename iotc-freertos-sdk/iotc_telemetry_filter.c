@@ -0,0 +1,323 @@
+//
+// Copyright: Avnet 2024
+//
+// Per-attribute telemetry filters, applied to samples before they are encoded so that
+// values that have not changed enough are never serialized or sent.  Each filter keeps
+// only the last reported value and when it was reported, so memory use is fixed.  Strings
+// are compared by length and FNV-1a hash rather than kept.
+//
+// Deciding and committing are separate steps, so a sample that passed the filter but was
+// then lost, e.g. because it did not fit in a message, does not hold back the next one.
+//
+
+#include <string.h>
+#include <math.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "iotcl_log.h"
+#include "iotc_telemetry_filter.h"
+
+struct IotcTelemetryFilter {
+    IotcTelemetryFilterRule rule;
+    TickType_t min_interval;
+    TickType_t max_interval;
+    TickType_t last_sent_at;
+    union {
+        double number;
+        bool boolean;
+        struct {
+            uint32_t hash;
+            size_t len;
+            bool is_null;
+        } string;
+    } last;
+    bool has_last;					// a sample has been reported since the filter was added or reset
+    IotcTelemetryFilterStats stats;
+};
+
+static IotcTelemetryFilter filters[IOTC_TELEMETRY_FILTER_MAX_COUNT];
+static size_t filter_count = 0;
+static IotcTelemetryFilterStats filter_totals;
+
+static bool filter_interval_allows(const IotcTelemetryFilter *filter, bool changed);
+static bool filter_result(IotcTelemetryFilter *filter, bool send);
+static void filter_mark_sent(IotcTelemetryFilter *filter);
+static uint32_t string_hash(const char *value, size_t *len);
+
+
+/* @brief	Add a filter for the attribute named in rule
+ *
+ * Returns NULL if the name already has a filter or all IOTC_TELEMETRY_FILTER_MAX_COUNT are in use.
+ */
+IotcTelemetryFilter *iotc_telemetry_filter_add(const IotcTelemetryFilterRule *rule)
+{
+    IotcTelemetryFilter *filter;
+
+    if (rule == NULL || rule->name == NULL) {
+        IOTCL_ERROR(0, "Telemetry filter rule has no name");
+        return NULL;
+    }
+    if (iotc_telemetry_filter_find(rule->name) != NULL) {
+        IOTCL_ERROR(0, "Telemetry filter %s added twice", rule->name);
+        return NULL;
+    }
+    if (filter_count >= IOTC_TELEMETRY_FILTER_MAX_COUNT) {
+        IOTCL_ERROR(0, "Too many telemetry filters, see IOTC_TELEMETRY_FILTER_MAX_COUNT");
+        return NULL;
+    }
+
+    filter = &filters[filter_count++];
+    memset(filter, 0, sizeof(*filter));
+    filter->rule = *rule;
+    filter->min_interval = pdMS_TO_TICKS(rule->min_interval_ms);
+    filter->max_interval = pdMS_TO_TICKS(rule->max_interval_ms);
+
+    return filter;
+}
+
+
+/* @brief	Find the filter of an attribute
+ *
+ * Look filters up once and keep the result; the search compares names.
+ * Returns NULL if the attribute has no filter.
+ */
+IotcTelemetryFilter *iotc_telemetry_filter_find(const char *name)
+{
+    for (size_t i = 0; i < filter_count; i++) {
+        if (strcmp(filters[i].rule.name, name) == 0) {
+            return &filters[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+/* @brief	Forget the last reported value, so the next sample is reported
+ *
+ * Call after a reconnect if the cloud should see the current values again.
+ */
+void iotc_telemetry_filter_reset(IotcTelemetryFilter *filter)
+{
+    if (filter) {
+        filter->has_last = false;
+    }
+}
+
+
+/* @brief	Decide whether to report a number
+ *
+ * Returns true if the sample should be sent.  The filter is not changed until the sample
+ * is committed with iotc_telemetry_filter_commit_number().
+ */
+bool iotc_telemetry_filter_number(IotcTelemetryFilter *filter, double value)
+{
+    bool changed;
+
+    if (filter == NULL) {
+        return true;
+    }
+
+    if (!filter->has_last) {
+        changed = true;
+    } else if (isnan(value) || isnan(filter->last.number)) {
+        changed = isnan(value) != isnan(filter->last.number);
+    } else {
+        double delta = fabs(value - filter->last.number);
+
+        switch (filter->rule.mode) {
+        case IOTC_FILTER_DEADBAND_ABSOLUTE:
+            changed = delta > filter->rule.deadband;
+            break;
+        case IOTC_FILTER_DEADBAND_RELATIVE:
+            changed = delta > filter->rule.deadband * fabs(filter->last.number);
+            break;
+        case IOTC_FILTER_ON_CHANGE:
+            changed = value != filter->last.number;
+            break;
+        default:
+            changed = true;
+            break;
+        }
+    }
+
+    return filter_result(filter, filter_interval_allows(filter, changed));
+}
+
+
+/*
+ *
+ */
+bool iotc_telemetry_filter_int(IotcTelemetryFilter *filter, int32_t value)
+{
+    return iotc_telemetry_filter_number(filter, (double) value);
+}
+
+
+/*
+ *
+ */
+bool iotc_telemetry_filter_bool(IotcTelemetryFilter *filter, bool value)
+{
+    bool changed;
+
+    if (filter == NULL) {
+        return true;
+    }
+
+    changed = !filter->has_last || filter->rule.mode == IOTC_FILTER_ALWAYS || value != filter->last.boolean;
+    return filter_result(filter, filter_interval_allows(filter, changed));
+}
+
+
+/* @brief	Decide whether to report a string. NULL is a value of its own.
+ */
+bool iotc_telemetry_filter_string(IotcTelemetryFilter *filter, const char *value)
+{
+    uint32_t hash;
+    size_t len;
+    bool changed;
+
+    if (filter == NULL) {
+        return true;
+    }
+
+    hash = string_hash(value, &len);
+    changed = !filter->has_last || filter->rule.mode == IOTC_FILTER_ALWAYS
+            || (value == NULL) != filter->last.string.is_null
+            || len != filter->last.string.len || hash != filter->last.string.hash;
+    return filter_result(filter, filter_interval_allows(filter, changed));
+}
+
+
+/* @brief	Make a number that was sent the last reported value
+ */
+void iotc_telemetry_filter_commit_number(IotcTelemetryFilter *filter, double value)
+{
+    if (filter) {
+        filter->last.number = value;
+        filter_mark_sent(filter);
+    }
+}
+
+
+/*
+ *
+ */
+void iotc_telemetry_filter_commit_int(IotcTelemetryFilter *filter, int32_t value)
+{
+    iotc_telemetry_filter_commit_number(filter, (double) value);
+}
+
+
+/*
+ *
+ */
+void iotc_telemetry_filter_commit_bool(IotcTelemetryFilter *filter, bool value)
+{
+    if (filter) {
+        filter->last.boolean = value;
+        filter_mark_sent(filter);
+    }
+}
+
+
+/*
+ *
+ */
+void iotc_telemetry_filter_commit_string(IotcTelemetryFilter *filter, const char *value)
+{
+    if (filter) {
+        filter->last.string.hash = string_hash(value, &filter->last.string.len);
+        filter->last.string.is_null = (value == NULL);
+        filter_mark_sent(filter);
+    }
+}
+
+
+/*
+ *
+ */
+void iotc_telemetry_filter_get_stats(const IotcTelemetryFilter *filter, IotcTelemetryFilterStats *stats)
+{
+    if (filter && stats) {
+        *stats = filter->stats;
+    }
+}
+
+
+/* @brief	Samples sent and suppressed by all filters together
+ */
+void iotc_telemetry_filter_get_totals(IotcTelemetryFilterStats *stats)
+{
+    if (stats) {
+        *stats = filter_totals;
+    }
+}
+
+
+/* @brief	Apply the reporting intervals to a sample
+ *
+ * A changed value is reported once min_interval has passed since the last report, an
+ * unchanged one only once max_interval has.  The first sample is always reported.
+ */
+static bool filter_interval_allows(const IotcTelemetryFilter *filter, bool changed)
+{
+    TickType_t elapsed = xTaskGetTickCount() - filter->last_sent_at;
+
+    if (filter->has_last) {
+        if (elapsed < filter->min_interval) {
+            return false;
+        }
+        if (!changed && (filter->max_interval == 0 || elapsed < filter->max_interval)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+/* @brief	Count a suppressed sample. Sent samples are counted when they are committed.
+ */
+static bool filter_result(IotcTelemetryFilter *filter, bool send)
+{
+    if (!send) {
+        filter->stats.suppressed++;
+        filter_totals.suppressed++;
+    }
+
+    return send;
+}
+
+
+/*
+ *
+ */
+static void filter_mark_sent(IotcTelemetryFilter *filter)
+{
+    filter->has_last = true;
+    filter->last_sent_at = xTaskGetTickCount();
+    filter->stats.sent++;
+    filter_totals.sent++;
+}
+
+
+/* @brief	FNV-1a hash and length of a string. NULL hashes like the empty string.
+ */
+static uint32_t string_hash(const char *value, size_t *len)
+{
+    uint32_t hash = 2166136261u;
+
+    *len = 0;
+    if (value) {
+        for (const char *p = value; *p; p++) {
+            hash = (hash ^ (uint8_t) *p) * 16777619u;
+            (*len)++;
+        }
+    }
+
+    return hash;
+}
@@ -53,6 +53,7 @@
 
 #include "iotconnect_config.h"
 #include "iotc_https_client.h"
+#include "iotc_telemetry_journal.h"
 
 
 /* Constants */
@@ -110,6 +111,8 @@ int iotconnect_sdk_init(IotConnectCustomMQTTConfig *custom_mqtt_config) {
     IOTCL_INFO("IOTC: CPID: %s***************************", cpid_buff);
     IOTCL_INFO("IOTC: ENV :  %s\r\n", config.env);
     IOTCL_INFO("IOTC: DUID:  %s\r\n", config.duid);
+    IOTCL_INFO("IOTC: Payload encoding: %s\r\n",
+            (iotconnect_sdk_get_payload_encoding() == IOTC_ENCODING_CBOR) ? "CBOR" : "JSON");
 
 	memset(&client_config, 0, sizeof(client_config));
 	client_config.cfg = &config;
@@ -120,8 +123,10 @@ int iotconnect_sdk_init(IotConnectCustomMQTTConfig *custom_mqtt_config) {
 	iotcl_cfg.device.duid = config.duid;
 	iotcl_cfg.device.instance_type = IOTCL_DCT_CUSTOM;
 	iotcl_cfg.mqtt_send_cb = iotc_device_client_mqtt_publish;
-	iotcl_cfg.events.cmd_cb = config.cmd_cb;
-	iotcl_cfg.events.ota_cb = config.ota_cb;
+	// C2D messages are decoded by iotc_c2d_process(), not by iotc-c-lib
+	iotcl_cfg.events.cmd_cb = NULL;
+	iotcl_cfg.events.ota_cb = NULL;
+	iotc_c2d_set_callbacks(config.cmd_cb, config.ota_cb);
 
 	IOTCL_INFO(" ***** MQTT send cb = %08x", (uintptr_t)iotcl_cfg.mqtt_send_cb);
 	
@@ -148,27 +153,21 @@ int iotconnect_sdk_init(IotConnectCustomMQTTConfig *custom_mqtt_config) {
 		IOTCL_INFO("IOTC: Discovery complete");
 
 		client_config.host = iotcl_mqtt_get_config()->host;
-		client_config.c2d_topic = iotcl_mqtt_get_config()->sub_c2d;
 
 	} else {
 		IOTCL_INFO("IOTC: Using custom config, skipping discovery");
 
-		char *custom_c2d_topic = malloc(
-				4 + strlen(iotcl_mqtt_get_config()->client_id) + 4 + 1);
-
-		if (custom_c2d_topic == NULL) {
-			IOTCL_ERROR(0, "Unable to allocate memory for custom c2d topic");
-			return -1;
-		}
-
-		strcpy(custom_c2d_topic, "iot/");
-		strcat(custom_c2d_topic, iotcl_mqtt_get_config()->client_id);
-		strcat(custom_c2d_topic, "/cmd");
-
 		client_config.host = custom_mqtt_config->host;
-		client_config.c2d_topic = custom_c2d_topic;
 	}
 
+	// Format every topic once; the c2d topic is built from the client id with a custom config
+	if (iotc_topics_init(custom_mqtt_config == NULL) != 0) {
+		IOTCL_ERROR(0, "IOTC: Failed to set up MQTT topics");
+		return -1;
+	}
+
+	client_config.c2d_topic = iotc_topic_get(IOTC_TOPIC_C2D)->name;
+
 	client_config.cfg->duid = iotcl_mqtt_get_config()->client_id;
 	client_config.auth = &config.auth_info;
 	client_config.status_cb = NULL;  // TODO: on_iotconnect_status;
@@ -182,6 +181,13 @@ int iotconnect_sdk_init(IotConnectCustomMQTTConfig *custom_mqtt_config) {
         IOTCL_ERROR(ret, "IOTC: Failed to connect to mqtt server");
     	return ret;
     }
+
+#ifdef IOTCONFIG_ENABLE_TELEMETRY_JOURNAL
+    // Telemetry produced while offline is journaled and drained once reconnected
+    if (iotc_telemetry_journal_init(IOTC_TOPIC_RPT) != 0) {
+        IOTCL_WARN(0, "IOTC: Telemetry journal unavailable, offline telemetry will be lost");
+    }
+#endif
     return ret;
 }
 
@@ -194,6 +200,16 @@ void iotconnect_sdk_deinit(void) {
 }
 
 
+/* @brief	Encoding telemetry and acks are sent in
+ *
+ * Chosen per device with payload_encoding in the client config, which the application
+ * sets to what the device's template expects.  Defaults to IOTC_PAYLOAD_ENCODING.
+ */
+IotcPayloadEncoding iotconnect_sdk_get_payload_encoding(void) {
+	return (config.payload_encoding == IOTC_ENCODING_DEFAULT) ? IOTC_PAYLOAD_ENCODING : config.payload_encoding;
+}
+
+
 /* @brief	Send a discovery and identity HTTP Get request to populate config fields.
  *
  * SEE SOURCES    https://github.com/aws/aws-iot-device-sdk-embedded-C/blob/main/demos/http/http_demo_plaintext/http_demo_plaintext.c
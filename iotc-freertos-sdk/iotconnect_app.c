@@ -47,6 +47,11 @@
 #include "iotcl_log.h"
 #include "iotcl_telemetry.h"
 #include "iotcl_util.h"
+#include "iotc_telemetry_batch.h"
+#include "iotc_telemetry_filter.h"
+#include "iotc_telemetry_aggregate.h"
+#include "iotc_dtoa.h"
+#include "iotc_commands.h"
 
 #include <iotconnect_config.h>
 
@@ -58,17 +63,24 @@ static IotConnectCustomMQTTConfig custom_mqtt_config;
 
 static bool is_downloading = false;
 
-MessageBufferHandle_t iotcAppQueueTelemetry = NULL;
+_Static_assert(sizeof(exampleIotcTelemetry_t) <= IOTC_TELEMETRY_SAMPLE_MAX_LEN,
+        "exampleIotcTelemetry_t does not fit in a telemetry sample");
 
 // Prototypes
 static BaseType_t init_sensors( void );
-static void on_command(IotclC2dEventData data);
-static void on_ota(IotclC2dEventData data);
+static void register_commands(void);
+static void register_telemetry_filters_and_aggregates(void);
+static int on_ping(IotcCommandRequest *request);
+#ifdef IOTC_USE_LED
+static int on_led(IotcCommandRequest *request);
+static int on_led_freq(IotcCommandRequest *request);
+#endif
+static void on_ota(const IotcC2dEvent *event);
 static bool is_ota_agent_file_initialized(void);
 static int split_url(const char *url, char **host_name, char**resource);
 static bool is_app_version_same_as_ota(const char *version);
 static bool app_needs_ota_update(const char *version);
-static int start_ota(char *url);
+static int start_ota(const char *url);
 
 
 /* @brief	Main IoT-Connect application task
@@ -95,11 +107,8 @@ void iotconnect_app( void * )
 		vTaskDelete(NULL);
     }
 
-    iotcAppQueueTelemetry = xMessageBufferCreate(IOTC_APP_QUEUE_SIZE_TELEMETRY * sizeof(void *));
-	if (iotcAppQueueTelemetry == NULL) {
-		LogError("Failed to create iotcAppQueueTelemetry");
-		vTaskDelete( NULL );
-	}
+    // This task receives the samples sensor tasks submit
+    iotc_telemetry_submit_init(NULL);
 
     // IoT-Connect configuration setup
     ( void ) xEventGroupWaitBits( xSystemEvents,
@@ -108,11 +117,13 @@ void iotconnect_app( void * )
                                   pdTRUE,
                                   portMAX_DELAY );
 
+    register_commands();
+
     IotConnectClientConfig *config = iotconnect_sdk_init_and_get_config();
     config->cpid = cpid;
     config->env = iotc_env;
     config->duid = device_id;
-    config->cmd_cb = on_command;
+    config->cmd_cb = iotc_command_dispatch;
 
 #ifdef IOTCONFIG_ENABLE_OTA
     config->ota_cb = on_ota;
@@ -121,6 +132,8 @@ void iotconnect_app( void * )
 #endif
 
     config->status_cb = NULL;
+    // Set to IOTC_ENCODING_CBOR for templates that take CBOR telemetry and acks
+    config->payload_encoding = IOTC_ENCODING_DEFAULT;
     config->auth_info.type = IOTC_X509;
 
     if (strcmp(platform, "aws") == 0) {
@@ -151,136 +164,202 @@ void iotconnect_app( void * )
     iotconnect_sdk_init(&custom_mqtt_config);
 #endif
 
+    iotc_telemetry_batch_init(NULL);
+    register_telemetry_filters_and_aggregates();
+
+#ifdef IOTC_ENABLE_BENCHMARKS
+    iotc_telemetry_encoder_benchmark(100);
+    iotc_dtoa_benchmark(100);
+    iotc_telemetry_aggregate_benchmark(1000);
+#endif
+
     while (1) {
-        size_t n;
-#define IOTC_TELEMETRY_MSG_SIZ (128)
-        void *telemetryData[IOTC_TELEMETRY_MSG_SIZ];
-
-        n = xMessageBufferReceive(iotcAppQueueTelemetry, &telemetryData, IOTC_TELEMETRY_MSG_SIZ, 0xffffffffUL);
-        if (n == 0) {
-			IOTCL_ERROR(n, "[%s] Q recv error \r\n", __func__);
-            break;
+        TickType_t wait = iotc_telemetry_batch_ticks_until_flush();
+        IotcTelemetrySample sample;
+
+        // Wake up no later than when the open telemetry batch or an aggregate window is due to be sent
+        if (iotc_telemetry_aggregate_ticks_until_emit() < wait) {
+            wait = iotc_telemetry_aggregate_ticks_until_emit();
+        }
+        if (iotc_telemetry_receive(&sample, wait) && sample.type == IOTC_APP_SAMPLE_EXAMPLE) {
+            iotcApp_create_and_send_telemetry_json(sample.data.bytes, sample.len);
         }
 
-        iotcApp_create_and_send_telemetry_json(&telemetryData, n);
+        iotc_telemetry_aggregate_poll();
+        iotc_telemetry_batch_poll();
         //vTaskDelay( pdMS_TO_TICKS( MQTT_PUBLISH_PERIOD_MS ) );
     }
 }
 
-typedef struct EXAMPLE_IOTC_TELEMETRY {
-	double doubleValue;
-	bool boolValue;
-	const char *strValue;
-}exampleIotcTelemetry_t;
+IOTC_TELEMETRY_FILTERED_SERIALIZER(example_telemetry_encode, exampleIotcTelemetry_t, EXAMPLE_TELEMETRY_FIELDS)
+
+// Report the example values when they change, and at least once a minute
+static const IotcTelemetryFilterRule telemetry_filter_rules[] = {
+    { .name = "double_value", .mode = IOTC_FILTER_DEADBAND_ABSOLUTE, .deadband = 0.5, .max_interval_ms = 60000 },
+    { .name = "bool_value", .mode = IOTC_FILTER_ON_CHANGE, .max_interval_ms = 60000 },
+    { .name = "string_value", .mode = IOTC_FILTER_ON_CHANGE, .max_interval_ms = 60000 },
+};
+
+static example_telemetry_encode_filters_t telemetry_filters;
+
+// Every sample of double_value is also summarised once a minute
+static const IotcTelemetryAggregateRule double_value_aggregate_rule = {
+    .name = "double_value",
+    .window_ms = 60000,
+    .statistics = IOTC_AGGREGATE_ALL,
+};
 
-/* @brief 	Create JSON message containing telemetry data to publish
+static IotcTelemetryAggregate *double_value_aggregate;
+
+/* @brief 	Add telemetry data to the current batch
  *
+ * The record is sent with others in one message by the telemetry batch. See iotc_telemetry_batch.h
  */
 __weak void iotcApp_create_and_send_telemetry_json(
 		const void *pToTelemetryStruct, size_t siz) {
 
-    const struct EXAMPLE_IOTC_TELEMETRY * p = NULL;
-    IotclMessageHandle msg = iotcl_telemetry_create();
+    const exampleIotcTelemetry_t *p = pToTelemetryStruct;
+    example_telemetry_encode_selection_t selection;
+    IotcBatchRecordStatus status;
+    IotcTelemetryEncoder *msg;
 
-    if(siz != sizeof(const struct EXAMPLE_IOTC_TELEMETRY)) {
+    if (p == NULL || siz != sizeof(exampleIotcTelemetry_t)) {
         IOTCL_ERROR(siz, "Expected telemetry size does not match");
         return;
     }
 
-    // Optional. The first time you create a data poiF\Z\nt, the current timestamp will be automatically added
-    // TelemetryAddWith* calls are only required if sending multiple data points in one packet.
-	// FIXME: new iotc-c-lib has new API for adding timestamps
-	// iotcl_telemetry_add_with_iso_time(msg, NULL);
+    // Aggregated before filtering, so the summary covers every sample
+    iotc_telemetry_aggregate_sample(double_value_aggregate, p->double_value);
+
+    // Nothing changed enough to be worth sending
+    if (!example_telemetry_encode_select(&telemetry_filters, p, &selection)) {
+        return;
+    }
 
-    iotcl_telemetry_set_number(msg, "double_value", p->doubleValue);
-    iotcl_telemetry_set_bool(msg, "bool_value", p->boolValue);
-    iotcl_telemetry_set_string(msg, "string_value", p->strValue);
+    // Each record in a batch gets its own timestamp and is encoded straight into the batch's publish buffer.
+    // A record that did not fit after the ones already batched is encoded again into a fresh batch.
+    do {
+        msg = iotc_telemetry_batch_add_record();
+        if (msg == NULL) {
+            return;
+        }
 
-    iotcl_telemetry_set_string(msg, "version", APP_VERSION);
+        example_telemetry_encode(msg, p, &selection);
+        iotc_telemetry_set_string(msg, "version", APP_VERSION);
+    } while ((status = iotc_telemetry_batch_commit_record()) == IOTC_BATCH_RECORD_RETRY);
 
-    iotcl_mqtt_send_telemetry(msg, true);
-    iotcl_telemetry_destroy(msg);
+    // Only a record that made it into a batch moves the filters on
+    if (status == IOTC_BATCH_RECORD_COMMITTED) {
+        example_telemetry_encode_commit(&telemetry_filters, p, &selection);
+    }
 }
 
-__weak int iotc_process_cmd_str(IotclC2dEventData data, char* command){
-    LogInfo("Received command: %s", command);
-
-    if(NULL != strcasestr(command, IOTC_CMD_PING)){
-        LogInfo("Ping Command Received!\n");
 #ifdef IOTC_USE_LED
-    } else if(NULL != strcasestr(command, IOTC_CMD_LED_RED)){
-        if (NULL != strcasestr(command, "on")) {
-            LogInfo("led-red on");
-            //BSP_LED_On(LED_RED);
-            set_led_red(true);
-        } else if (NULL != strcasestr(command, "off")) {
-            LogInfo("led-red off");
-            set_led_red(false);
-        } else {
-            LogWarn("Invalid led-red command received: %s", command);
-        }
-        // TODO: command_status(data, true, command, "OK");
-    } else if(NULL != strcasestr(command, IOTC_CMD_LED_GREEN)) {
-        if (NULL != strcasestr(command, "on")) {
-            LogInfo("led-green on");
-            set_led_green(true);
-        } else if (NULL != strcasestr(command, "off")) {
-            LogInfo("led-green off");
-            set_led_green(false);
-        } else {
-            LogWarn("Invalid led-green command received: %s", command);
-        }
-        // TODO: command_status(data, true, command, "OK");
-    } else if(NULL != strcasestr(command, IOTC_CMD_LED_FREQ)) {
-        // Get the int following the command
-        int led_freq = atoi(command + strlen(IOTC_CMD_LED_FREQ) + 1);
-        if (0 != led_freq){
-            set_led_freq(led_freq);
-        }
+// Command contexts are object pointers, so each LED's setter is passed wrapped in a struct
+typedef struct {
+    void (*set_led)(bool on);
+} LedControl;
+
+static LedControl led_red_control = { .set_led = set_led_red };
+static LedControl led_green_control = { .set_led = set_led_green };
+
+static const IotcCommandDesc led_red_command = {
+    .name = IOTC_CMD_LED_RED,
+    .handler = on_led,
+    .parse_args = iotc_command_parse_on_off,
+    .concurrency = IOTC_CMD_CONCURRENCY_INLINE,
+    .context = &led_red_control,
+};
+
+static const IotcCommandDesc led_green_command = {
+    .name = IOTC_CMD_LED_GREEN,
+    .handler = on_led,
+    .parse_args = iotc_command_parse_on_off,
+    .concurrency = IOTC_CMD_CONCURRENCY_INLINE,
+    .context = &led_green_control,
+};
+
+static const IotcCommandDesc led_freq_command = {
+    .name = IOTC_CMD_LED_FREQ,
+    .handler = on_led_freq,
+    .parse_args = iotc_command_parse_int,
+};
 #endif // IOTC_USE_LED
-    } else {
-        LogInfo("Command not recognized: %s", command);
-        // TODO: command_status(data, false, command, "Not implemented");
+
+static const IotcCommandDesc ping_command = {
+    .name = IOTC_CMD_PING,
+    .handler = on_ping,
+    .concurrency = IOTC_CMD_CONCURRENCY_INLINE,
+};
+
+
+/* @brief	Register the cloud-to-device commands this application handles
+ *
+ * Add application commands here with iotc_register_command().
+ */
+static void register_commands(void) {
+    iotc_register_command(&ping_command);
+#ifdef IOTC_USE_LED
+    iotc_register_command(&led_red_command);
+    iotc_register_command(&led_green_command);
+    iotc_register_command(&led_freq_command);
+#endif
+}
+
+/*
+ *
+ */
+static void register_telemetry_filters_and_aggregates(void) {
+    for (size_t i = 0; i < sizeof(telemetry_filter_rules) / sizeof(telemetry_filter_rules[0]); i++) {
+        iotc_telemetry_filter_add(&telemetry_filter_rules[i]);
     }
+    example_telemetry_encode_bind_filters(&telemetry_filters);
+
+    double_value_aggregate = iotc_telemetry_aggregate_add(&double_value_aggregate_rule);
+}
+
+/*
+ *
+ */
+static int on_ping(IotcCommandRequest *request) {
+    (void) request;
+    LogInfo("Ping Command Received!\n");
     return 0;
 }
 
-/* @brief	Callback when a a cloud-to-device command is received on the subscribed MQTT topic
+#ifdef IOTC_USE_LED
+/* @brief	Handler for led-red and led-green, the context is the LED setter
  */
-static void on_command(IotclC2dEventData data) {
-    const char *command = iotcl_c2d_get_command(data);
-    const char *ack_id = iotcl_c2d_get_ack_id(data);
-    int err;
-
-    if (command) {
-        IOTCL_INFO("Command %s received with %s ACK ID\n", command,
-                        ack_id ? ack_id : "no");
-
-        err = iotc_process_cmd_str(data, command);
-
-        if(ack_id) {
-			if(!err)
-				iotcl_mqtt_send_cmd_ack(ack_id, IOTCL_C2D_EVT_CMD_FAILED,
-						"Command error");
-			else
-				iotcl_mqtt_send_cmd_ack(ack_id, IOTCL_C2D_EVT_CMD_SUCCESS_WITH_ACK,
-						"Command OK");
-        }
-    } else {
-        IOTCL_ERROR(0, "No command, internal error");
-        // could be a command without acknowledgement, so ackID can be null
-        if (ack_id) {
-            iotcl_mqtt_send_cmd_ack(ack_id, IOTCL_C2D_EVT_CMD_FAILED,
-                                    "Internal error");
-        }
+static int on_led(IotcCommandRequest *request) {
+    const LedControl *led = request->context;
+    bool on = *(const bool *) request->parsed_args;
+
+    LogInfo("%s %s", request->name, on ? "on" : "off");
+    led->set_led(on);
+    return 0;
+}
+
+/*
+ *
+ */
+static int on_led_freq(IotcCommandRequest *request) {
+    int led_freq = *(const int *) request->parsed_args;
+
+    if (led_freq <= 0) {
+        request->ack_message = "Invalid frequency";
+        return -1;
     }
+
+    set_led_freq(led_freq);
+    return 0;
 }
+#endif // IOTC_USE_LED
 
 #ifdef IOTCONFIG_ENABLE_OTA
-static void on_ota(IotclC2dEventData data) {
+static void on_ota(const IotcC2dEvent *event) {
 	const char *message = NULL;
-	const char *url = iotcl_c2d_get_ota_url(data, 0);
-	const char *ack_id = iotcl_c2d_get_ack_id(data);
+	const char *url = iotc_c2d_get_ota_url(event, 0).str;
+	const char *ack_id = iotc_c2d_get_ack_id(event).str;
     bool success = false;
     int needs_ota_commit = false;
 
@@ -288,7 +367,7 @@ static void on_ota(IotclC2dEventData data) {
 
     if (NULL != url) {
     	LogInfo("Download URL is: %s\r\n", url);
-		const char *version = iotcl_c2d_get_ota_sw_version(data);
+		const char *version = iotc_c2d_get_ota_sw_version(event).str;
         if (!version) {
             success = true;
             message = "Failed to parse message";
@@ -316,15 +395,12 @@ static void on_ota(IotclC2dEventData data) {
 
             is_downloading = false; // we should reset soon
         }
-
-        free((void*) url);
-        free((void*) version);
     } else {
         IOTCL_ERROR(0, "OTA has no URL");
         success = false;
     }
 
-    iotcl_mqtt_send_ota_ack(ack_id,
+    iotc_c2d_send_ota_ack(ack_id,
             (success ?
                         0 :
                         IOTCL_C2D_EVT_OTA_DOWNLOAD_FAILED), message);
@@ -386,7 +462,7 @@ static int split_url(const char *url, char **host_name, char**resource) {
     return -4; // URL could not be parsed
 }
 
-static int start_ota(char *url)
+static int start_ota(const char *url)
 {
     char *host_name;
     char *resource;